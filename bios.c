@@ -94,6 +94,9 @@ static volatile sig_atomic_t PIC_active;
 /* Bit vector denoting halted cores */
 static _Atomic uint32_t halt_vector;
 
+/* Bit vector denoting parked cores */
+static _Atomic uint32_t park_vector;
+
 /* PIC thread id */
 static pthread_t PIC_thread;
 
@@ -370,6 +373,13 @@ static TimerDuration get_coarse_time()
 	return curtime.tv_nsec / 1000ul + curtime.tv_sec*1000000ull;
 }
 
+/* High-resolution clock */
+static TimerDuration get_hires_time()
+{
+	struct timespec curtime;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &curtime));
+	return curtime.tv_nsec / 1000ul + curtime.tv_sec*1000000ull;
+}
 
 
 /*
@@ -899,8 +909,9 @@ void vm_run(vm_config* vmc)
 	pthread_barrier_init(& system_barrier, NULL, ncores+1);
 	pthread_barrier_init(& core_barrier, NULL, ncores);
 
-	/* Initialize the halted vector */
+	/* Initialize the halted and parked vectors */
 	halt_vector = 0;
+	park_vector = 0;
 
 	/* Launch the core threads */
 	for(uint c=0; c < ncores; c++) {
@@ -992,6 +1003,11 @@ uint cpu_cores()
 	return ncores;
 }
 
+uint cpu_physical_cores()
+{
+	return physical_cores;
+}
+
 
 
 void cpu_core_halt()
@@ -1060,17 +1076,66 @@ void cpu_core_restart(uint c)
 }
 
 
+uint cpu_cores_running()
+{
+	return ncores - __builtin_popcount(halt_vector);
+}
+
+
+int cpu_core_halted(uint c)
+{
+	assert(c < ncores);
+	return (halt_vector & (1u << c)) != 0;
+}
+
+
+/* 
+	The number of halted cores that can be restarted, without running
+	more cores than the host has physical cores.
+ */
+static inline uint restartable_cores(uint32_t hv)
+{
+	uint running = ncores - __builtin_popcount(hv);
+	return (running < physical_cores) ? physical_cores - running : 0;
+}
+
+
 void cpu_core_restart_one()
 {
-	/* Only restart if core_id < physical_cores */
+	cpu_core_restart_many(1);
+}
+
+uint cpu_core_restart_many(uint n)
+{
 	uint32_t hv = halt_vector;
+	uint count = 0;
+
+	if(n > restartable_cores(hv))
+		n = restartable_cores(hv);
+	hv &= ~park_vector;
 
-	if( (hv=halt_vector)!=0 ) {
+	while(hv != 0 && count < n) {
 		uint c = __builtin_ctz(hv);
-		if(c < physical_cores)
-			__core_restart(c);
+		count += __core_restart(c);
+		hv &= hv - 1;
 	}
+	return count;
+}
 
+int cpu_core_restart_preferred(uint c)
+{
+	uint32_t hv = halt_vector;
+
+	if(restartable_cores(hv) == 0)
+		return 0;
+	if(c < ncores && (hv & ~park_vector & (1u << c)) && __core_restart(c))
+		return 1;
+	return cpu_core_restart_many(1);
+}
+
+void cpu_core_park(uint32_t mask)
+{
+	park_vector = mask;
 }
 
 void cpu_core_restart_all()
@@ -1176,6 +1241,11 @@ TimerDuration bios_clock()
 	return get_coarse_time();
 }	
 
+TimerDuration bios_clock_hires()
+{
+	return get_hires_time();
+}
+
 
 
 uint bios_serial_ports()
@@ -302,6 +302,14 @@ extern _Thread_local uint cpu_core_id;
  */
 uint cpu_cores();
 
+/**
+	@brief Returns the number of physical cores of the host.
+
+	When the VM has more cores than this, the cores share the host cpus,
+	and a busy-waiting core takes cpu time away from the other cores.
+ */
+uint cpu_physical_cores();
+
 
 /**
 	@brief Barrier synchronization for all cores.
@@ -390,13 +398,61 @@ void cpu_core_halt();
 */
 void cpu_core_restart(uint c);
 
+/**
+	@brief Return the number of cores which are not halted.
+*/
+uint cpu_cores_running();
+
+/**
+	@brief Return non-zero if the given core is halted.
+*/
+int cpu_core_halted(uint c);
+
 /**
 	@brief Restart some halted core.
 
-	This call will restart some halted core, if at least one exists.
+	This call will restart the lowest halted core, if at least one exists,
+	and a physical core of the host is idle, i.e., fewer cores are running 
+	than @c cpu_physical_cores(). Otherwise, restarting a core would only 
+	take the host cpu away from a running core.
 */
 void cpu_core_restart_one();
 
+/**
+	@brief Restart up to @c n halted cores.
+
+	This is like calling @c cpu_core_restart_one() @c n times, but it
+	reads the set of halted cores once.
+
+	@param n the maximum number of cores to restart
+	@returns the number of cores restarted
+*/
+uint cpu_core_restart_many(uint n);
+
+/**
+	@brief Restart a halted core, preferably the given one.
+
+	This is like @c cpu_core_restart_one(), but core @c c is restarted
+	if it is halted.
+
+	@param c the preferred core
+	@returns 1 if a core was restarted, 0 otherwise
+*/
+int cpu_core_restart_preferred(uint c);
+
+/**
+	@brief Set the parked cores.
+
+	A parked core is not restarted by @c cpu_core_restart_one(), 
+	@c cpu_core_restart_many() and @c cpu_core_restart_preferred(), so 
+	that it stays halted while the other cores can take the work. It is 
+	still restarted by @c cpu_core_restart(), @c cpu_core_restart_all()
+	and by interrupts, e.g., @c cpu_ici(). Initially, no core is parked.
+
+	@param mask the parked cores, one bit per core
+*/
+void cpu_core_park(uint32_t mask);
+
 /**
 	@brief Signal all halted cores to restart.
 
@@ -483,6 +539,17 @@ TimerDuration bios_cancel_timer();
  */
 TimerDuration bios_clock();
 
+/**
+	@brief Get the current time from a high-resolution clock.
+
+	This function returns a monotonic clock value, in usec, with
+	a resolution of about 1 usec. Unlike @c bios_clock(), it is
+	suitable for measuring short intervals, such as the run time
+	of a time-slice. Its value is not related to @c bios_clock().
+
+	@see bios_clock
+ */
+TimerDuration bios_clock_hires();
 
 
 
@@ -0,0 +1,603 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "util.h"
+#include "bios.h"
+
+
+/*
+	A microbenchmark suite for the virtual machine of bios.c.
+
+	The programs bios_example*.c demonstrate the BIOS API; this program
+	measures it. Each benchmark is repeated a number of times (after
+	some warmup rounds) and the samples are reduced to a few statistics
+	(mean, standard deviation, median, extremes and the 95% confidence
+	interval of the mean). The results are printed as a table and/or as
+	JSON, so that changes to bios.c can be judged by numbers.
+
+	The VM is booted with 2 cores and 1 serial port. The serial port is
+	not connected to a terminal; instead, two host threads feed the
+	keyboard side and drain the console side through plain pipes.
+
+	All times are measured with the host's CLOCK_MONOTONIC.
+
+	Usage:  ./bios_bench [-r <reps>] [-t | -j] [<benchmark> ...]
+ */
+
+
+/* Number of cores used by the benchmark VM */
+#define BENCH_CORES 2
+
+/* Default number of repetitions per benchmark */
+#define DEFAULT_REPS 30
+
+/* Warmup rounds, which are discarded */
+#define WARMUP 3
+
+/* Maximum number of repetitions */
+#define MAX_REPS 10000
+
+/* Number of context swaps per sample */
+#define SWAP_BATCH 20000
+
+/* Number of single-byte serial writes per sample */
+#define SERIAL_BYTE_BATCH 256
+
+/* Number of bytes per bulk serial transfer sample */
+#define SERIAL_BULK_SIZE (1 << 18)
+
+/* How long to wait for an event before giving up on a sample (nsec) */
+#define EVENT_TIMEOUT 100000000ll
+
+
+
+/* Host-side monotonic clock, in nanoseconds */
+static inline int64_t now_nsec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ll + ts.tv_nsec;
+}
+
+/* Busy-wait for (about) the given time */
+static void spin_nsec(int64_t nsec)
+{
+	int64_t t0 = now_nsec();
+	while(now_nsec()-t0 < nsec);
+}
+
+
+
+/*********************************************
+
+	Samples and statistics
+
+ *********************************************/
+
+typedef struct bench_result
+{
+	const char* name;      /* benchmark name */
+	const char* unit;      /* unit of the samples */
+	size_t n;              /* number of samples */
+	size_t lost;           /* samples discarded (e.g., on timeout) */
+	double mean, stddev, median, min, max, p95, ci95;
+} bench_result;
+
+
+static int cmp_double(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x<y) ? -1 : (x>y) ? 1 : 0;
+}
+
+
+/*
+	Reduce the samples to statistics. The samples array is sorted
+	in the process.
+ */
+static void compute_stats(bench_result* res, double* samples, size_t n)
+{
+	res->n = n;
+	if(n==0) {
+		res->mean = res->stddev = res->median = res->min = res->max = res->p95 = res->ci95 = NAN;
+		return;
+	}
+
+	qsort(samples, n, sizeof(double), cmp_double);
+
+	double sum = 0.0;
+	for(size_t i=0; i<n; i++) sum += samples[i];
+	res->mean = sum / n;
+
+	double ssq = 0.0;
+	for(size_t i=0; i<n; i++) ssq += (samples[i]-res->mean)*(samples[i]-res->mean);
+	res->stddev = (n>1) ? sqrt(ssq/(n-1)) : 0.0;
+
+	res->median = (n&1) ? samples[n/2] : 0.5*(samples[n/2-1]+samples[n/2]);
+	res->min = samples[0];
+	res->max = samples[n-1];
+	res->p95 = samples[(size_t)ceil(0.95*n)-1];
+
+	/* Normal approximation of the 95% confidence interval of the mean */
+	res->ci95 = 1.96 * res->stddev / sqrt((double)n);
+}
+
+
+
+/*********************************************
+
+	Benchmark state shared between the cores
+
+ *********************************************/
+
+static unsigned int reps = DEFAULT_REPS;
+
+/* Samples of the current benchmark, filled by core 0 */
+static double samples[MAX_REPS];
+static size_t nsamples, nlost;
+
+/* Events exchanged between the cores (and interrupt handlers) */
+static volatile int partner_done;
+static volatile int ici_pong;
+static volatile int halting, woke;
+static volatile int64_t wake_time;
+static volatile int timer_fired;
+static volatile int64_t fire_time;
+
+
+/* Record a sample, unless we are still warming up */
+static inline void add_sample(unsigned int round, double value)
+{
+	if(round >= WARMUP) samples[nsamples++] = value;
+}
+
+
+
+/*
+	Context swap cost.
+
+	Core 0 swaps back and forth between its boot context and a
+	second context, which does nothing but swap back.
+ */
+static cpu_context_t main_ctx, ping_ctx;
+
+static void ping_func()
+{
+	while(1) cpu_swap_context(&ping_ctx, &main_ctx);
+}
+
+static void bench_swap_context()
+{
+	if(cpu_core_id!=0) return;
+
+	const size_t stack_size = 64*1024;
+	void* stack = xmalloc(stack_size);
+	cpu_initialize_context(&ping_ctx, stack, stack_size, ping_func);
+
+	for(unsigned int r=0; r<reps+WARMUP; r++) {
+		int64_t t0 = now_nsec();
+		for(int i=0; i<SWAP_BATCH; i++)
+			cpu_swap_context(&main_ctx, &ping_ctx);
+		int64_t t1 = now_nsec();
+
+		/* Each iteration does two swaps */
+		add_sample(r, (double)(t1-t0) / (2*SWAP_BATCH));
+	}
+
+	free(stack);
+}
+
+
+/*
+	ICI round-trip latency.
+
+	Core 0 sends an ICI to core 1, whose handler sends an ICI back.
+	Core 1 spins (with interrupts enabled) while the benchmark runs, so
+	that halt/restart cost is not included.
+ */
+static void ici_ping_handler() { ici_pong = 1; }
+static void ici_pong_handler() { cpu_ici(0); }
+
+static void bench_ici_roundtrip()
+{
+	if(cpu_core_id==1) {
+		cpu_interrupt_handler(ICI, ici_pong_handler);
+		while(! partner_done);
+		cpu_interrupt_handler(ICI, NULL);
+		return;
+	}
+	if(cpu_core_id!=0) return;
+
+	cpu_interrupt_handler(ICI, ici_ping_handler);
+
+	for(unsigned int r=0; r<reps+WARMUP; r++) {
+		ici_pong = 0;
+		int64_t t0 = now_nsec();
+		cpu_ici(1);
+		while(!ici_pong && now_nsec()-t0 < EVENT_TIMEOUT);
+		int64_t t1 = now_nsec();
+
+		if(ici_pong) add_sample(r, (t1-t0)*1E-3);
+		else nlost++;
+	}
+
+	cpu_interrupt_handler(ICI, NULL);
+	partner_done = 1;
+}
+
+
+/*
+	Halt/restart wakeup latency.
+
+	Core 1 halts; core 0 restarts it and measures the time until core 1
+	runs again. If the restart raced with the halt (i.e., core 1 had not
+	yet been marked as halted), the restart is repeated and the sample
+	is discarded.
+ */
+static void bench_halt_restart()
+{
+	if(cpu_core_id==1) {
+		while(! partner_done) {
+			halting = 1;
+			cpu_core_halt();
+			wake_time = now_nsec();
+			halting = 0;
+			woke = 1;
+			while(woke && !partner_done);
+		}
+		return;
+	}
+	if(cpu_core_id!=0) return;
+
+	for(unsigned int r=0; r<reps+WARMUP; r++) {
+		while(! halting);
+		/* Give core 1 time to actually block */
+		spin_nsec(200000);
+
+		int64_t t0 = now_nsec();
+		cpu_core_restart(1);
+		while(!woke && now_nsec()-t0 < EVENT_TIMEOUT);
+
+		if(woke)
+			add_sample(r, (wake_time-t0)*1E-3);
+		else {
+			/* Lost the race with the halt, retry until core 1 wakes */
+			nlost++;
+			while(!woke) { cpu_core_restart(1); spin_nsec(1000000); }
+		}
+
+		if(r+1 == reps+WARMUP) partner_done = 1;
+		woke = 0;
+	}
+}
+
+
+/*
+	Timer accuracy and jitter.
+
+	Core 0 sets the timer and spins until the ALARM handler runs.
+	The sample is the difference between the observed and the requested
+	interval; the mean is the accuracy and the stddev is the jitter.
+ */
+static TimerDuration timer_interval;
+
+static void alarm_handler()
+{
+	fire_time = now_nsec();
+	timer_fired = 1;
+}
+
+static void bench_timer()
+{
+	if(cpu_core_id!=0) return;
+
+	cpu_interrupt_handler(ALARM, alarm_handler);
+
+	for(unsigned int r=0; r<reps+WARMUP; r++) {
+		timer_fired = 0;
+		int64_t t0 = now_nsec();
+		bios_set_timer(timer_interval);
+		while(!timer_fired && now_nsec()-t0 < EVENT_TIMEOUT + 1000ll*timer_interval);
+
+		if(timer_fired)
+			add_sample(r, (fire_time-t0)*1E-3 - (double)timer_interval);
+		else
+			nlost++;
+	}
+
+	bios_cancel_timer();
+	cpu_interrupt_handler(ALARM, NULL);
+}
+
+static void bench_timer_100us() { timer_interval = 100; bench_timer(); }
+static void bench_timer_1ms() { timer_interval = 1000; bench_timer(); }
+static void bench_timer_10ms() { timer_interval = 10000; bench_timer(); }
+
+
+/*
+	Serial port throughput.
+
+	The console side is drained by a host thread, and the keyboard side
+	is fed by another host thread, so the devices are (almost) always
+	ready. A failed transfer is simply retried.
+ */
+static inline void serial_put(char c) { while(! bios_write_serial(0, c)); }
+static inline char serial_get() { char c; while(! bios_read_serial(0, &c)); return c; }
+
+static void bench_serial_tx_byte()
+{
+	if(cpu_core_id!=0) return;
+
+	for(unsigned int r=0; r<reps+WARMUP; r++) {
+		int64_t t0 = now_nsec();
+		for(int i=0; i<SERIAL_BYTE_BATCH; i++)
+			serial_put('a'+(i%26));
+		int64_t t1 = now_nsec();
+		add_sample(r, (double)(t1-t0) / SERIAL_BYTE_BATCH);
+	}
+}
+
+static void bench_serial_tx_bulk()
+{
+	if(cpu_core_id!=0) return;
+
+	for(unsigned int r=0; r<reps+WARMUP; r++) {
+		int64_t t0 = now_nsec();
+		for(int i=0; i<SERIAL_BULK_SIZE; i++)
+			serial_put('a'+(i%26));
+		int64_t t1 = now_nsec();
+		add_sample(r, SERIAL_BULK_SIZE / ((t1-t0)*1E-9) / (1<<20));
+	}
+}
+
+static void bench_serial_rx_bulk()
+{
+	if(cpu_core_id!=0) return;
+
+	for(unsigned int r=0; r<reps+WARMUP; r++) {
+		int64_t t0 = now_nsec();
+		for(int i=0; i<SERIAL_BULK_SIZE; i++)
+			serial_get();
+		int64_t t1 = now_nsec();
+		add_sample(r, SERIAL_BULK_SIZE / ((t1-t0)*1E-9) / (1<<20));
+	}
+}
+
+
+
+/*********************************************
+
+	The benchmark table
+
+ *********************************************/
+
+typedef struct bench_def
+{
+	const char* name;
+	const char* unit;
+	void (*run)();
+	int selected;
+} bench_def;
+
+static bench_def BENCHMARKS[] = {
+	{ "swap_context", "ns/swap", bench_swap_context },
+	{ "ici_roundtrip", "usec", bench_ici_roundtrip },
+	{ "halt_restart", "usec", bench_halt_restart },
+	{ "timer_error_100us", "usec", bench_timer_100us },
+	{ "timer_error_1ms", "usec", bench_timer_1ms },
+	{ "timer_error_10ms", "usec", bench_timer_10ms },
+	{ "serial_tx_byte", "ns/byte", bench_serial_tx_byte },
+	{ "serial_tx_bulk", "MiB/s", bench_serial_tx_bulk },
+	{ "serial_rx_bulk", "MiB/s", bench_serial_rx_bulk },
+	{ NULL, NULL, NULL }
+};
+
+#define NBENCH (sizeof(BENCHMARKS)/sizeof(bench_def) - 1)
+
+static bench_result results[NBENCH];
+
+
+/* Executed by every core of the VM */
+static void bootfunc()
+{
+	for(size_t b=0; b<NBENCH; b++) {
+		if(! BENCHMARKS[b].selected) continue;
+
+		if(cpu_core_id==0) {
+			nsamples = nlost = 0;
+			partner_done = 0;
+			halting = woke = 0;
+		}
+		cpu_core_barrier_sync();
+
+		BENCHMARKS[b].run();
+		cpu_core_barrier_sync();
+
+		if(cpu_core_id==0) {
+			results[b].name = BENCHMARKS[b].name;
+			results[b].unit = BENCHMARKS[b].unit;
+			results[b].lost = nlost;
+			compute_stats(&results[b], samples, nsamples);
+		}
+	}
+}
+
+
+
+/*********************************************
+
+	Host threads for the serial port
+
+ *********************************************/
+
+/* Read everything from the console side until EOF */
+static void* console_drainer(void* arg)
+{
+	int fd = *(int*)arg;
+	char buf[65536];
+	while(read(fd, buf, sizeof(buf)) > 0);
+	return NULL;
+}
+
+/* Feed the keyboard side with enough data for the rx benchmark */
+static size_t kbd_bytes;
+static void* keyboard_feeder(void* arg)
+{
+	int fd = *(int*)arg;
+	char buf[65536];
+	memset(buf, 'k', sizeof(buf));
+
+	size_t left = kbd_bytes;
+	while(left > 0) {
+		ssize_t rc = write(fd, buf, left < sizeof(buf) ? left : sizeof(buf));
+		if(rc == -1) {
+			if(errno == EINTR) continue;
+			break;    /* EPIPE: the VM has closed the keyboard */
+		}
+		left -= rc;
+	}
+	return NULL;
+}
+
+
+
+/*********************************************
+
+	Reporting
+
+ *********************************************/
+
+static void print_table(FILE* out)
+{
+	fprintf(out, "%-20s %-8s %5s %12s %12s %12s %12s %12s %12s %12s\n",
+		"benchmark", "unit", "n", "mean", "stddev", "median", "min", "max", "p95", "ci95");
+	for(size_t b=0; b<NBENCH; b++) {
+		if(! BENCHMARKS[b].selected) continue;
+		bench_result* r = &results[b];
+		fprintf(out, "%-20s %-8s %5zu %12.3f %12.3f %12.3f %12.3f %12.3f %12.3f %12.3f",
+			r->name, r->unit, r->n, r->mean, r->stddev, r->median, r->min, r->max, r->p95, r->ci95);
+		if(r->lost) fprintf(out, "  (%zu lost)", r->lost);
+		fprintf(out, "\n");
+	}
+}
+
+/* JSON has no NaN, use null instead */
+static void json_number(FILE* out, const char* key, double value, const char* sep)
+{
+	if(isnan(value)) fprintf(out, "\"%s\": null%s", key, sep);
+	else fprintf(out, "\"%s\": %.6f%s", key, value, sep);
+}
+
+static void print_json(FILE* out)
+{
+	fprintf(out, "{\n  \"config\": { \"cores\": %d, \"host_cpus\": %ld, \"reps\": %u, \"warmup\": %d },\n",
+		BENCH_CORES, sysconf(_SC_NPROCESSORS_ONLN), reps, WARMUP);
+	fprintf(out, "  \"benchmarks\": [");
+	const char* sep = "\n";
+	for(size_t b=0; b<NBENCH; b++) {
+		if(! BENCHMARKS[b].selected) continue;
+		bench_result* r = &results[b];
+		fprintf(out, "%s    { \"name\": \"%s\", \"unit\": \"%s\", \"n\": %zu, \"lost\": %zu, ",
+			sep, r->name, r->unit, r->n, r->lost);
+		json_number(out, "mean", r->mean, ", ");
+		json_number(out, "stddev", r->stddev, ", ");
+		json_number(out, "median", r->median, ", ");
+		json_number(out, "min", r->min, ", ");
+		json_number(out, "max", r->max, ", ");
+		json_number(out, "p95", r->p95, ", ");
+		json_number(out, "ci95", r->ci95, " }");
+		sep = ",\n";
+	}
+	fprintf(out, "\n  ]\n}\n");
+}
+
+
+
+/*********************************************
+
+	Main program
+
+ *********************************************/
+
+static void usage(const char* pname)
+{
+	fprintf(stderr, "usage:\n  %s [-r <reps>] [-t | -j] [<benchmark> ...]\n\n\
+    -r <reps>   number of samples per benchmark (default %d, max %d)\n\
+    -t          print only the table\n\
+    -j          print only the JSON\n\n\
+  benchmarks:", pname, DEFAULT_REPS, MAX_REPS);
+	for(size_t b=0; b<NBENCH; b++) fprintf(stderr, " %s", BENCHMARKS[b].name);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+	int table = 1, json = 1;
+	int opt;
+	while((opt = getopt(argc, argv, "r:tjh")) != -1) {
+		switch(opt) {
+		case 'r': reps = atoi(optarg); break;
+		case 't': json = 0; break;
+		case 'j': table = 0; break;
+		default: usage(argv[0]);
+		}
+	}
+	if(reps < 1 || reps > MAX_REPS || (!table && !json)) usage(argv[0]);
+
+	/* Select benchmarks */
+	for(size_t b=0; b<NBENCH; b++)
+		BENCHMARKS[b].selected = (optind == argc);
+	for(int a=optind; a<argc; a++) {
+		size_t b;
+		for(b=0; b<NBENCH; b++)
+			if(strcmp(argv[a], BENCHMARKS[b].name)==0) break;
+		if(b==NBENCH) usage(argv[0]);
+		BENCHMARKS[b].selected = 1;
+	}
+
+	/* Connect the serial port to pipes */
+	int con[2], kbd[2];
+	CHECK(pipe(con));
+	CHECK(pipe(kbd));
+	kbd_bytes = (size_t)(reps+WARMUP) * SERIAL_BULK_SIZE;
+
+	/* The host threads must not receive the VM's signals */
+	sigset_t all, saved;
+	sigfillset(&all);
+	CHECKRC(pthread_sigmask(SIG_BLOCK, &all, &saved));
+	pthread_t drainer, feeder;
+	CHECKRC(pthread_create(&drainer, NULL, console_drainer, &con[0]));
+	CHECKRC(pthread_create(&feeder, NULL, keyboard_feeder, &kbd[1]));
+	CHECKRC(pthread_sigmask(SIG_SETMASK, &saved, NULL));
+
+	vm_config vmc;
+	vmc.bootfunc = bootfunc;
+	vmc.cores = BENCH_CORES;
+	vmc.serialno = 1;
+	vmc.serial_in[0] = kbd[0];
+	vmc.serial_out[0] = con[1];
+
+	/* vm_run closes the VM side of the pipes when it finishes */
+	vm_run(&vmc);
+
+	CHECKRC(pthread_join(drainer, NULL));
+	CHECKRC(pthread_join(feeder, NULL));
+	close(con[0]);
+	close(kbd[1]);
+
+	if(table) print_table(stdout);
+	if(table && json) printf("\n");
+	if(json) print_json(stdout);
+
+	return 0;
+}
@@ -55,6 +55,12 @@ void Mutex_Lock(Mutex* lock)
 }
 
 
+int Mutex_TryLock(Mutex* lock)
+{
+  return ! __atomic_test_and_set(lock,__ATOMIC_ACQUIRE);
+}
+
+
 void Mutex_Unlock(Mutex* lock)
 {
   __atomic_clear(lock, __ATOMIC_RELEASE);
@@ -173,6 +179,47 @@ static inline void cv_signal(CondVar* cv)
 }
 
 
+/* The number of waiters woken up at once by cv_broadcast() */
+#define CV_BROADCAST_BATCH 64
+
+/**
+  @internal
+  Helper for Cond_Broadcast. The whole waiters' ring is detached 
+  from the condition variable, and the waiters are woken up in batches
+  with @c wakeup_many(). It leaves cv->waitset == NULL.
+
+  The waiters cannot leave cv_wait() (and their stack frames) while we
+  hold cv->waitset_lock, so the ring stays valid until we return.
+ */
+static inline void cv_broadcast(CondVar* cv)
+{
+	__cv_waiter* waiters[CV_BROADCAST_BATCH];
+	TCB* threads[CV_BROADCAST_BATCH];
+
+	if(cv->waitset == NULL) return;
+
+	/* Detach the ring */
+	rlnode* first = & ((__cv_waiter*) cv->waitset)->node;
+	rlnode* node = first;
+	cv->waitset = NULL;
+
+	do {
+		uint n = 0;
+		do {
+			waiters[n] = node->obj;
+			waiters[n]->removed = 1;
+			threads[n] = waiters[n]->thread;
+			n++;
+			node = node->next;
+		} while(node != first && n < CV_BROADCAST_BATCH);
+
+		wakeup_many(threads, n);
+		for(uint i = 0; i < n; i++)
+			if(threads[i] != NULL) waiters[i]->signalled = 1;
+	} while(node != first);
+}
+
+
 
 int Cond_Wait(Mutex* mutex, CondVar* cv)
 {
@@ -186,6 +233,44 @@ int Cond_TimedWait(Mutex* mutex, CondVar* cv, timeout_t timeout)
 }
 
 
+unsigned int RseqBegin(rseq_area* rs)
+{
+	rs->aborted = 0;
+	rs->in_cs = 1;
+	unsigned int core = rs->cpu_id;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	return core;
+}
+
+int RseqCommit(rseq_area* rs, uintptr_t* ptr, uintptr_t value)
+{
+	/* The kernel sets rs->aborted only at a context switch, and it does not 
+	   switch while we are committing */
+	rs->committing = 1;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	int ok = !rs->aborted;
+	if(ok)
+		*ptr = value;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	rs->committing = 0;
+	rs->in_cs = 0;
+
+	if(rs->deferred)
+		rseq_deferred_yield(rs);
+	return ok;
+}
+
+
+void Sleep(unsigned long usec)
+{
+	/* Only the timeout should wake us up, but make sure */
+	TimerDuration wakeup_time = bios_clock_hires() + usec;
+	TimerDuration now;
+	while((now = bios_clock_hires()) < wakeup_time)
+		sleep_releasing(STOPPED, NULL, SCHED_USER, wakeup_time - now);
+}
+
+
 void Cond_Signal(CondVar* cv)
 {
   Mutex_Lock(&(cv->waitset_lock));
@@ -197,7 +282,7 @@ void Cond_Signal(CondVar* cv)
 void Cond_Broadcast(CondVar* cv)
 {
   Mutex_Lock(&(cv->waitset_lock));
-  while(cv->waitset) cv_signal(cv);
+  cv_broadcast(cv);
   Mutex_Unlock(&(cv->waitset_lock));
 }
 
@@ -231,6 +316,9 @@ static int kernel_sem = 1;
 /* Semaphore condition */
 static CondVar kernel_sem_cv = COND_INIT;
 
+/* The thread that holds the kernel semaphore, or NULL */
+static TCB* volatile kernel_owner = NULL;
+
 void kernel_lock()
 {
 	Mutex_Lock(& kernel_mutex);
@@ -238,12 +326,14 @@ void kernel_lock()
 		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
 	}
 	kernel_sem--;
+	kernel_owner = cur_thread();
 	Mutex_Unlock(& kernel_mutex);
 }
 
 void kernel_unlock()
 {
 	Mutex_Lock(& kernel_mutex);
+	kernel_owner = NULL;
 	kernel_sem++;
 	Cond_Signal(&kernel_sem_cv);
 	Mutex_Unlock(& kernel_mutex);
@@ -254,6 +344,7 @@ int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause,
 {
 	/* Atomically release kernel semaphore */
 	Mutex_Lock(& kernel_mutex);
+	kernel_owner = NULL;
 	kernel_sem++;
 	Cond_Signal(&kernel_sem_cv);	
 
@@ -263,11 +354,17 @@ int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause,
 	while(kernel_sem<=0)
 		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
 	kernel_sem--;
+	kernel_owner = cur_thread();
 	Mutex_Unlock(& kernel_mutex);		
 
 	return ret;
 }
 
+int kernel_lock_held()
+{
+	return kernel_owner != NULL && kernel_owner == cur_thread();
+}
+
 void kernel_signal(CondVar* cv) 
 { 
 	Cond_Signal(cv); 
@@ -281,6 +378,7 @@ void kernel_broadcast(CondVar* cv)
 void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
 {
 	Mutex_Lock(& kernel_mutex);
+	kernel_owner = NULL;
 	kernel_sem++;
 	Cond_Signal(&kernel_sem_cv);
 	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
@@ -32,6 +32,17 @@
 
 
 
+/**
+	@brief Try to lock a mutex, without waiting.
+
+	This is used by the kernel where waiting for a mutex could 
+	deadlock, because other mutexes are already held in a different order.
+
+	@returns 1 if the mutex was locked by this call, 0 if it was already locked.
+ */
+int Mutex_TryLock(Mutex* lock);
+
+
 /*
  * Kernel preemption control.
  * These are wrappers for the kernel monitor.
@@ -47,6 +58,11 @@ void kernel_lock();
  */
 void kernel_unlock();
 
+/**
+	@brief Return true if the current thread holds the kernel lock.
+ */
+int kernel_lock_held();
+
 /**
 	@brief Wait on a condition variable using the kernel lock.
 	@returns 1 if signalled, 0 if not
@@ -53,8 +53,11 @@ void boot_tinyos_kernel()
 
   run_scheduler();
 
+  cpu_core_barrier_sync();
+
   if(cpu_core_id==0) {
-    /* Here, we could add cleanup after the scheduler has ended. */    
+    /* Cleanup after the scheduler has ended. */
+    finalize_scheduler();
   }
 }
 
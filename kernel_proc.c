@@ -1,7 +1,9 @@
 
 #include <assert.h>
+#include <string.h>
 #include "kernel_cc.h"
 #include "kernel_proc.h"
+#include "kernel_sched.h"
 #include "kernel_streams.h"
 
 
@@ -19,6 +21,9 @@
 PCB PT[MAX_PROC];
 unsigned int process_count;
 
+/* One more than the highest pid ever given to a process */
+static Pid_t pid_limit;
+
 PCB* get_pcb(Pid_t pid)
 {
   return PT[pid].pstate==FREE ? NULL : &PT[pid];
@@ -29,6 +34,18 @@ Pid_t get_pid(PCB* pcb)
   return pcb==NULL ? NOPROC : pcb-PT;
 }
 
+TCB* get_tcb(Tid_t tid)
+{
+  if(tid == NOTHREAD)
+    return cur_thread();
+
+  /* The tid is not dereferenced, since it may be stale */
+  for(Pid_t p=1; p<pid_limit; p++)
+    if(PT[p].pstate==ALIVE && PT[p].main_thread == (TCB*) tid)
+      return PT[p].main_thread;
+  return NULL;
+}
+
 /* Initialize a PCB */
 static inline void initialize_PCB(PCB* pcb)
 {
@@ -66,6 +83,7 @@ void initialize_processes()
   }
 
   process_count = 0;
+  pid_limit = 0;
 
   /* Execute a null "idle" process */
   if(Exec(NULL,0,NULL)!=0)
@@ -85,6 +103,8 @@ PCB* acquire_PCB()
     pcb->pstate = ALIVE;
     pcb_freelist = pcb_freelist->parent;
     process_count++;
+    if(get_pid(pcb) >= pid_limit)
+      pid_limit = get_pid(pcb) + 1;
   }
 
   return pcb;
@@ -126,9 +146,9 @@ void start_main_thread()
 
 
 /*
-	System call to create a new process.
+	Create a new process, whose main thread has the given stack size.
  */
-Pid_t sys_Exec(Task call, int argl, void* args)
+static Pid_t exec_process(Task call, int argl, void* args, size_t stack_size)
 {
   PCB *curproc, *newproc;
   
@@ -178,7 +198,16 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     the initialization of the PCB.
    */
   if(call != NULL) {
-    newproc->main_thread = spawn_thread(newproc, start_main_thread);
+    newproc->main_thread = spawn_thread_stack(newproc, start_main_thread, stack_size);
+
+    /* Inherit the affinity, nice value, class, gang and cpu group of the creator (there is none during boot) */
+    if(newproc->parent != NULL) {
+      newproc->main_thread->affinity = cur_thread()->affinity;
+      newproc->main_thread->batch = cur_thread()->batch;
+      newproc->main_thread->gang = cur_thread()->gang;
+      newproc->main_thread->cpu_group = cur_thread()->cpu_group;
+      set_thread_nice(newproc->main_thread, cur_thread()->nice);
+    }
     wakeup(newproc->main_thread);
   }
 
@@ -188,6 +217,24 @@ finish:
 }
 
 
+/*
+	System call to create a new process.
+ */
+Pid_t sys_Exec(Task call, int argl, void* args)
+{
+  return exec_process(call, argl, args, THREAD_STACK_SIZE);
+}
+
+
+/*
+	System call to create a new process with a given stack size.
+ */
+Pid_t sys_ExecStack(Task call, int argl, void* args, size_t stack_size)
+{
+  return exec_process(call, argl, args, (stack_size == 0) ? THREAD_STACK_SIZE : stack_size);
+}
+
+
 /* System call */
 Pid_t sys_GetPid()
 {
@@ -364,3 +411,73 @@ Fid_t sys_OpenInfo()
 	return NOFILE;
 }
 
+
+/*
+  The scheduler information stream. The records are copied when the 
+  stream is opened, and then read in sequence.
+ */
+typedef struct schedinfo_control_block {
+  size_t size;        /* The size of the records, in bytes */
+  size_t pos;         /* The read position, in bytes */
+  schedinfo rec[];    /* The records */
+} schedinfo_cb;
+
+static int schedinfo_read(void* this, char* buf, unsigned int size)
+{
+  schedinfo_cb* si = this;
+  size_t n = si->size - si->pos;
+  if(n > size) n = size;
+
+  memcpy(buf, (char*)si->rec + si->pos, n);
+  si->pos += n;
+  return n;
+}
+
+static int schedinfo_write(void* this, const char* buf, unsigned int size)
+{
+  return -1;
+}
+
+static int schedinfo_close(void* this)
+{
+  free(this);
+  return 0;
+}
+
+static file_ops schedinfo_fops = {
+  .Open = NULL,
+  .Read = schedinfo_read,
+  .Write = schedinfo_write,
+  .Close = schedinfo_close
+};
+
+Fid_t sys_OpenSchedInfo()
+{
+  Fid_t fid;
+  FCB* fcb;
+
+  if(! FCB_reserve(1, &fid, &fcb))
+    return NOFILE;
+
+  /* A record for each core, and for each live process with a main thread */
+  uint ncores = cpu_cores();
+  uint nrec = ncores;
+  for(Pid_t p=0; p<MAX_PROC; p++)
+    if(PT[p].pstate==ALIVE && PT[p].main_thread != NULL)
+      nrec++;
+
+  schedinfo_cb* si = xmalloc(sizeof(schedinfo_cb) + nrec*sizeof(schedinfo));
+  uint n = 0;
+  for(uint c=0; c<ncores; c++)
+    si->rec[n++] = (schedinfo) { .core = c, .pid = NOPROC, .hist = cctx[c].hist };
+  for(Pid_t p=0; p<MAX_PROC && n<nrec; p++)
+    if(PT[p].pstate==ALIVE && PT[p].main_thread != NULL)
+      si->rec[n++] = (schedinfo) { .core = -1, .pid = p, .hist = PT[p].main_thread->hist };
+  si->size = n*sizeof(schedinfo);
+  si->pos = 0;
+
+  fcb->streamobj = si;
+  fcb->streamfunc = &schedinfo_fops;
+  return fid;
+}
+
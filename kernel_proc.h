@@ -95,6 +95,21 @@ PCB* get_pcb(Pid_t pid);
 */
 Pid_t get_pid(PCB* pcb);
 
+/**
+  @brief Get the TCB for a Tid.
+
+  This function will return a pointer to the TCB of the thread
+  with a given Tid, in any process. @c NOTHREAD stands for the
+  current thread. If the Tid does not correspond to a live thread
+  (e.g., the thread has exited), the function returns @c NULL.
+  This must be called with the kernel lock held, which keeps the
+  thread from exiting.
+
+  @param tid the tid of the thread
+  @returns A pointer to the TCB of the thread, or NULL.
+*/
+TCB* get_tcb(Tid_t tid);
+
 /** @} */
 
 #endif
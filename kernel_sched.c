@@ -1,5 +1,8 @@
 
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 
 #include "kernel_cc.h"
@@ -52,38 +55,189 @@ TCB* cur_thread()
 
 
 /*
-   The thread layout.
-  --------------------
+  A counter for active threads. By "active", we mean 'existing',
+  with the exception of idle threads (they don't count).
+ */
+volatile unsigned int active_threads = 0;
+Mutex active_threads_spinlock = MUTEX_INIT;
+
+int sched_tickless = 1;
+
+/* The fair policy, rather than the original round-robin (SCHED_POLICY_FIFO),
+   so that nice values take effect (see sched_policy) */
+enum SCHED_POLICY sched_policy = SCHED_POLICY_FAIR;
+
+/* The operations of sched_policy, set at boot (see the table of policies) */
+static const struct sched_ops* policy;
+
+int sched_consolidate = 0;
+
+/* The histograms of a thread count each cause of SCHED_CAUSE */
+_Static_assert(SCHED_PREEMPT + 1 == SCHED_CAUSES, "SCHED_CAUSES must count enum SCHED_CAUSE");
+
+/* The bucket of an interval of @c usec in a latency histogram (see sched_hist) */
+static inline uint hist_bucket(TimerDuration usec)
+{
+	uint b = (usec == 0) ? 0 : 64 - __builtin_clzll(usec);
+	return (b < SCHED_HIST_BUCKETS) ? b : SCHED_HIST_BUCKETS - 1;
+}
+
+/* The file of the scheduler trace, or NULL if tracing is off (see SCHED_TRACE_ENV) */
+static const char* sched_trace_path;
+
+/*
+  Record an event of a thread in the trace buffer of the current core, 
+  if tracing is on. The cause, the state and the nice value are those 
+  of the thread now.
+*/
+static void sched_trace_record(TCB* tcb, enum SCHED_TRACE_TYPE type, 
+	TimerDuration time, TimerDuration length)
+{
+	if (sched_trace_path == NULL || tcb->type == IDLE_THREAD)
+		return;
+
+	int preempt = preempt_off;
+	CCB* ccb = &CURCORE;
+	if (ccb->trace_count < SCHED_TRACE_EVENTS)
+		ccb->trace[ccb->trace_count++] = (sched_trace_event) {
+			.time = time, .length = length, .tid = (uintptr_t) tcb, .type = type,
+			.cause = tcb->curr_cause, .state = tcb->state, .nice = tcb->nice
+		};
+	else
+		ccb->trace_dropped++;
+	if (preempt)
+		preempt_on;
+}
+
+/* True for a thread in the real-time class */
+static inline int is_realtime(TCB* tcb)
+{
+	return tcb->rt_runtime != 0;
+}
+
+/* True for a thread in the batch class */
+static inline int is_batch(TCB* tcb)
+{
+	return tcb->batch && !is_realtime(tcb);
+}
+
+/* The class of a thread: real-time (0), normal (1) or batch (2) threads run in this order */
+static inline int sched_class(TCB* tcb)
+{
+	return is_realtime(tcb) ? 0 : is_batch(tcb) ? 2 : 1;
+}
 
-  On the x86 (Pentium) architecture, the stack grows upward. Therefore, we
-  can allocate the TCB at the top of the memory block used as the stack.
+/*
+  Admission control for real-time threads. The utilization of the 
+  real-time threads is kept in units of 1/RT_UTIL_ONE of a core.
+ */
+#define RT_UTIL_ONE (1UL << 20)
 
-  +-------------+
-  |   TCB       |
-  +-------------+
-  |             |
-  |    stack    |
-  |             |
-  |      ^      |
-  |      |      |
-  +-------------+
-  | first frame |
-  +-------------+
+static unsigned long rt_utilization = 0;
+static Mutex rt_spinlock = MUTEX_INIT;
 
-  Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
-  crash own thread, before it affects other threads (which may make debugging
-  easier).
+static unsigned long rt_util(TimerDuration runtime, TimerDuration period)
+{
+	return (runtime == 0) ? 0 : (runtime * RT_UTIL_ONE + period - 1) / period;
+}
 
-  Disadvantages: The stack cannot grow unless we move the whole TCB. Of course,
-  we do not support stack growth anyway!
+/*
+  Replace the utilization of a thread by that of the given parameters, 
+  unless the total would exceed RT_UTIL_MAX_PERCENT of the cores. 
+  Return 1 if the thread is admitted with the new parameters, else 0.
  */
+static int rt_admit(TCB* tcb, TimerDuration runtime, TimerDuration period)
+{
+	unsigned long old_util = rt_util(tcb->rt_runtime, tcb->rt_period);
+	unsigned long new_util = rt_util(runtime, period);
+	unsigned long limit = cpu_cores() * (RT_UTIL_ONE / 100) * RT_UTIL_MAX_PERCENT;
+
+	Mutex_Lock(&rt_spinlock);
+	int admitted = (rt_utilization - old_util + new_util <= limit);
+	if (admitted)
+		rt_utilization = rt_utilization - old_util + new_util;
+	Mutex_Unlock(&rt_spinlock);
+
+	return admitted;
+}
 
 /*
-  A counter for active threads. By "active", we mean 'existing',
-  with the exception of idle threads (they don't count).
+  CPU groups (see set_cpu_quota()). The fields of a group with a quota
+  are protected by its spinlock, which is acquired after any thread lock,
+  and with no other lock acquired after it. The total of a group without
+  a quota is updated atomically, without the lock.
  */
-volatile unsigned int active_threads = 0;
-Mutex active_threads_spinlock = MUTEX_INIT;
+typedef struct cpu_group {
+	Mutex spinlock;
+	TimerDuration quota; /* The cpu time per period, or 0 for no limit */
+	TimerDuration period; /* The period of the quota */
+	TimerDuration period_start; /* The start of the current period, by bios_clock_hires() */
+	TimerDuration usage; /* The cpu time used in the current period */
+	TimerDuration total; /* The cpu time used since boot */
+	unsigned long throttles; /* The number of times a thread was throttled */
+	TimerDuration throttled_time; /* The total time that threads were throttled */
+} cpu_group;
+
+static cpu_group cpu_groups[CPU_GROUPS];
+
+/* True if a thread may be throttled: a normal or batch thread, in a group with a quota */
+static inline int quota_limited(TCB* tcb)
+{
+	return tcb->type != IDLE_THREAD && !is_realtime(tcb) && cpu_groups[tcb->cpu_group].quota != 0;
+}
+
+/*
+  Start a new period of a group, if the current one is over.
+
+  *** MUST BE CALLED WITH g->spinlock HELD ***
+ */
+static void quota_refresh(cpu_group* g, TimerDuration now)
+{
+	if (g->quota != 0 && now - g->period_start >= g->period) {
+		g->period_start += (now - g->period_start) / g->period * g->period;
+		g->usage = 0;
+	}
+}
+
+/* Charge the run time of a thread to its group */
+static void quota_charge(TCB* tcb, TimerDuration delta, TimerDuration now)
+{
+	cpu_group* g = &cpu_groups[tcb->cpu_group];
+	if (g->quota == 0) {
+		__atomic_fetch_add(&g->total, delta, __ATOMIC_RELAXED);
+		return;
+	}
+
+	Mutex_Lock(&g->spinlock);
+	quota_refresh(g, now);
+	g->usage += delta;
+	__atomic_fetch_add(&g->total, delta, __ATOMIC_RELAXED);
+	Mutex_Unlock(&g->spinlock);
+}
+
+/*
+  Return the cpu time left to the group of a thread in the current 
+  period, or NO_TIMEOUT if the group has no quota.
+ */
+static TimerDuration quota_left(TCB* tcb, TimerDuration now)
+{
+	cpu_group* g = &cpu_groups[tcb->cpu_group];
+	TimerDuration left = NO_TIMEOUT;
+
+	Mutex_Lock(&g->spinlock);
+	quota_refresh(g, now);
+	if (g->quota != 0)
+		left = (g->usage < g->quota) ? g->quota - g->usage : 0;
+	Mutex_Unlock(&g->spinlock);
+	return left;
+}
+
+/* The bit of a core in a cpumask_t */
+#define CORE_BIT(c) (((cpumask_t)1) << (c))
+
+/* The mask of all the cores of the machine */
+#define ALL_CORES_MASK \
+	((cpu_cores() >= 32) ? ~(cpumask_t)0 : CORE_BIT(cpu_cores()) - 1)
 
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE (1 << 12)
@@ -92,278 +246,2220 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 #define THREAD_TCB_SIZE \
 	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
+/* Round a size up to a multiple of SYSTEM_PAGE_SIZE */
+#define PAGE_ROUND_UP(size) \
+	((((size_t)(size) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
-//#define MMAPPED_THREAD_MEM
-#ifdef MMAPPED_THREAD_MEM
+/* The memory mapped for a thread with the given stack size */
+#define THREAD_SIZE(stack_size) (THREAD_TCB_SIZE + SYSTEM_PAGE_SIZE + (stack_size))
 
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  Threads are allocated with mmap, as a TCB, followed by a guard page, 
+  followed by the stack:
+
+    +-----+-------+----------------------+
+    | TCB | guard |        stack         |
+    +-----+-------+----------------------+
+
+  The stack grows downwards, towards the guard page, which is mapped with
+  PROT_NONE, so that a stack overflow causes a segmentation fault instead
+  of silently corrupting the TCB. 
+
+  The mapping is created with MAP_NORESERVE, so that the memory of the 
+  stack is only committed when a page is first touched. Therefore, a large
+  stack costs little memory, unless it is actually used.
  */
-void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
+static TCB* allocate_thread(size_t stack_size)
+{
+	size_t size = THREAD_SIZE(stack_size);
+	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+	CHECK((ptr == MAP_FAILED) ? -1 : 0);
+
+	CHECK(mprotect(ptr + THREAD_TCB_SIZE, SYSTEM_PAGE_SIZE, PROT_NONE));
 
-void* allocate_thread(size_t size)
+	TCB* tcb = (TCB*)ptr;
+	tcb->stack = ptr + THREAD_TCB_SIZE + SYSTEM_PAGE_SIZE;
+	tcb->stack_size = stack_size;
+	return tcb;
+}
+
+static void free_thread(TCB* tcb)
 {
-	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	CHECK(munmap(tcb, THREAD_SIZE(tcb->stack_size)));
+}
 
-	CHECK((ptr == MAP_FAILED) ? -1 : 0);
+/*
+  Return the committed pages of a stack to the system. They will be 
+  committed again (zero-filled) when touched. The top page is kept, 
+  since every thread uses it.
+ */
+static void decommit_stack(TCB* tcb)
+{
+	CHECK(madvise(tcb->stack, tcb->stack_size - SYSTEM_PAGE_SIZE, MADV_DONTNEED));
+}
+
+/* The number of stack pages checked by each call to mincore() */
+#define STACK_SCAN_PAGES 64
+
+/*
+  Return the number of bytes of the stack that have been touched, measured
+  from the top of the stack down to the lowest committed page. The pages 
+  are checked from the bottom up, a chunk at a time, since the stack may 
+  be much larger than the kernel stack of the caller.
+ */
+static size_t stack_high_water(TCB* tcb)
+{
+	size_t npages = tcb->stack_size / SYSTEM_PAGE_SIZE;
+	unsigned char vec[STACK_SCAN_PAGES];
+	for (size_t base = 0; base < npages; base += STACK_SCAN_PAGES) {
+		size_t n = (npages - base < STACK_SCAN_PAGES) ? npages - base : STACK_SCAN_PAGES;
+		if (mincore(tcb->stack + base * SYSTEM_PAGE_SIZE, n * SYSTEM_PAGE_SIZE, vec) != 0)
+			return 0;
+		for (size_t p = 0; p < n; p++)
+			if (vec[p] & 1)
+				return (npages - base - p) * SYSTEM_PAGE_SIZE;
+	}
+	return 0;
+}
+
+
+/*
+  The thread pool.
+
+  Released threads with the default stack size are not freed, but kept 
+  for reuse. Each core keeps a small LIFO cache of free threads (so that 
+  the most recently used stacks are reused first), which it accesses 
+  without locks, with preemption disabled. When the cache of a core 
+  overflows, half of it is moved to the global pool; when it is empty, 
+  it is refilled from the global pool. The stacks of pooled threads are
+  decommitted, so that the pool holds little memory.
+
+  To keep the scheduler short, release_TCB() never unmaps pooled threads. 
+  Instead, the global pool is trimmed back to THREAD_POOL_SIZE by 
+  spawn_thread().
+ */
+
+/* The maximum number of free threads cached by each core */
+#define THREAD_CACHE_SIZE 16
+
+/* The number of free threads kept by the global pool, after trimming */
+#define THREAD_POOL_SIZE 256
+
+static rlnode thread_pool;
+static uint thread_pool_count;
+static Mutex thread_pool_spinlock = MUTEX_INIT;
+
+/*
+  Move up to n threads from list src to list dest.
+ */
+static uint thread_list_move(rlnode* dest, rlnode* src, uint n)
+{
+	uint moved = 0;
+	for (; moved < n && !is_rlist_empty(src); moved++)
+		rlist_push_front(dest, rlist_pop_front(src));
+	return moved;
+}
+
+/*
+  Take a free thread from the cache of the current core (refilling it 
+  from the global pool if needed), or allocate a new one.
+ */
+static TCB* acquire_thread()
+{
+	TCB* tcb = NULL;
+
+	int preempt = preempt_off;
+	CCB* ccb = &CURCORE;
+
+	if (ccb->thread_cache_count == 0 && thread_pool_count > 0) {
+		Mutex_Lock(&thread_pool_spinlock);
+		uint moved = thread_list_move(&ccb->thread_cache, &thread_pool, THREAD_CACHE_SIZE / 2);
+		thread_pool_count -= moved;
+		Mutex_Unlock(&thread_pool_spinlock);
+		ccb->thread_cache_count += moved;
+	}
+
+	if (ccb->thread_cache_count > 0) {
+		tcb = rlist_pop_front(&ccb->thread_cache)->tcb;
+		ccb->thread_cache_count--;
+	}
+
+	if (preempt)
+		preempt_on;
+
+	if (tcb == NULL)
+		tcb = allocate_thread(THREAD_STACK_SIZE);
+
+	return tcb;
+}
+
+/*
+  Return a thread to the cache of the current core, spilling half of
+  the cache to the global pool if it overflows.
+
+  *** MUST BE CALLED WITH PREEMPTION DISABLED ***
+ */
+static void return_thread(TCB* tcb)
+{
+	CCB* ccb = &CURCORE;
+
+	decommit_stack(tcb);
+
+	rlnode_init(&tcb->sched_node, tcb);
+	rlist_push_front(&ccb->thread_cache, &tcb->sched_node);
+	ccb->thread_cache_count++;
+
+	if (ccb->thread_cache_count > THREAD_CACHE_SIZE) {
+		Mutex_Lock(&thread_pool_spinlock);
+		uint moved = thread_list_move(&thread_pool, &ccb->thread_cache, THREAD_CACHE_SIZE / 2);
+		thread_pool_count += moved;
+		Mutex_Unlock(&thread_pool_spinlock);
+		ccb->thread_cache_count -= moved;
+	}
+}
+
+/*
+  Free the threads of the global pool beyond THREAD_POOL_SIZE.
+ */
+static void trim_thread_pool()
+{
+	if (thread_pool_count <= THREAD_POOL_SIZE)
+		return;
+
+	rlnode excess;
+	rlnode_init(&excess, NULL);
+
+	int preempt = preempt_off;
+	Mutex_Lock(&thread_pool_spinlock);
+	if (thread_pool_count > THREAD_POOL_SIZE)
+		thread_pool_count -= thread_list_move(&excess, &thread_pool, thread_pool_count - THREAD_POOL_SIZE);
+	Mutex_Unlock(&thread_pool_spinlock);
+	if (preempt)
+		preempt_on;
+
+	while (!is_rlist_empty(&excess))
+		free_thread(rlist_pop_front(&excess)->tcb);
+}
+
+
+
+
+/*
+  This is the function that is used to start normal threads.
+*/
+
+void gain(int preempt); /* forward */
+
+static void thread_start()
+{
+	gain(1);
+	cur_thread()->thread_func();
+
+	/* We are not supposed to get here! */
+	assert(0);
+}
+
+static void sched_reserve_heaps(uint nthreads);
+
+/*
+  Initialize and return a new TCB
+*/
+
+TCB* spawn_thread(PCB* pcb, void (*func)())
+{
+	return spawn_thread_stack(pcb, func, THREAD_STACK_SIZE);
+}
+
+TCB* spawn_thread_stack(PCB* pcb, void (*func)(), size_t stack_size)
+{
+	/* The allocated stack size must be a multiple of page size */
+	if (stack_size < THREAD_STACK_MIN)
+		stack_size = THREAD_STACK_MIN;
+	stack_size = PAGE_ROUND_UP(stack_size);
+
+	/* Only threads with the default stack size are pooled */
+	TCB* tcb = (stack_size == THREAD_STACK_SIZE) ? acquire_thread() : allocate_thread(stack_size);
+	trim_thread_pool();
+
+	/* Set the owner */
+	tcb->owner_pcb = pcb;
+
+	/* Initialize the other attributes */
+	tcb->type = NORMAL_THREAD;
+	tcb->state = INIT;
+	tcb->phase = CTX_CLEAN;
+	tcb->thread_func = func;
+	tcb->wakeup_time = NO_TIMEOUT;
+	tcb->spinlock = MUTEX_INIT;
+	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
+	tcb->timeout_node.tcb = tcb;
+	tcb->fair_node.tcb = tcb;
+	tcb->rt_node.tcb = tcb;
+	tcb->sched_ccb = NULL;
+	tcb->queued = 0;
+
+	tcb->its = QUANTUM;
+	tcb->rts = QUANTUM;
+	tcb->priority = 0;
+	tcb->affinity = ALL_CORES_MASK;
+	tcb->last_core = cpu_core_id;
+	tcb->migrations = 0;
+	tcb->nice = 0;
+	tcb->weight = NICE_0_WEIGHT;
+	tcb->vruntime = 0;
+	tcb->exec_start = 0;
+	tcb->rt_runtime = 0;
+	tcb->rt_deadline = 0;
+	tcb->rt_period = 0;
+	tcb->rt_abs_deadline = 0;
+	tcb->rt_budget = 0;
+	tcb->rt_misses = 0;
+	tcb->batch = 0;
+	tcb->gang = 0;
+	tcb->cpu_group = 0;
+	tcb->rseq = NULL;
+	tcb->last_cause = SCHED_IDLE;
+	tcb->curr_cause = SCHED_IDLE;
+	tcb->ready_time = 0;
+	memset(&tcb->hist, 0, sizeof(tcb->hist));
+
+	/* The stack segment address and size were set by allocate_thread() */
+	void* sp = tcb->stack;
+
+	/* Init the context */
+	cpu_initialize_context(&tcb->context, sp, tcb->stack_size, thread_start);
+
+#ifndef NVALGRIND
+	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + tcb->stack_size);
+#endif
+
+	/* increase the count of active threads */
+	Mutex_Lock(&active_threads_spinlock);
+	uint nthreads = ++active_threads;
+	Mutex_Unlock(&active_threads_spinlock);
+
+	sched_reserve_heaps(nthreads);
+
+	sched_trace_record(tcb, SCHED_TRACE_CREATE, bios_clock_hires(), 0);
+	return tcb;
+}
+
+size_t thread_stack_high_water(TCB* tcb)
+{
+	return stack_high_water(tcb);
+}
+
+/*
+  This is called by gain(), after the spinlock of the TCB has been released.
+  The thread is returned to the pool of the current core, unless it has
+  a non-default stack size.
+ */
+void release_TCB(TCB* tcb)
+{
+#ifndef NVALGRIND
+	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
+#endif
+
+	/* Release the utilization of a real-time thread */
+	if (is_realtime(tcb))
+		rt_admit(tcb, 0, 0);
+
+	if (tcb->stack_size == THREAD_STACK_SIZE)
+		return_thread(tcb);
+	else
+		free_thread(tcb);
+
+	Mutex_Lock(&active_threads_spinlock);
+	active_threads--;
+	Mutex_Unlock(&active_threads_spinlock);
+}
+
+/*
+ *
+ * Scheduler
+ *
+ */
+
+/*
+ *  Note: the scheduler routines are all in the non-preemptive domain.
+ */
+
+/*
+  Each core has its own scheduler queues. In the MLFQ policy, there is one
+  queue per priority, implemented as a doubly linked list, with head and 
+  tail stored in the CCB. In the fair policy, there is a binary min-heap of
+  threads, ordered by virtual run time. A core takes the threads to run 
+  from its own queues. When its queues are empty, it steals threads from 
+  the queues of the most loaded core.
+
+  Also, each core contains a binary min-heap of the threads which went
+  to sleep on it with a timeout, ordered by wakeup time. The core itself 
+  checks the top of the heap for expired timeouts each time it enters the 
+  scheduler. Each thread records its position in the heap, so insertion and
+  removal (when a thread is woken up before its timeout) take O(log n) time,
+  while checking for expired timeouts takes O(1) time.
+
+  Both per-core structures are protected by the core's @c sched_spinlock.
+  The state of each thread is protected by the thread's own @c spinlock.
+  When both kinds of lock are needed, the thread's lock must be taken first.
+  This way, no scheduler operation needs a global lock, and cores only
+  contend when they operate on the same thread, or on the same core.
+*/
+
+/*
+  Return 1 if the current thread is committing a restartable sequence, and 
+  mark its preemption as deferred (see rseq_deferred_yield()). The timer
+  is armed for RSEQ_GRACE (unless it is armed earlier): if the thread is 
+  still committing then, this returns 0, and the thread is preempted.
+
+  *** MUST BE CALLED BY THE CORE ITSELF, WITH PREEMPTION DISABLED ***
+*/
+static int sched_rseq_committing(CCB* ccb, TCB* current)
+{
+	if (current->rseq == NULL || !current->rseq->committing)
+		return 0;
+	if (ccb->rseq_deferred) {
+		ccb->rseq_overruns++;
+		return 0;
+	}
+	ccb->rseq_deferred = 1;
+	current->rseq->deferred = 1;
+	ccb->tickless = 0;
+	TimerDuration remaining = bios_set_timer(RSEQ_GRACE);
+	if (remaining > 0 && remaining < RSEQ_GRACE)
+		bios_set_timer(remaining);
+	return 1;
+}
+
+/* 
+  Interrupt handler for ALARM. The alarm may have been set for the end
+  of the time-slice, for a timeout, or to preempt the current thread.
+ */
+void yield_handler() 
+{ 
+	CCB* ccb = &CURCORE;
+	ccb->alarms++;
+	if (sched_rseq_committing(ccb, CURTHREAD))
+		return;
+	yield(ccb->preempt ? SCHED_PREEMPT : ccb->timer_cause); 
+}
+
+/*
+  The number of threads in the scheduler queue of a core, which share the 
+  core with its current thread: batch threads wait for the others.
+*/
+static inline uint sched_competing(CCB* ccb)
+{
+	return ccb->curr_batch ? ccb->ready_count : ccb->ready_count - ccb->batch_count;
+}
+
+/*
+  If the current thread of a core is running tickless, but there are other
+  threads in the scheduler queue of the core, arm the timer to preempt it.
+
+  *** MUST BE CALLED BY THE CORE ITSELF, WITH PREEMPTION DISABLED ***
+*/
+static void sched_end_tickless(CCB* ccb)
+{
+	if (ccb->tickless && sched_competing(ccb) > 0) {
+		ccb->tickless = 0;
+		TimerDuration remaining = bios_set_timer(QUANTUM);
+		ccb->timer_cause = SCHED_QUANTUM;
+		if (remaining > 0 && remaining < QUANTUM) {
+			bios_set_timer(remaining);
+			ccb->timer_cause = SCHED_TIMEOUT;
+		}
+	}
+}
+
+/* 
+  Interrupt handler for inter-core interrupts. These are sent by cores
+  that add a thread to our scheduler queue (because of its affinity), 
+  possibly a real-time thread which must preempt our current thread.
+ */
+void ici_handler()
+{
+	CCB* ccb = &CURCORE;
+	if (ccb->preempt) {
+		if (!sched_rseq_committing(ccb, CURTHREAD))
+			yield(SCHED_PREEMPT);
+	} else
+		sched_end_tickless(ccb);
+}
+
+/*
+  Scheduler heap helpers. 
+
+  A heap is stored in an array, where the children of position i 
+  are at positions 2i+1 and 2i+2. Each node records its position, so
+  that it can be removed from the middle of the heap.
+
+  *** MUST BE CALLED WITH THE sched_spinlock OF THE HEAP'S CORE HELD ***
+*/
+static inline void heap_set(sched_heap* heap, uint i, heap_node* node)
+{
+	heap->node[i] = node;
+	node->index = i;
+}
+
+static void heap_sift_up(sched_heap* heap, uint i)
+{
+	heap_node* node = heap->node[i];
+	while (i > 0) {
+		uint parent = (i - 1) / 2;
+		if (heap->node[parent]->key <= node->key)
+			break;
+		heap_set(heap, i, heap->node[parent]);
+		i = parent;
+	}
+	heap_set(heap, i, node);
+}
+
+static void heap_sift_down(sched_heap* heap, uint i)
+{
+	heap_node* node = heap->node[i];
+	for (;;) {
+		uint child = 2 * i + 1;
+		if (child >= heap->count)
+			break;
+		if (child + 1 < heap->count &&
+		    heap->node[child + 1]->key < heap->node[child]->key)
+			child++;
+		if (node->key <= heap->node[child]->key)
+			break;
+		heap_set(heap, i, heap->node[child]);
+		i = child;
+	}
+	heap_set(heap, i, node);
+}
+
+static void heap_insert(sched_heap* heap, heap_node* node)
+{
+	assert(heap->count < heap->capacity);
+	heap_set(heap, heap->count++, node);
+	heap_sift_up(heap, node->index);
+}
+
+static void heap_remove(sched_heap* heap, heap_node* node)
+{
+	uint i = node->index;
+	assert(i < heap->count && heap->node[i] == node);
+
+	/* Move the last element into the hole, and restore the heap order */
+	heap_node* last = heap->node[--heap->count];
+	if (last != node) {
+		heap_set(heap, i, last);
+		if (i > 0 && heap->node[(i - 1) / 2]->key > last->key)
+			heap_sift_up(heap, i);
+		else
+			heap_sift_down(heap, i);
+	}
+}
+
+static inline int heap_contains(sched_heap* heap, heap_node* node)
+{
+	return node->index < heap->count && heap->node[node->index] == node;
+}
+
+/*
+  Make sure that a heap of a core can hold @c nthreads threads.
+ */
+static void heap_reserve(CCB* ccb, sched_heap* heap, uint nthreads)
+{
+	if (heap->capacity >= nthreads)
+		return;
+
+	uint capacity = (nthreads < 64) ? 64 : 2 * nthreads;
+	heap_node** array = xmalloc(capacity * sizeof(heap_node*));
+	heap_node** old_array;
+
+	int preempt = preempt_off;
+	Mutex_Lock(&ccb->sched_spinlock);
+	if (heap->capacity < capacity) {
+		memcpy(array, heap->node, heap->count * sizeof(heap_node*));
+		old_array = heap->node;
+		heap->node = array;
+		heap->capacity = capacity;
+	} else {
+		old_array = array;
+	}
+	Mutex_Unlock(&ccb->sched_spinlock);
+	if (preempt)
+		preempt_on;
+
+	free(old_array);
+}
+
+/*
+  Make sure that the heaps of every core can hold @c nthreads threads.
+
+  The heaps are never grown inside the scheduler, because a thread may have
+  been preempted inside malloc(), holding the allocator's lock. Instead, 
+  they are grown here, when a thread is spawned, since every thread can be 
+  in at most one heap of each kind.
+*/
+static void sched_reserve_heaps(uint nthreads)
+{
+	for (uint c = 0; c < cpu_cores(); c++) {
+		heap_reserve(&cctx[c], &cctx[c].timeout_heap, nthreads);
+		heap_reserve(&cctx[c], &cctx[c].fair_queue, nthreads);
+		heap_reserve(&cctx[c], &cctx[c].rt_queue, nthreads);
+	}
+}
+
+/*
+  Possibly add TCB to the timeout heap of the current core. Wakeup times
+  are by bios_clock_hires(), so that short timeouts are precise.
+
+  *** MUST BE CALLED WITH tcb->spinlock HELD ***
+*/
+static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
+{
+	if (timeout != NO_TIMEOUT) {
+		CCB* ccb = &CURCORE;
+
+		/* set the wakeup time */
+		TimerDuration curtime = bios_clock_hires();
+		tcb->wakeup_time = curtime + timeout;
+
+		Mutex_Lock(&ccb->sched_spinlock);
+		tcb->timeout_node.key = tcb->wakeup_time;
+		heap_insert(&ccb->timeout_heap, &tcb->timeout_node);
+		tcb->sched_ccb = ccb;
+		Mutex_Unlock(&ccb->sched_spinlock);
+	}
+}
+
+/*
+  Core parking (see sched_consolidate). The cores below sched_active_cores
+  are unparked. It only changes under sched_park_spinlock, and it is read
+  without it.
+ */
+static volatile uint sched_active_cores;
+static Mutex sched_park_spinlock = MUTEX_INIT;
+
+/* The mask of the unparked cores */
+static inline cpumask_t sched_unparked_mask()
+{
+	uint active = sched_active_cores;
+	return (active >= 32) ? ~(cpumask_t)0 : CORE_BIT(active) - 1;
+}
+
+/* True for a parked core */
+static inline int sched_core_parked(CCB* ccb)
+{
+	return sched_consolidate && ccb->id >= sched_active_cores;
+}
+
+/*
+  Set the number of unparked cores, and let the BIOS know.
+
+  *** MUST BE CALLED WITH sched_park_spinlock HELD ***
+*/
+static void sched_set_active_cores(uint active)
+{
+	sched_active_cores = active;
+	cpu_core_park(ALL_CORES_MASK & ~sched_unparked_mask());
+}
+
+/*
+  Account the time since the last update to the utilization of the 
+  current core, as busy or idle time, and mark it as @c idling or not.
+  The average weighs each period by its length, over about PARK_WINDOW.
+ */
+static void sched_util_update(CCB* ccb, int idling)
+{
+	TimerDuration now = bios_clock_hires();
+	TimerDuration delta = now - ccb->util_stamp;
+	TimerDuration busy = ccb->idling ? 0 : UTIL_SCALE * delta;
+
+	ccb->util = (ccb->util * PARK_WINDOW + busy) / (PARK_WINDOW + delta);
+	ccb->util_stamp = now;
+	ccb->idling = idling;
+}
+
+/*
+  The utilization of a core at time @c now, including the current period,
+  read without locking. A core that was unparked within PARK_WINDOW counts 
+  as fully utilized, since it was needed.
+ */
+static uint sched_util(CCB* ccb, TimerDuration now)
+{
+	TimerDuration stamp = ccb->util_stamp;
+	TimerDuration delta = (now > stamp) ? now - stamp : 0;
+	TimerDuration busy = ccb->idling ? 0 : UTIL_SCALE * delta;
+
+	if (now - ccb->unpark_time < PARK_WINDOW)
+		return UTIL_SCALE;
+	return (ccb->util * PARK_WINDOW + busy) / (PARK_WINDOW + delta);
+}
+
+/*
+  Unpark the next core, if the ready threads of the unparked cores
+  outnumber their idle cores, i.e., some of them will have to wait, and
+  the unparked cores are utilized over PARK_UTIL. Short bursts of ready 
+  threads on lightly loaded cores just wait. The queue lengths and the 
+  utilizations are read without locking.
+ */
+static void sched_unpark()
+{
+	uint active = sched_active_cores;
+	if (!sched_consolidate || active >= cpu_cores())
+		return;
+
+	uint ready = 0, idle = 0;
+	for (uint c = 0; c < active; c++) {
+		ready += cctx[c].ready_count;
+		idle += (cctx[c].current_thread == &cctx[c].idle_thread);
+	}
+	if (ready <= idle)
+		return;
+
+	TimerDuration now = bios_clock_hires();
+	unsigned long util = 0;
+	for (uint c = 0; c < active; c++)
+		util += sched_util(&cctx[c], now);
+	if (util <= (unsigned long)active * PARK_UTIL)
+		return;
+
+	Mutex_Lock(&sched_park_spinlock);
+	if (sched_active_cores == active) {
+		sched_set_active_cores(active + 1);
+		cctx[active].unpark_time = bios_clock_hires();
+		cctx[active].unparks++;
+	}
+	Mutex_Unlock(&sched_park_spinlock);
+
+	/* It will steal the threads */
+	cpu_core_restart_preferred(active);
+}
+
+/*
+  Called by an idle core: park the highest unparked core, if it is this 
+  core or a halted one, it was not unparked within PARK_WINDOW, and the 
+  utilization of all the unparked cores would fit in the rest of them.
+ */
+static void sched_park(CCB* ccb)
+{
+	uint active = sched_active_cores;
+	if (!sched_consolidate || active <= 1)
+		return;
+
+	CCB* last = &cctx[active - 1];
+	TimerDuration now = bios_clock_hires();
+	if ((last != ccb && !cpu_core_halted(last->id)) || now - last->unpark_time < PARK_WINDOW)
+		return;
+
+	unsigned long util = 0;
+	for (uint c = 0; c < active; c++)
+		util += sched_util(&cctx[c], now);
+	if (util > (unsigned long)(active - 1) * PARK_UTIL)
+		return;
+
+	Mutex_Lock(&sched_park_spinlock);
+	if (sched_active_cores == active) {
+		sched_set_active_cores(active - 1);
+		last->parks++;
+	}
+	Mutex_Unlock(&sched_park_spinlock);
+}
+
+/* The ways in which a thread is added to a scheduler queue */
+enum SCHED_ADD {
+	SCHED_ADD_REQUEUE, /* A thread which was running, or moves to another core */
+	SCHED_ADD_WAKEUP, /* A thread which wakes up, e.g., at a timeout */
+	SCHED_ADD_HANDOFF /* A thread woken up by the current thread, with wakeup() */
+};
+
+/* True for a normal thread in a gang; real-time and batch threads ignore their gang */
+static inline int sched_gang_member(TCB* tcb)
+{
+	return tcb->gang != 0 && sched_class(tcb) == 1;
+}
+
+/* 
+  True if a thread of gang @c gang is running on some core other than 
+  @c except (which may be NULL). Gangs are co-scheduled only if the host
+  runs all the cores in parallel: otherwise, the threads of a gang on 
+  different cores would only take turns on the host cpus.
+*/
+static int sched_gang_running(int gang, CCB* except)
+{
+	if (cpu_cores() > cpu_physical_cores())
+		return 0;
+	for (uint c = 0; c < cpu_cores(); c++)
+		if (cctx[c].curr_gang == gang && &cctx[c] != except)
+			return 1;
+	return 0;
+}
+
+/*
+  Return a core for a gang thread which wakes up while its gang runs, or
+  NULL if there is none: the core the thread last ran on, or else the 
+  least loaded of the allowed cores, as long as the core runs a normal 
+  thread outside any gang (which the gang thread will preempt) and no 
+  other gang thread is about to preempt it. The fields of other cores 
+  are read without their locks, so this is only a hint.
+*/
+static CCB* sched_gang_target(TCB* tcb, cpumask_t allowed)
+{
+	CCB* target = NULL;
+	for (uint c = 0; c < cpu_cores(); c++) {
+		CCB* ccb = &cctx[c];
+		if (!(allowed & CORE_BIT(c)) || ccb->curr_gang != 0 || 
+		    ccb->curr_deadline != NO_TIMEOUT || ccb->gang_next != NULL)
+			continue;
+		if (c == tcb->last_core)
+			return ccb;
+		if (target == NULL || ccb->ready_count < target->ready_count)
+			target = ccb;
+	}
+	return target;
+}
+
+/*
+  Return the core to whose scheduler queue a thread should be added.
+
+  A thread woken up by the current thread, which will probably sleep soon,
+  stays on the current core, to be handed the core (see sched_queue_select()).
+  A thread which wakes up otherwise (e.g., at a timeout), or which may not 
+  run on the current core, goes to the core it last ran on, if that core 
+  is halted and the host has an idle cpu for it: the thread finds its 
+  cache warm, and no core has to steal it from our queue. Otherwise, the 
+  thread goes to the current core if its affinity allows it, else to the
+  least loaded of the allowed cores.
+
+  A gang thread which wakes up while its gang runs goes to a core that
+  does not run its gang, if there is one (see sched_gang_target()).
+
+  In consolidation mode, the allowed cores are only the unparked ones, 
+  if the affinity of the thread allows any of them.
+*/
+static CCB* sched_queue_target(TCB* tcb, enum SCHED_ADD how)
+{
+	cpumask_t allowed = tcb->affinity;
+	if (sched_consolidate && (allowed & sched_unparked_mask()))
+		allowed &= sched_unparked_mask();
+
+	if (how != SCHED_ADD_REQUEUE && sched_gang_member(tcb) && sched_gang_running(tcb->gang, NULL)) {
+		CCB* target = sched_gang_target(tcb, allowed);
+		if (target != NULL)
+			return target;
+	}
+
+	int here = (allowed & CORE_BIT(cpu_core_id)) != 0;
+	uint last = tcb->last_core;
+
+	if ((how == SCHED_ADD_WAKEUP || !here) && last != cpu_core_id &&
+	    (allowed & CORE_BIT(last)) && cpu_core_halted(last) &&
+	    cpu_cores_running() < cpu_physical_cores())
+		return &cctx[last];
+
+	if (here)
+		return &CURCORE;
+
+	CCB* target = NULL;
+	for (uint c = 0; c < cpu_cores(); c++)
+		if ((allowed & CORE_BIT(c)) &&
+		    (target == NULL || cctx[c].ready_count < target->ready_count))
+			target = &cctx[c];
+
+	assert(target != NULL);
+	return target;
+}
+
+/*
+  The weights of the nice values, from NICE_MIN to NICE_MAX. Consecutive
+  nice values differ in weight by a factor of about 1.25.
+ */
+static const uint nice_weight[NICE_MAX - NICE_MIN + 1] = {
+	/* -20 */ 88761, 71755, 56483, 46273, 36291,
+	/* -15 */ 29154, 23254, 18705, 14949, 11916,
+	/* -10 */ 9548, 7620, 6100, 4904, 3906,
+	/*  -5 */ 3121, 2501, 1991, 1586, 1277,
+	/*   0 */ 1024, 820, 655, 526, 423,
+	/*   5 */ 335, 272, 215, 172, 137,
+	/*  10 */ 110, 87, 70, 56, 45,
+	/*  15 */ 36, 29, 23, 18, 15
+};
+
+/*
+  Adjust the virtual run time of a thread which is about to enter the
+  fair queue of a core.
+
+  The virtual run times of different cores are not comparable, so a thread 
+  coming from another core keeps its lag relative to the min_vruntime of 
+  that core. A new thread starts at the min_vruntime of the core. Also, a 
+  thread that has slept for long keeps at most SCHED_LATENCY of lag, so 
+  that it cannot monopolize the core when it wakes up.
+
+  *** MUST BE CALLED WITH tcb->spinlock HELD, OR FOR A THREAD NOT IN ANY QUEUE ***
+*/
+static void fair_place(CCB* ccb, TCB* tcb)
+{
+	CCB* from = tcb->sched_ccb;
+
+	if (from == NULL)
+		tcb->vruntime = ccb->min_vruntime;
+	else if (from != ccb) {
+		if (tcb->vruntime >= from->min_vruntime)
+			tcb->vruntime = ccb->min_vruntime + (tcb->vruntime - from->min_vruntime);
+		else if (from->min_vruntime - tcb->vruntime < ccb->min_vruntime)
+			tcb->vruntime = ccb->min_vruntime - (from->min_vruntime - tcb->vruntime);
+		else
+			tcb->vruntime = 0;
+	}
+
+	TimerDuration floor = (ccb->min_vruntime > SCHED_LATENCY) ? ccb->min_vruntime - SCHED_LATENCY : 0;
+	if (tcb->vruntime < floor)
+		tcb->vruntime = floor;
+}
+
+/*
+  Start a new period for a real-time thread, at time @c now.
+
+  *** MUST BE CALLED WITH tcb->spinlock HELD ***
+*/
+static void rt_new_period(TCB* tcb, TimerDuration now)
+{
+	tcb->rt_abs_deadline = now + tcb->rt_deadline;
+	tcb->rt_budget = tcb->rt_runtime;
+}
+
+/*
+  A real-time thread becomes ready. It keeps its current deadline and budget
+  only if it can use up the budget by the deadline, without exceeding
+  its utilization (the wakeup rule of the constant bandwidth server).
+  Otherwise, a new period starts.
+
+  *** MUST BE CALLED WITH tcb->spinlock HELD ***
+*/
+static void rt_wakeup(TCB* tcb)
+{
+	TimerDuration now = bios_clock_hires();
+	if (tcb->rt_abs_deadline <= now ||
+	    tcb->rt_budget * tcb->rt_period > (tcb->rt_abs_deadline - now) * tcb->rt_runtime)
+		rt_new_period(tcb, now);
+}
+
+/*
+  Charge @c delta of cpu time to a real-time thread. A thread that used up 
+  its budget has its deadline postponed by a period, with a new budget. A 
+  thread that is still running after its deadline, with budget left, has 
+  missed the deadline; its next period starts now.
+
+  *** MUST BE CALLED FOR THE CURRENT THREAD, WITH ITS spinlock HELD ***
+*/
+static void rt_charge(TCB* tcb, TimerDuration delta, TimerDuration now)
+{
+	tcb->rt_budget = (delta < tcb->rt_budget) ? tcb->rt_budget - delta : 0;
+	if (tcb->rt_budget == 0) {
+		tcb->rt_abs_deadline += tcb->rt_period;
+		tcb->rt_budget = tcb->rt_runtime;
+	} else if (now > tcb->rt_abs_deadline) {
+		tcb->rt_misses++;
+		CURCORE.deadline_misses++;
+		rt_new_period(tcb, now);
+	}
+}
+
+/*
+  Insert a thread into the scheduler queue of a core: into the real-time
+  queue by its deadline (real-time threads), at the end of the batch queue
+  (batch threads, or at the front if preempted), or into the queues of 
+  the scheduling policy (normal threads).
+
+  *** MUST BE CALLED WITH ccb->sched_spinlock HELD ***
+*/
+static void sched_queue_insert(CCB* ccb, TCB* tcb)
+{
+	if (is_realtime(tcb)) {
+		tcb->rt_node.key = tcb->rt_abs_deadline;
+		heap_insert(&ccb->rt_queue, &tcb->rt_node);
+	} else if (is_batch(tcb)) {
+		if (tcb->curr_cause == SCHED_PREEMPT)
+			rlist_push_front(&ccb->batch_queue, &tcb->sched_node);
+		else
+			rlist_push_back(&ccb->batch_queue, &tcb->sched_node);
+		ccb->batch_count++;
+	} else {
+		policy->enqueue(ccb, tcb);
+	}
+	tcb->sched_ccb = ccb;
+	tcb->queued = 1;
+	ccb->ready_count++;
+}
+
+/*
+  Remove a thread from the scheduler queue of a core.
+
+  *** MUST BE CALLED WITH ccb->sched_spinlock HELD ***
+*/
+static void sched_queue_remove(CCB* ccb, TCB* tcb)
+{
+	if (ccb->handoff == tcb)
+		ccb->handoff = NULL;
+	if (ccb->gang_next == tcb)
+		ccb->gang_next = NULL;
+	if (ccb->yield_to == tcb)
+		ccb->yield_to = NULL;
+	if (is_realtime(tcb)) {
+		heap_remove(&ccb->rt_queue, &tcb->rt_node);
+	} else if (is_batch(tcb)) {
+		rlist_remove(&tcb->sched_node);
+		ccb->batch_count--;
+	} else {
+		policy->dequeue(ccb, tcb);
+	}
+	tcb->queued = 0;
+	ccb->ready_count--;
+}
+
+/*
+  Lock the core whose scheduler queue holds a thread, and return it, or 
+  return NULL (with no core locked) if the thread is in no queue.
+
+  A READY and CTX_CLEAN thread is not necessarily in a queue: a core which
+  selected or stole it removes it from its queue without locking it, and 
+  the thread stays READY and CTX_CLEAN until the core runs it. Therefore, 
+  membership is checked by the @c queued flag, under the lock of the core.
+  A thread may be moved to the queue of another core meanwhile (by a 
+  thief), so the lookup is repeated until @c sched_ccb is stable.
+
+  *** MUST BE CALLED WITH tcb->spinlock HELD ***
+*/
+static CCB* sched_queue_lock(TCB* tcb)
+{
+	CCB* ccb;
+	while ((ccb = tcb->sched_ccb) != NULL) {
+		Mutex_Lock(&ccb->sched_spinlock);
+		if (tcb->sched_ccb == ccb) {
+			if (tcb->queued)
+				return ccb;
+			Mutex_Unlock(&ccb->sched_spinlock);
+			return NULL;
+		}
+		Mutex_Unlock(&ccb->sched_spinlock);
+	}
+	return NULL;
+}
+
+/*
+  Insert TCB into the scheduler queue of core @c ccb.
+
+  A real-time thread which wakes up preempts the current thread of the 
+  core, if its deadline is earlier, and any other thread which wakes up 
+  preempts a current batch thread. A thread woken up by the current thread
+  becomes the handoff thread of the current core: if the current thread
+  sleeps or yields before the next scheduling decision, the handoff thread 
+  gets the core (see sched_queue_select()). A gang thread which wakes up
+  while its gang runs preempts a current normal thread outside any gang.
+
+  Return 1 if the current thread of the core must be preempted.
+
+  *** MUST BE CALLED WITH tcb->spinlock AND ccb->sched_spinlock HELD ***
+*/
+static int sched_queue_enqueue(CCB* ccb, TCB* tcb, enum SCHED_ADD how)
+{
+	if (policy->on_wakeup != NULL && !is_realtime(tcb))
+		policy->on_wakeup(ccb, tcb);
+	sched_queue_insert(ccb, tcb);
+	int preempt = how != SCHED_ADD_REQUEUE && 
+		((is_realtime(tcb) && tcb->rt_abs_deadline < ccb->curr_deadline) ||
+		 (!is_batch(tcb) && ccb->curr_batch));
+	if (how != SCHED_ADD_REQUEUE && ccb->gang_next == NULL && ccb->curr_gang == 0 &&
+	    ccb->curr_deadline == NO_TIMEOUT && sched_gang_member(tcb) && 
+	    sched_gang_running(tcb->gang, ccb)) {
+		ccb->gang_next = tcb;
+		preempt = 1;
+	}
+	if (preempt)
+		ccb->preempt = 1;
+	if (how == SCHED_ADD_HANDOFF && ccb == &CURCORE)
+		ccb->handoff = tcb;
+	return preempt;
+}
+
+/*
+  Notify core @c ccb that @c count threads were added to its queue. If
+  this is the current core, halted cores are restarted to steal the 
+  threads, starting with core @c prefer.
+
+  *** MUST BE CALLED WITHOUT ccb->sched_spinlock HELD ***
+*/
+static void sched_queue_notify(CCB* ccb, int preempt, uint count, uint prefer)
+{
+	if (ccb == &CURCORE) {
+		if (preempt) {
+			/* Yield as soon as preemption is enabled */
+			ccb->tickless = 0;
+			bios_set_timer(1);
+		} else {
+			/* If the current thread is running tickless, it must now be preempted */
+			sched_end_tickless(ccb);
+		}
+
+		/* Restart possibly halted cores, which will steal the threads */
+		if (count == 1)
+			cpu_core_restart_preferred(prefer);
+		else
+			cpu_core_restart_many(count);
+	} else {
+		/* Interrupt the other core, which may be halted or running tickless */
+		cpu_ici(ccb->id);
+	}
+}
+
+/*
+  Add TCB to the scheduler queue of the core chosen by sched_queue_target().
+
+  *** MUST BE CALLED WITH tcb->spinlock HELD ***
+*/
+static void sched_queue_add(TCB* tcb, enum SCHED_ADD how)
+{
+	CCB* ccb = sched_queue_target(tcb, how);
+
+	Mutex_Lock(&ccb->sched_spinlock);
+	int preempt = sched_queue_enqueue(ccb, tcb, how);
+	Mutex_Unlock(&ccb->sched_spinlock);
+
+	/* A handoff thread will get the core when the current thread sleeps */
+	if (how != SCHED_ADD_HANDOFF)
+		sched_unpark();
+	sched_queue_notify(ccb, preempt, 1, tcb->last_core);
+}
+
+/*
+	Adjust the state of a thread to make it READY, adding it to a 
+	scheduler queue in the given way.
+
+	*** MUST BE CALLED WITH tcb->spinlock HELD ***
+ */
+static void sched_make_ready(TCB* tcb, enum SCHED_ADD how)
+{
+	assert(tcb->state == STOPPED || tcb->state == INIT);
+
+	/* Possibly remove from the timeout heap */
+	if (tcb->wakeup_time != NO_TIMEOUT) {
+		/* tcb is in the timeout heap of some core, fix it */
+		CCB* ccb = tcb->sched_ccb;
+		Mutex_Lock(&ccb->sched_spinlock);
+		assert(tcb->state == STOPPED);
+		heap_remove(&ccb->timeout_heap, &tcb->timeout_node);
+		Mutex_Unlock(&ccb->sched_spinlock);
+		tcb->wakeup_time = NO_TIMEOUT;
+	}
+
+	/* Mark as ready */
+	tcb->state = READY;
+	tcb->ready_time = bios_clock_hires();
+	sched_trace_record(tcb, SCHED_TRACE_WAKEUP, tcb->ready_time, 0);
+	if (is_realtime(tcb))
+		rt_wakeup(tcb);
+
+	/* Possibly add to the scheduler queue */
+	if (tcb->phase == CTX_CLEAN)
+		sched_queue_add(tcb, how);
+}
+
+/*
+  Pop the threads whose timeout has expired from the timeout heap of a 
+  core, and wake them up.
+
+  Because the lock order is 'thread first', the thread locks are only 
+  tried here. If a thread is locked by someone else (who may be waiting for 
+  this core's lock in order to wake the thread up), we stop, and the 
+  rest of the heap is checked at the next call.
+
+  *** MUST BE CALLED WITHOUT ANY SCHEDULER LOCKS HELD ***
+*/
+static void sched_wakeup_expired_timeouts(CCB* ccb)
+{
+	/* This is checked without the lock; we will catch up at the next call */
+	if (ccb->timeout_heap.count == 0)
+		return;
+
+	/* Empty the timeout heap up to the current time and wake up each thread */
+	TimerDuration curtime = bios_clock_hires();
+
+	Mutex_Lock(&ccb->sched_spinlock);
+	while (ccb->timeout_heap.count > 0) {
+		TCB* tcb = ccb->timeout_heap.node[0]->tcb;
+		if (tcb->wakeup_time > curtime)
+			break;
+		if (!Mutex_TryLock(&tcb->spinlock))
+			break;
+
+		/* Remove it here, so that sched_make_ready() does not need our lock */
+		heap_remove(&ccb->timeout_heap, &tcb->timeout_node);
+		tcb->wakeup_time = NO_TIMEOUT;
+		Mutex_Unlock(&ccb->sched_spinlock);
+
+		sched_make_ready(tcb, SCHED_ADD_WAKEUP);
+		Mutex_Unlock(&tcb->spinlock);
+
+		Mutex_Lock(&ccb->sched_spinlock);
+	}
+	Mutex_Unlock(&ccb->sched_spinlock);
+}
+
+/*
+  Return the thread with the smallest key in a heap of a core, among those
+  allowed to run on core @c core, or NULL if there is no such thread.
+
+  *** MUST BE CALLED WITH THE sched_spinlock OF THE HEAP'S CORE HELD ***
+*/
+static TCB* sched_heap_peek(sched_heap* heap, uint core)
+{
+	if (heap->count == 0)
+		return NULL;
+	if (heap->node[0]->tcb->affinity & CORE_BIT(core))
+		return heap->node[0]->tcb;
+
+	/* Only another core may find the top not allowed; search the heap */
+	heap_node* best = NULL;
+	for (uint i = 1; i < heap->count; i++)
+		if ((heap->node[i]->tcb->affinity & CORE_BIT(core)) &&
+		    (best == NULL || heap->node[i]->key < best->key))
+			best = heap->node[i];
+	return (best != NULL) ? best->tcb : NULL;
+}
+
+/*
+  Return the first batch thread of the scheduler queue of a core, among 
+  those allowed to run on core @c core, or NULL.
+
+  *** MUST BE CALLED WITH ccb->sched_spinlock HELD ***
+*/
+static TCB* sched_queue_peek_batch(CCB* ccb, uint core)
+{
+	rlnode* q = &ccb->batch_queue;
+	for (rlnode* n = q->next; n != q; n = n->next)
+		if (n->tcb->affinity & CORE_BIT(core))
+			return n->tcb;
+	return NULL;
+}
+
+/*
+  Return the next normal thread of the scheduler queue of a core, else
+  the first batch thread, among those allowed to run on core @c core, 
+  or NULL.
+
+  *** MUST BE CALLED WITH ccb->sched_spinlock HELD ***
+*/
+static TCB* sched_queue_peek_normal(CCB* ccb, uint core)
+{
+	TCB* tcb = policy->pick_next(ccb, core);
+	return (tcb != NULL) ? tcb : sched_queue_peek_batch(ccb, core);
+}
+
+/*
+  Return the next thread to run from the scheduler queue of a core, among 
+  those allowed to run on core @c core, or NULL if there is no such thread.
+  This is the real-time thread with the earliest deadline, if any, else 
+  the next normal thread of the scheduling policy, else the first batch 
+  thread.
+
+  *** MUST BE CALLED WITH ccb->sched_spinlock HELD ***
+*/
+static TCB* sched_queue_peek(CCB* ccb, uint core)
+{
+	TCB* tcb = sched_heap_peek(&ccb->rt_queue, core);
+	return (tcb != NULL) ? tcb : sched_queue_peek_normal(ccb, core);
+}
+
+/*
+  Return 1 if a thread is cache-hot on the core whose queue holds it,
+  i.e., it stopped running there within MIGRATE_COST. When the VM has 
+  more cores than the host, the cores share the host cpus (and their 
+  caches), so no thread is cache-hot.
+*/
+static int sched_cache_hot(CCB* ccb, TCB* tcb)
+{
+	return cpu_cores() <= cpu_physical_cores() && tcb->last_core == ccb->id && 
+		bios_clock_hires() - tcb->exec_start < MIGRATE_COST;
+}
+
+/*
+  Take the next thread of the queue of @c victim which may run on @c thief,
+  or return NULL. A normal thread which is cache-hot on the victim core is
+  left there, unless the victim queue holds at least MIGRATE_IMBALANCE 
+  threads; then, @c hot is set.
+
+  *** MUST BE CALLED BY THE THIEF, WITHOUT ANY CORE LOCKS HELD ***
+*/
+static TCB* sched_queue_steal_from(CCB* thief, CCB* victim, int* hot)
+{
+	Mutex_Lock(&victim->sched_spinlock);
+	TCB* tcb = sched_queue_peek(victim, thief->id);
+	if (tcb != NULL && !is_realtime(tcb) && 
+	    victim->ready_count < MIGRATE_IMBALANCE && sched_cache_hot(victim, tcb)) {
+		*hot = 1;
+		tcb = NULL;
+	}
+	if (tcb != NULL)
+		sched_queue_remove(victim, tcb);
+	Mutex_Unlock(&victim->sched_spinlock);
+	return tcb;
+}
+
+/*
+  Steal the next thread of the most loaded core other than @c thief, 
+  which has a thread that may run on the thief (see 
+  sched_queue_steal_from()): the other cores are tried in order of 
+  decreasing load. Return NULL if there is no such thread. The stolen 
+  thread is placed on the thief by the policy (in the fair policy, its 
+  virtual run time moves).
+
+  If no thread was stolen, but some victim kept a cache-hot thread, the 
+  thief sets steal_retry, to try again when the thread cools down (see 
+  sched_set_timer()).
+
+  The queue lengths are read without locking, so a victim may
+  have emptied its queue by the time we lock it.
+
+  *** MUST BE CALLED BY THE THIEF, WITHOUT ANY CORE LOCKS HELD ***
+*/
+static TCB* sched_queue_steal(CCB* thief)
+{
+	uint ncores = cpu_cores();
+	CCB* victims[MAX_CORES];
+	uint len[MAX_CORES];
+	uint nvictims = 0;
+
+	/* Sort the non-empty queues by decreasing length (ties in core order) */
+	for (uint i = 1; i < ncores; i++) {
+		CCB* ccb = &cctx[(thief->id + i) % ncores];
+		uint n = ccb->ready_count;
+		if (n == 0)
+			continue;
+		uint k = nvictims++;
+		for (; k > 0 && len[k-1] < n; k--) {
+			victims[k] = victims[k-1];
+			len[k] = len[k-1];
+		}
+		victims[k] = ccb;
+		len[k] = n;
+	}
+
+	TCB* tcb = NULL;
+	int hot = 0;
+	for (uint k = 0; k < nvictims && tcb == NULL; k++)
+		tcb = sched_queue_steal_from(thief, victims[k], &hot);
+
+	if (tcb == NULL) {
+		if (hot)
+			thief->steal_retry = 1;
+		return NULL;
+	}
+
+	thief->steals++;
+	if (policy->on_wakeup != NULL)
+		policy->on_wakeup(thief, tcb);
+	tcb->sched_ccb = thief;
+	return tcb;
+}
+
+/*
+  Return the quantum of a thread about to run on a core. The threads in 
+  the scheduler queue of the core share a period of SCHED_LATENCY, as the
+  scheduling policy decides, but none gets less than MIN_QUANTUM. Batch 
+  threads do not share the period. A real-time thread gets its remaining
+  budget, and a batch thread gets BATCH_QUANTUM, or MIN_QUANTUM if other 
+  threads wait.
+*/
+static TimerDuration sched_quantum(CCB* ccb, TCB* tcb)
+{
+	if (tcb->type == IDLE_THREAD)
+		return QUANTUM;
+
+	/* A real-time thread runs until it uses up its budget */
+	if (is_realtime(tcb))
+		return tcb->rt_budget;
+
+	/* A batch thread gets a long quantum, unless other threads are waiting */
+	if (is_batch(tcb))
+		return (ccb->ready_count > ccb->batch_count) ? MIN_QUANTUM : BATCH_QUANTUM;
+
+	TimerDuration quantum = policy->quantum(ccb, tcb);
+	return (quantum < MIN_QUANTUM) ? MIN_QUANTUM : quantum;
+}
+
+/*
+  Arm the timer of the current core for the end of the time-slice of the
+  current thread, or for the earliest timeout of the core, if it comes first
+  (so that a thread waking up from a timed sleep, especially a real-time 
+  thread, is not delayed by a long time-slice).
+
+  In tickless mode, when there is no other thread to run on this core, the 
+  time-slice does not end, and the timer is only armed for the earliest 
+  timeout of the core (if any). This includes the idle thread, so a halted
+  core wakes up for the earliest timeout. The timer is armed for the exact
+  wakeup time, or for TIMEOUT_MIN if it has passed (a thread whose timeout
+  expired may be left in the heap, if its lock was busy).
+
+  *** MUST BE CALLED WITH PREEMPTION DISABLED ***
+*/
+static void sched_set_timer(TCB* current)
+{
+	CCB* ccb = &CURCORE;
+
+	ccb->tickless = sched_tickless && sched_competing(ccb) == 0;
+	ccb->timer_cause = SCHED_QUANTUM;
+	TimerDuration delay = ccb->tickless ? NO_TIMEOUT : current->rts;
+
+	/* The time-slice ends when the group of the thread runs out of quota */
+	if (quota_limited(current)) {
+		TimerDuration left = quota_left(current, bios_clock_hires());
+		if (left < delay) {
+			ccb->tickless = 0;
+			delay = (left > TIMEOUT_MIN) ? left : TIMEOUT_MIN;
+		}
+	}
+
+	if (ccb->timeout_heap.count > 0) {
+		Mutex_Lock(&ccb->sched_spinlock);
+		if (ccb->timeout_heap.count > 0) {
+			TimerDuration curtime = bios_clock_hires();
+			TimerDuration wakeup_time = ccb->timeout_heap.node[0]->key;
+			TimerDuration timeout_delay = (wakeup_time > curtime + TIMEOUT_MIN) ? wakeup_time - curtime : TIMEOUT_MIN;
+			if (timeout_delay < delay) {
+				delay = timeout_delay;
+				ccb->timer_cause = SCHED_TIMEOUT;
+			}
+		}
+		Mutex_Unlock(&ccb->sched_spinlock);
+	}
+
+	/* An idle core that left a cache-hot thread to another core, checks it again */
+	if (current->type == IDLE_THREAD && ccb->steal_retry && delay > MIGRATE_COST) {
+		ccb->tickless = 0;
+		ccb->timer_cause = SCHED_QUANTUM;
+		delay = MIGRATE_COST;
+	}
+
+	if (delay != NO_TIMEOUT)
+		bios_set_timer(delay);
+}
+
+/*
+  Return true if thread @c a should run before thread @c b: real-time threads
+  run before normal threads, by earliest deadline, normal threads run before
+  batch threads, and normal threads run in the order of the scheduling 
+  policy. Batch threads always run in queue order.
+*/
+static int sched_runs_before(TCB* a, TCB* b)
+{
+	if (sched_class(a) != sched_class(b))
+		return sched_class(a) < sched_class(b);
+	if (is_realtime(a))
+		return a->rt_abs_deadline <= b->rt_abs_deadline;
+	return !is_batch(a) && policy->runs_before(a, b);
+}
+
+/*
+  Return true if a handoff thread may run before thread @c next of the 
+  queue, i.e., unless @c next is of a higher class, or a real-time thread
+  with an earlier deadline.
+*/
+static int sched_handoff_first(TCB* handoff, TCB* next)
+{
+	if (sched_class(handoff) != sched_class(next))
+		return sched_class(handoff) < sched_class(next);
+	return !is_realtime(handoff) || handoff->rt_abs_deadline <= next->rt_abs_deadline;
+}
+
+/*
+  Remove the next thread of the scheduler queues of this core, or else 
+  steal a thread from another core (unless this core is parked), and 
+  return it. If all queues are empty, return the current thread if it is
+  still READY, else the idle thread.
+
+  However, if the current thread sleeps or yields voluntarily, and it has 
+  woken up a thread of our queue since the last scheduling decision, that
+  thread (the handoff thread) is selected, unless a thread of a higher 
+  class, or a real-time thread with an earlier deadline, is ready. This 
+  way, a thread waiting for a reply from the thread it woke up (e.g., at 
+  a condition variable) does not wait for the whole queue to run. A 
+  thread to which the current thread donates the core (see 
+  sched_donate()) is selected in the same way.
+
+  A READY current thread which was interrupted (rather than yielding 
+  voluntarily, e.g., on a contended mutex) is selected again if it runs 
+  before the next thread (see sched_runs_before()). In the MLFQ policy, this 
+  only happens for real-time threads: a normal current thread is selected 
+  again only if there is no other thread, regardless of priority. Its 
+  priority is accounted for when it is added to a queue by gain(), and it 
+  will be selected in order.
+
+  A thread which yields on a contended mutex, and would still be selected
+  again before the other threads of its class in our queue, lets the next
+  thread of the class below run instead (a real-time thread lets a normal
+  thread run, a normal thread lets a batch thread run, the latter only for
+  MIN_QUANTUM), since the owner of the mutex may be one of them. Otherwise,
+  the spinner would take the core back at once, and two such spinners 
+  would take turns forever. While another thread of the same class can 
+  run, it goes first, so that batch work still yields to interactive 
+  threads.
+
+  A gang thread which preempted the current thread (see 
+  sched_queue_enqueue()) is selected before the others, unless a 
+  real-time thread is ready, or the current thread is real-time. A gang
+  thread which yields on a contended mutex while its gang runs on other
+  cores is selected again (unless a real-time thread is ready), since a
+  running sibling probably holds the mutex.
+
+  *** MUST BE CALLED WITH current->spinlock HELD ***
+*/
+static TCB* sched_queue_select(TCB* current)
+{
+	CCB* ccb = &CURCORE;
+	int runnable = current->type != IDLE_THREAD && current->state == READY &&
+		(current->affinity & CORE_BIT(ccb->id));
+	int voluntary = !(current->curr_cause == SCHED_QUANTUM ||
+		current->curr_cause == SCHED_TIMEOUT || current->curr_cause == SCHED_PREEMPT);
+	int interrupted = runnable && !voluntary;
+
+	/* Get the head of our own queues */
+	Mutex_Lock(&ccb->sched_spinlock);
+	ccb->preempt = 0;
+	ccb->rseq_deferred = 0;
+	TCB* handoff = ccb->handoff;
+	ccb->handoff = NULL;
+	if (ccb->yield_to != NULL) {
+		/* The current thread donates the core, see sched_donate() */
+		handoff = ccb->yield_to;
+		ccb->yield_to = NULL;
+	}
+	TCB* gang_next = ccb->gang_next;
+	ccb->gang_next = NULL;
+	TCB* next_thread = sched_queue_peek(ccb, ccb->id);
+	if (runnable && current->curr_cause == SCHED_MUTEX && !is_batch(current) &&
+	    next_thread != NULL && sched_class(next_thread) == sched_class(current) &&
+	    sched_runs_before(current, next_thread)) {
+		TCB* lower = is_realtime(current) ? sched_queue_peek_normal(ccb, ccb->id)
+			: sched_queue_peek_batch(ccb, ccb->id);
+		if (lower != NULL)
+			next_thread = lower;
+	}
+	if (gang_next != NULL && (next_thread == NULL || !is_realtime(next_thread)) &&
+	    !(runnable && is_realtime(current))) {
+		/* The gang thread joins its gang, which is running on other cores */
+		next_thread = gang_next;
+		sched_queue_remove(ccb, next_thread);
+		handoff = NULL;
+	} else if (runnable && current->curr_cause == SCHED_MUTEX && sched_gang_member(current) &&
+	           (next_thread == NULL || !is_realtime(next_thread)) &&
+	           sched_gang_running(current->gang, ccb)) {
+		/* The mutex is probably held by a running thread of the gang; keep spinning */
+		next_thread = current;
+		handoff = NULL;
+	} else if (handoff != NULL && voluntary && sched_handoff_first(handoff, next_thread)) {
+		/* The current thread woke up the handoff thread, and now gives up the core */
+		next_thread = handoff;
+		sched_queue_remove(ccb, next_thread);
+	} else if (next_thread != NULL) {
+		handoff = NULL;
+		if (interrupted && sched_runs_before(current, next_thread))
+			next_thread = current;
+		else
+			sched_queue_remove(ccb, next_thread);
+	}
+	Mutex_Unlock(&ccb->sched_spinlock);
+
+	ccb->steal_retry = 0;
+	if (next_thread == NULL && !sched_core_parked(ccb)) {
+		next_thread = sched_queue_steal(ccb);
+
+		/* Keep a stolen thread in our queue, if the current thread goes first */
+		if (next_thread != NULL && interrupted && sched_runs_before(current, next_thread)) {
+			Mutex_Lock(&ccb->sched_spinlock);
+			sched_queue_insert(ccb, next_thread);
+			Mutex_Unlock(&ccb->sched_spinlock);
+			next_thread = current;
+		}
+	}
+
+	if (next_thread == NULL)
+		next_thread = runnable ? current : &ccb->idle_thread;
+
+	if (policy->on_pick != NULL && next_thread->type != IDLE_THREAD && 
+	    sched_class(next_thread) == 1)
+		policy->on_pick(ccb, next_thread);
+
+	/* A real-time thread with an earlier deadline will preempt this one */
+	ccb->curr_deadline = is_realtime(next_thread) ? next_thread->rt_abs_deadline : NO_TIMEOUT;
+
+	/* Any other thread that becomes ready will preempt a batch thread */
+	ccb->curr_batch = is_batch(next_thread);
+
+	/* A gang thread which wakes up will preempt a normal thread outside any gang */
+	ccb->curr_gang = sched_gang_member(next_thread) ? next_thread->gang : 0;
+
+	/* A normal handoff thread gets the rest of the time-slice of the current thread */
+	if (handoff != NULL && !is_realtime(handoff) && !ccb->tickless)
+		next_thread->its = (current->rts > MIN_QUANTUM) ? current->rts : MIN_QUANTUM;
+	else if (is_batch(next_thread) && runnable && !is_batch(current))
+		next_thread->its = MIN_QUANTUM;
+	else if (is_batch(next_thread) && next_thread->curr_cause == SCHED_PREEMPT &&
+	         next_thread->rts > MIN_QUANTUM)
+		/* A preempted batch thread resumes its time-slice, with its cache warm */
+		next_thread->its = next_thread->rts;
+	else
+		next_thread->its = sched_quantum(ccb, next_thread);
+
+	return next_thread;
+}
+
+/*
+  Charge the run time of the current time-slice of a thread to its 
+  virtual run time, scaled by its weight, and to its budget if it is
+  a real-time thread. The time-slice and its end cause are counted in
+  the histograms of the thread and the core. A thread which is still 
+  ready starts waiting now.
+
+  *** MUST BE CALLED FOR THE CURRENT THREAD, WITH ITS spinlock HELD ***
+*/
+static void sched_account(TCB* tcb)
+{
+	if (tcb->type == IDLE_THREAD)
+		return;
+
+	TimerDuration now = bios_clock_hires();
+	TimerDuration delta = now - tcb->exec_start;
+	tcb->exec_start = now;
+	sched_trace_record(tcb, SCHED_TRACE_BURST, now - delta, delta);
+
+	tcb->vruntime += delta * NICE_0_WEIGHT / tcb->weight;
+	if (is_realtime(tcb))
+		rt_charge(tcb, delta, now);
+	quota_charge(tcb, delta, now);
+	CURCORE.curr_start = now;
+
+	uint b = hist_bucket(delta);
+	tcb->hist.run[b]++;
+	tcb->hist.cause[tcb->curr_cause]++;
+	CURCORE.hist.run[b]++;
+	CURCORE.hist.cause[tcb->curr_cause]++;
+	if (tcb->state == READY)
+		tcb->ready_time = now;
+}
+
+/*
+  Throttle the current thread, if its group has used up its quota: the
+  thread sleeps until the next period of its group, instead of returning
+  to the scheduler queues. Only a thread which was interrupted or yielded
+  is throttled, and not while it holds the kernel lock, so that it does
+  not keep other threads waiting.
+
+  *** MUST BE CALLED FOR THE CURRENT THREAD, WITH ITS spinlock HELD ***
+*/
+static void sched_quota_throttle(TCB* tcb, enum SCHED_CAUSE cause)
+{
+	if (tcb->state != READY || !quota_limited(tcb))
+		return;
+	if (cause != SCHED_QUANTUM && cause != SCHED_TIMEOUT && cause != SCHED_PREEMPT &&
+	    cause != SCHED_USER)
+		return;
+	if (kernel_lock_held())
+		return;
+
+	cpu_group* g = &cpu_groups[tcb->cpu_group];
+	TimerDuration now = bios_clock_hires();
+	TimerDuration sleep = 0;
+
+	Mutex_Lock(&g->spinlock);
+	quota_refresh(g, now);
+	if (g->quota != 0 && g->usage >= g->quota) {
+		sleep = g->period_start + g->period - now;
+		g->throttles++;
+		g->throttled_time += sleep;
+	}
+	Mutex_Unlock(&g->spinlock);
+
+	if (sleep > 0) {
+		tcb->state = STOPPED;
+		sched_register_timeout(tcb, sleep);
+	}
+}
+
+/*
+  Adjust the priority of a thread, according to the cause of the end 
+  of its time-slice. CPU-bound threads sink, whereas I/O-bound threads
+  rise.
+
+  *** MUST BE CALLED FOR THE CURRENT THREAD, WITH ITS spinlock HELD ***
+*/
+static void sched_adjust_priority(TCB* tcb, enum SCHED_CAUSE cause)
+{
+	if (tcb->type == IDLE_THREAD)
+		return;
+
+	switch (cause) {
+	case SCHED_QUANTUM:
+		if (tcb->priority < PRIORITY_QUEUES - 1)
+			tcb->priority++;
+		break;
+	case SCHED_IO:
+	case SCHED_PIPE:
+		if (tcb->priority > 0)
+			tcb->priority--;
+		break;
+	default:
+		/* Other causes do not tell us much about the thread */
+		break;
+	}
+}
+
+/*
+  Every PRIORITY_BOOST_PERIOD, move all the threads of core @c ccb 
+  (including its current thread) to the highest priority, so that 
+  low-priority threads do not starve.
+
+  *** MUST BE CALLED WITH current->spinlock HELD ***
+*/
+static void sched_priority_boost(CCB* ccb, TCB* current, TimerDuration curtime)
+{
+	if (curtime - ccb->last_boost < PRIORITY_BOOST_PERIOD)
+		return;
+
+	Mutex_Lock(&ccb->sched_spinlock);
+	ccb->last_boost = curtime;
+	for (uint p = 1; p < PRIORITY_QUEUES; p++) {
+		for (rlnode* n = ccb->ready_queue[p].next; n != &ccb->ready_queue[p]; n = n->next)
+			n->tcb->priority = 0;
+		rlist_append(&ccb->ready_queue[0], &ccb->ready_queue[p]);
+	}
+	Mutex_Unlock(&ccb->sched_spinlock);
+
+	if (current->type != IDLE_THREAD)
+		current->priority = 0;
+}
+
+
+/*
+	The scheduling policies of normal threads.
+ */
+
+static void fair_enqueue(CCB* ccb, TCB* tcb)
+{
+	tcb->fair_node.key = tcb->vruntime;
+	heap_insert(&ccb->fair_queue, &tcb->fair_node);
+	ccb->load += tcb->weight;
+}
+
+static void fair_dequeue(CCB* ccb, TCB* tcb)
+{
+	heap_remove(&ccb->fair_queue, &tcb->fair_node);
+	ccb->load -= tcb->weight;
+}
+
+/* The thread with the least virtual run time */
+static TCB* fair_pick_next(CCB* ccb, uint core)
+{
+	return sched_heap_peek(&ccb->fair_queue, core);
+}
+
+static int fair_runs_before(TCB* a, TCB* b)
+{
+	return a->vruntime <= b->vruntime;
+}
+
+/* The period is shared in proportion to the weights */
+static TimerDuration fair_quantum(CCB* ccb, TCB* tcb)
+{
+	return SCHED_LATENCY * tcb->weight / (ccb->load + tcb->weight);
+}
+
+/* The virtual run time of the core follows the threads it selects */
+static void fair_on_pick(CCB* ccb, TCB* tcb)
+{
+	if (tcb->vruntime > ccb->min_vruntime)
+		ccb->min_vruntime = tcb->vruntime;
+}
+
+static void mlfq_enqueue(CCB* ccb, TCB* tcb)
+{
+	rlist_push_back(&ccb->ready_queue[tcb->priority], &tcb->sched_node);
+}
+
+static void mlfq_dequeue(CCB* ccb, TCB* tcb)
+{
+	rlist_remove(&tcb->sched_node);
+}
+
+/* The first thread of the highest-priority non-empty queue */
+static TCB* mlfq_pick_next(CCB* ccb, uint core)
+{
+	for (uint p = 0; p < PRIORITY_QUEUES; p++) {
+		rlnode* q = &ccb->ready_queue[p];
+		for (rlnode* n = q->next; n != q; n = n->next)
+			if (n->tcb->affinity & CORE_BIT(core))
+				return n->tcb;
+	}
+	return NULL;
+}
+
+/* The order is that of the queues */
+static int mlfq_runs_before(TCB* a, TCB* b)
+{
+	return 0;
+}
+
+/* The period is shared equally, and lower priorities get longer quanta */
+static TimerDuration mlfq_quantum(CCB* ccb, TCB* tcb)
+{
+	TimerDuration quantum = SCHED_LATENCY / (ccb->ready_count - ccb->batch_count + 1);
+	if (quantum < MIN_QUANTUM)
+		quantum = MIN_QUANTUM;
+	return quantum << tcb->priority;
+}
 
-	return ptr;
+static void mlfq_on_tick(CCB* ccb, TCB* current, enum SCHED_CAUSE cause, TimerDuration now)
+{
+	sched_adjust_priority(current, cause);
+	sched_priority_boost(ccb, current, now);
 }
-#else
+
 /*
-  Use malloc to allocate a thread. This is probably faster than  mmap, but
-  cannot be made easily to 'detect' stack overflow.
+  The fifo policy is the original scheduler: a single queue in arrival 
+  order (the first queue of the MLFQ), where every thread runs for 
+  QUANTUM, and an interrupted thread goes to the back of the queue.
  */
-void free_thread(void* ptr, size_t size) { free(ptr); }
-
-void* allocate_thread(size_t size)
+static void fifo_enqueue(CCB* ccb, TCB* tcb)
 {
-	void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
-	CHECK((ptr == NULL) ? -1 : 0);
-	return ptr;
+	rlist_push_back(&ccb->ready_queue[0], &tcb->sched_node);
 }
-#endif
-
 
+static TCB* fifo_pick_next(CCB* ccb, uint core)
+{
+	rlnode* q = &ccb->ready_queue[0];
+	for (rlnode* n = q->next; n != q; n = n->next)
+		if (n->tcb->affinity & CORE_BIT(core))
+			return n->tcb;
+	return NULL;
+}
 
+static TimerDuration fifo_quantum(CCB* ccb, TCB* tcb)
+{
+	return QUANTUM;
+}
 
-/*
-  This is the function that is used to start normal threads.
-*/
+/* The table of policies, indexed by enum SCHED_POLICY */
+static const struct sched_ops sched_policies[SCHED_POLICIES] = {
+	[SCHED_POLICY_FAIR] = {
+		.name = "fair",
+		.enqueue = fair_enqueue,
+		.dequeue = fair_dequeue,
+		.pick_next = fair_pick_next,
+		.runs_before = fair_runs_before,
+		.quantum = fair_quantum,
+		.on_tick = NULL,
+		.on_wakeup = fair_place,
+		.on_pick = fair_on_pick
+	},
+	[SCHED_POLICY_MLFQ] = {
+		.name = "mlfq",
+		.enqueue = mlfq_enqueue,
+		.dequeue = mlfq_dequeue,
+		.pick_next = mlfq_pick_next,
+		.runs_before = mlfq_runs_before,
+		.quantum = mlfq_quantum,
+		.on_tick = mlfq_on_tick,
+		.on_wakeup = NULL,
+		.on_pick = NULL
+	},
+	[SCHED_POLICY_FIFO] = {
+		.name = "fifo",
+		.enqueue = fifo_enqueue,
+		.dequeue = mlfq_dequeue,
+		.pick_next = fifo_pick_next,
+		.runs_before = mlfq_runs_before,
+		.quantum = fifo_quantum,
+		.on_tick = NULL,
+		.on_wakeup = NULL,
+		.on_pick = NULL
+	}
+};
 
-void gain(int preempt); /* forward */
+const struct sched_ops* sched_policy_ops(enum SCHED_POLICY p)
+{
+	return (p < SCHED_POLICIES) ? &sched_policies[p] : NULL;
+}
 
-static void thread_start()
+uint sched_nice_weight(int nice)
 {
-	gain(1);
-	cur_thread()->thread_func();
+	assert(nice >= NICE_MIN && nice <= NICE_MAX);
+	return nice_weight[nice - NICE_MIN];
+}
 
-	/* We are not supposed to get here! */
-	assert(0);
+int sched_select_policy(const char* name)
+{
+	for (uint i = 0; i < SCHED_POLICIES; i++)
+		if (strcmp(sched_policies[i].name, name) == 0) {
+			sched_policy = i;
+			return 0;
+		}
+	return -1;
 }
 
 /*
-  Initialize and return a new TCB
-*/
-
-TCB* spawn_thread(PCB* pcb, void (*func)())
+  Make the process ready, adding it to a scheduler queue in the given way.
+ */
+static int sched_wakeup(TCB* tcb, enum SCHED_ADD how)
 {
-	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
-
-	/* Set the owner */
-	tcb->owner_pcb = pcb;
+	int ret = 0;
 
-	/* Initialize the other attributes */
-	tcb->type = NORMAL_THREAD;
-	tcb->state = INIT;
-	tcb->phase = CTX_CLEAN;
-	tcb->thread_func = func;
-	tcb->wakeup_time = NO_TIMEOUT;
-	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
+	/* Preemption off */
+	int oldpre = preempt_off;
 
-	tcb->its = QUANTUM;
-	tcb->rts = QUANTUM;
-	tcb->last_cause = SCHED_IDLE;
-	tcb->curr_cause = SCHED_IDLE;
+	/* To touch tcb->state, we must get the spinlock. */
+	Mutex_Lock(&tcb->spinlock);
 
-	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+	if (tcb->state == STOPPED || tcb->state == INIT) {
+		sched_make_ready(tcb, how);
+		ret = 1;
+	}
 
-	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+	Mutex_Unlock(&tcb->spinlock);
 
-#ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
-#endif
+	/* Restore preemption state */
+	if (oldpre)
+		preempt_on;
 
-	/* increase the count of active threads */
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads++;
-	Mutex_Unlock(&active_threads_spinlock);
+	return ret;
+}
 
-	return tcb;
+int wakeup(TCB* tcb)
+{
+	return sched_wakeup(tcb, SCHED_ADD_HANDOFF);
 }
 
 /*
-  This is called with sched_spinlock locked !
+  Wake up many threads, with a single acquisition of the current core's
+  lock.
+
+  Because the lock order is 'thread first', the thread locks are only 
+  tried while holding the core's lock (as in sched_wakeup_expired_timeouts()).
+  The threads which are locked by someone else, go to the queue of another
+  core (see sched_queue_target()), or sleep with a timeout on another core, 
+  are woken up one by one afterwards.
  */
-void release_TCB(TCB* tcb)
+uint wakeup_many(TCB** tcbs, uint n)
 {
-#ifndef NVALGRIND
-	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
-#endif
+	int oldpre = preempt_off;
 
-	free_thread(tcb, THREAD_SIZE);
+	CCB* ccb = &CURCORE;
+	uint woken = 0, queued = 0;
+	int preempt = 0;
+	_Bool done[n];
+
+	Mutex_Lock(&ccb->sched_spinlock);
+	for (uint i = 0; i < n; i++) {
+		TCB* tcb = tcbs[i];
+		done[i] = 0;
+		if (!Mutex_TryLock(&tcb->spinlock))
+			continue;
+
+		if (tcb->state != STOPPED && tcb->state != INIT) {
+			tcbs[i] = NULL;
+			done[i] = 1;
+		} else if (sched_queue_target(tcb, SCHED_ADD_WAKEUP) == ccb &&
+		           (tcb->wakeup_time == NO_TIMEOUT || tcb->sched_ccb == ccb)) {
+			/* This is sched_make_ready(), with our lock held */
+			if (tcb->wakeup_time != NO_TIMEOUT) {
+				heap_remove(&ccb->timeout_heap, &tcb->timeout_node);
+				tcb->wakeup_time = NO_TIMEOUT;
+			}
+			tcb->state = READY;
+			tcb->ready_time = bios_clock_hires();
+			sched_trace_record(tcb, SCHED_TRACE_WAKEUP, tcb->ready_time, 0);
+			if (is_realtime(tcb))
+				rt_wakeup(tcb);
+			if (tcb->phase == CTX_CLEAN) {
+				preempt |= sched_queue_enqueue(ccb, tcb, SCHED_ADD_WAKEUP);
+				queued++;
+			}
+			woken++;
+			done[i] = 1;
+		}
+		Mutex_Unlock(&tcb->spinlock);
+	}
+	Mutex_Unlock(&ccb->sched_spinlock);
 
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads--;
-	Mutex_Unlock(&active_threads_spinlock);
-}
+	if (queued > 0) {
+		sched_unpark();
+		sched_queue_notify(ccb, preempt, queued, ccb->id);
+	}
 
-/*
- *
- * Scheduler
- *
- */
+	/* The rest, one by one */
+	for (uint i = 0; i < n; i++) {
+		if (done[i])
+			continue;
+		if (sched_wakeup(tcbs[i], SCHED_ADD_WAKEUP))
+			woken++;
+		else
+			tcbs[i] = NULL;
+	}
 
-/*
- *  Note: the scheduler routines are all in the non-preemptive domain.
- */
+	if (oldpre)
+		preempt_on;
 
-/*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
+	return woken;
+}
 
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
+int set_thread_affinity(TCB* tcb, cpumask_t mask)
+{
+	mask &= ALL_CORES_MASK;
+	if (mask == 0)
+		return -1;
 
-  Both of these structures are protected by @c sched_spinlock.
-*/
+	int preempt = preempt_off;
+	Mutex_Lock(&tcb->spinlock);
+
+	tcb->affinity = mask;
+
+	/* A queued thread may be at a core that is no longer allowed; move it */
+	CCB* ccb = sched_queue_lock(tcb);
+	if (ccb != NULL) {
+		int move = !(mask & CORE_BIT(ccb->id));
+		if (move)
+			sched_queue_remove(ccb, tcb);
+		Mutex_Unlock(&ccb->sched_spinlock);
+		if (move)
+			sched_queue_add(tcb, SCHED_ADD_REQUEUE);
+	}
 
-rlnode SCHED; /* The scheduler queue */
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
+	Mutex_Unlock(&tcb->spinlock);
+	if (preempt)
+		preempt_on;
 
-/* Interrupt handler for ALARM */
-void yield_handler() { yield(SCHED_QUANTUM); }
+	/* The current thread leaves a core that is no longer allowed */
+	if (tcb == CURTHREAD && !(mask & CORE_BIT(cpu_core_id)))
+		yield(SCHED_USER);
 
-/* Interrupt handle for inter-core interrupts */
-void ici_handler()
-{ /* noop for now... */
+	return 0;
 }
 
-/*
-  Possibly add TCB to the scheduler timeout list.
-
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
-*/
-static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
+int set_thread_nice(TCB* tcb, int nice)
 {
-	if (timeout != NO_TIMEOUT) {
-		/* set the wakeup time */
-		TimerDuration curtime = bios_clock();
-		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
-
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
+	if (nice < NICE_MIN || nice > NICE_MAX)
+		return -1;
+
+	uint weight = nice_weight[nice - NICE_MIN];
+
+	int preempt = preempt_off;
+	Mutex_Lock(&tcb->spinlock);
+
+	/* The load of a core includes the weights of the threads in its fair queue */
+	CCB* ccb = tcb->sched_ccb;
+	if (tcb->state == READY && tcb->phase == CTX_CLEAN && ccb != NULL) {
+		Mutex_Lock(&ccb->sched_spinlock);
+		if (heap_contains(&ccb->fair_queue, &tcb->fair_node))
+			ccb->load = ccb->load - tcb->weight + weight;
+		Mutex_Unlock(&ccb->sched_spinlock);
 	}
-}
 
-/*
-  Add TCB to the end of the scheduler list.
+	tcb->nice = nice;
+	tcb->weight = weight;
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
-*/
-static void sched_queue_add(TCB* tcb)
-{
-	/* Insert at the end of the scheduling list */
-	rlist_push_back(&SCHED, &tcb->sched_node);
+	Mutex_Unlock(&tcb->spinlock);
+	if (preempt)
+		preempt_on;
 
-	/* Restart possibly halted cores */
-	cpu_core_restart_one();
+	return 0;
 }
 
-/*
-	Adjust the state of a thread to make it READY.
-
-	*** MUST BE CALLED WITH sched_spinlock HELD ***
- */
-static void sched_make_ready(TCB* tcb)
+int set_thread_deadline(TCB* tcb, TimerDuration runtime, TimerDuration deadline, TimerDuration period)
 {
-	assert(tcb->state == STOPPED || tcb->state == INIT);
+	if (runtime != 0 && !(runtime <= deadline && deadline <= period && period <= RT_PERIOD_MAX))
+		return -1;
 
-	/* Possibly remove from TIMEOUT_LIST */
-	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
-		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
-		rlist_remove(&tcb->sched_node);
-		tcb->wakeup_time = NO_TIMEOUT;
-	}
+	int preempt = preempt_off;
+	Mutex_Lock(&tcb->spinlock);
+
+	int admitted = rt_admit(tcb, runtime, period);
+	if (admitted) {
+		/* A queued thread moves to the queue of its new class */
+		CCB* ccb = sched_queue_lock(tcb);
+		int queued = (ccb != NULL);
+		if (queued) {
+			sched_queue_remove(ccb, tcb);
+			Mutex_Unlock(&ccb->sched_spinlock);
+		}
 
-	/* Mark as ready */
-	tcb->state = READY;
+		tcb->rt_runtime = runtime;
+		tcb->rt_deadline = deadline;
+		tcb->rt_period = period;
+		if (runtime != 0)
+			rt_new_period(tcb, bios_clock_hires());
 
-	/* Possibly add to the scheduler queue */
-	if (tcb->phase == CTX_CLEAN)
-		sched_queue_add(tcb);
-}
+		if (queued)
+			sched_queue_add(tcb, SCHED_ADD_WAKEUP);
+	}
 
-/*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
+	Mutex_Unlock(&tcb->spinlock);
+	if (preempt)
+		preempt_on;
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
-*/
-static void sched_wakeup_expired_timeouts()
-{
-	/* Empty the timeout list up to the current time and wake up each thread */
-	TimerDuration curtime = bios_clock();
+	/* The current thread is rescheduled in its new class */
+	if (admitted && tcb == CURTHREAD)
+		yield(SCHED_PREEMPT);
 
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
-		if (tcb->wakeup_time > curtime)
-			break;
-		sched_make_ready(tcb);
-	}
+	return admitted ? 0 : -1;
 }
 
-/*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
-
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
-*/
-static TCB* sched_queue_select(TCB* current)
+void set_thread_batch(TCB* tcb, int batch)
 {
-	/* Get the head of the SCHED list */
-	rlnode* sel = rlist_pop_front(&SCHED);
+	int preempt = preempt_off;
+	Mutex_Lock(&tcb->spinlock);
+
+	/* A queued thread moves to the queue of its new class */
+	CCB* ccb = sched_queue_lock(tcb);
+	int queued = (ccb != NULL);
+	if (queued) {
+		sched_queue_remove(ccb, tcb);
+		Mutex_Unlock(&ccb->sched_spinlock);
+	}
 
-	TCB* next_thread = sel->tcb; /* When the list is empty, this is NULL */
+	tcb->batch = (batch != 0);
 
-	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+	if (queued)
+		sched_queue_add(tcb, SCHED_ADD_WAKEUP);
 
-	next_thread->its = QUANTUM;
+	Mutex_Unlock(&tcb->spinlock);
+	if (preempt)
+		preempt_on;
 
-	return next_thread;
+	/* The current thread is rescheduled in its new class */
+	if (tcb == CURTHREAD)
+		yield(SCHED_PREEMPT);
 }
 
-/*
-  Make the process ready.
- */
-int wakeup(TCB* tcb)
+void set_thread_gang(TCB* tcb, int gang)
 {
-	int ret = 0;
+	int preempt = preempt_off;
+	Mutex_Lock(&tcb->spinlock);
+	tcb->gang = gang;
+	if (tcb == CURTHREAD)
+		CURCORE.curr_gang = sched_gang_member(tcb) ? gang : 0;
+	Mutex_Unlock(&tcb->spinlock);
+	if (preempt)
+		preempt_on;
+}
 
-	/* Preemption off */
-	int oldpre = preempt_off;
+void set_thread_cpu_group(TCB* tcb, int group)
+{
+	assert(group >= 0 && group < CPU_GROUPS);
+	int preempt = preempt_off;
+	Mutex_Lock(&tcb->spinlock);
+	tcb->cpu_group = group;
+	if (tcb == CURTHREAD)
+		CURCORE.curr_group = group;
+	Mutex_Unlock(&tcb->spinlock);
+	if (preempt)
+		preempt_on;
+}
 
-	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+int set_cpu_quota(int group, TimerDuration quota, TimerDuration period)
+{
+	if (group <= 0 || group >= CPU_GROUPS)
+		return -1;
+	if (quota != 0 && !(period >= QUOTA_PERIOD_MIN && period <= QUOTA_PERIOD_MAX &&
+	                    quota <= period * cpu_cores()))
+		return -1;
 
-	if (tcb->state == STOPPED || tcb->state == INIT) {
-		sched_make_ready(tcb);
-		ret = 1;
+	int preempt = preempt_off;
+	cpu_group* g = &cpu_groups[group];
+	Mutex_Lock(&g->spinlock);
+	g->quota = quota;
+	g->period = (quota != 0) ? period : 0;
+	g->period_start = bios_clock_hires();
+	g->usage = 0;
+	Mutex_Unlock(&g->spinlock);
+	if (preempt)
+		preempt_on;
+	return 0;
+}
+
+void get_cpu_quota(int group, cpu_quota* q)
+{
+	assert(group >= 0 && group < CPU_GROUPS);
+	int preempt = preempt_off;
+	cpu_group* g = &cpu_groups[group];
+	Mutex_Lock(&g->spinlock);
+	quota_refresh(g, bios_clock_hires());
+	q->quota = g->quota;
+	q->period = g->period;
+	q->usage = g->usage;
+	q->total = __atomic_load_n(&g->total, __ATOMIC_RELAXED);
+	q->throttles = g->throttles;
+	q->throttled_time = g->throttled_time;
+	Mutex_Unlock(&g->spinlock);
+
+	/* Time-slices in progress are charged when they end, but a thread may run tickless for long */
+	TimerDuration now = bios_clock_hires();
+	for (uint c = 0; c < cpu_cores(); c++) {
+		TimerDuration start = cctx[c].curr_start;
+		if (cctx[c].curr_group == group && now > start)
+			q->total += now - start;
 	}
+	if (preempt)
+		preempt_on;
+}
+
+void set_thread_rseq(TCB* tcb, rseq_area* rs)
+{
+	assert(tcb == cur_thread());
 
-	Mutex_Unlock(&sched_spinlock);
+	int preempt = preempt_off;
+	if (rs != NULL) {
+		rs->cpu_id = cpu_core_id;
+		rs->in_cs = 0;
+		rs->aborted = 0;
+		rs->committing = 0;
+		rs->deferred = 0;
+	}
+	tcb->rseq = rs;
+	if (preempt)
+		preempt_on;
+}
 
-	/* Restore preemption state */
-	if (oldpre)
+void rseq_deferred_yield(rseq_area* rs)
+{
+	int preempt = preempt_off;
+	rs->deferred = 0;
+	yield(CURCORE.preempt ? SCHED_PREEMPT : CURCORE.timer_cause);
+	if (preempt)
 		preempt_on;
+}
 
-	return ret;
+int sched_donate(TCB* tcb)
+{
+	int preempt = preempt_off;
+	CCB* ccb = &CURCORE;
+	int donated = 0;
+
+	Mutex_Lock(&tcb->spinlock);
+	CCB* from;
+	if (tcb != CURTHREAD && (tcb->affinity & CORE_BIT(ccb->id)) &&
+	    (from = sched_queue_lock(tcb)) != NULL) {
+		/* Move the thread to our queue */
+		if (from != ccb) {
+			sched_queue_remove(from, tcb);
+			Mutex_Unlock(&from->sched_spinlock);
+			Mutex_Lock(&ccb->sched_spinlock);
+			sched_queue_enqueue(ccb, tcb, SCHED_ADD_REQUEUE);
+		}
+		ccb->yield_to = tcb;
+		Mutex_Unlock(&ccb->sched_spinlock);
+		donated = 1;
+	}
+	Mutex_Unlock(&tcb->spinlock);
+	if (preempt)
+		preempt_on;
+	return donated;
 }
 
 /*
@@ -377,7 +2473,7 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 	int preempt = preempt_off;
 	TCB* tcb = CURTHREAD;
-	Mutex_Lock(&sched_spinlock);
+	Mutex_Lock(&tcb->spinlock);
 
 	/* mark the thread as stopped or exited */
 	tcb->state = state;
@@ -390,8 +2486,8 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 	if (mx != NULL)
 		Mutex_Unlock(mx);
 
-	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
+	/* Release the thread spinlock before calling yield() !!! */
+	Mutex_Unlock(&tcb->spinlock);
 
 	/* call this to schedule someone else */
 	yield(cause);
@@ -413,7 +2509,10 @@ void yield(enum SCHED_CAUSE cause)
 
 	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
 
-	Mutex_Lock(&sched_spinlock);
+	/* Wake up threads whose sleep timeout has expired */
+	sched_wakeup_expired_timeouts(&CURCORE);
+
+	Mutex_Lock(&current->spinlock);
 
 	/* Update CURTHREAD state */
 	if (current->state == RUNNING)
@@ -423,9 +2522,10 @@ void yield(enum SCHED_CAUSE cause)
 	current->rts = remaining;
 	current->last_cause = current->curr_cause;
 	current->curr_cause = cause;
-
-	/* Wake up threads whose sleep timeout has expired */
-	sched_wakeup_expired_timeouts();
+	sched_account(current);
+	if (policy->on_tick != NULL)
+		policy->on_tick(&CURCORE, current, cause, bios_clock());
+	sched_quota_throttle(current, cause);
 
 	/* Get next */
 	TCB* next = sched_queue_select(current);
@@ -434,10 +2534,11 @@ void yield(enum SCHED_CAUSE cause)
 	/* Save the current TCB for the gain phase */
 	CURCORE.previous_thread = current;
 
-	Mutex_Unlock(&sched_spinlock);
+	Mutex_Unlock(&current->spinlock);
 
 	/* Switch contexts */
 	if (current != next) {
+		CURCORE.context_switches++;
 		CURTHREAD = next;
 		cpu_swap_context(&current->context, &next->context);
 	}
@@ -462,42 +2563,148 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
-
 	TCB* current = CURTHREAD;
 
 	/* Mark current state */
+	Mutex_Lock(&current->spinlock);
 	current->state = RUNNING;
 	current->phase = CTX_DIRTY;
 	current->rts = current->its;
+	current->exec_start = bios_clock_hires();
+	CURCORE.curr_group = (current->type == IDLE_THREAD) ? -1 : current->cpu_group;
+	CURCORE.curr_start = current->exec_start;
+	if (current->type != IDLE_THREAD) {
+		uint b = hist_bucket(current->exec_start - current->ready_time);
+		current->hist.wait[b]++;
+		CURCORE.hist.wait[b]++;
+	}
+	if (current->last_core != cpu_core_id) {
+		current->last_core = cpu_core_id;
+		current->migrations++;
+	}
+
+	/* A restartable sequence in progress is aborted, unless this thread resumes right after itself */
+	if (current->rseq != NULL) {
+		if (current != CURCORE.previous_thread && current->rseq->in_cs)
+			current->rseq->aborted = 1;
+		current->rseq->cpu_id = cpu_core_id;
+	}
+	Mutex_Unlock(&current->spinlock);
 
 	/* Take care of the previous thread */
 	TCB* prev = CURCORE.previous_thread;
 	if (current != prev) {
+		Mutex_Lock(&prev->spinlock);
 		prev->phase = CTX_CLEAN;
-		switch (prev->state) {
+		Thread_state prev_state = prev->state;
+		switch (prev_state) {
 		case READY:
 			if (prev->type != IDLE_THREAD)
-				sched_queue_add(prev);
+				sched_queue_add(prev, SCHED_ADD_REQUEUE);
 			break;
 		case EXITED:
-			release_TCB(prev);
-			break;
 		case STOPPED:
 			break;
 		default:
 			assert(0); /* prev->state should not be INIT or RUNNING ! */
 		}
+		Mutex_Unlock(&prev->spinlock);
+
+		/* The spinlock is part of the TCB, so release only after unlocking */
+		if (prev_state == EXITED)
+			release_TCB(prev);
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	/* Set the alarm for the end of the time-slice */
+	sched_set_timer(current);
 
 	/* Reset preemption as needed */
 	if (preempt)
 		preempt_on;
+}
+
+/*
+  The total number of threads in the scheduler queues of all cores. 
+  This is read without locking.
+ */
+static uint sched_ready_total()
+{
+	uint total = 0;
+	for (uint c = 0; c < cpu_cores(); c++)
+		total += cctx[c].ready_count;
+	return total;
+}
+
+/*
+  The time an idle core polls for new work before halting. Work that 
+  arrives soon after the core halts pays for a full (signal-based) core 
+  restart, so we poll for twice the average idle period of the core, 
+  if it is short. Under light load, the average is long and the core 
+  halts at once.
+
+  When the VM has more cores than the host, polling takes the host cpus
+  away from the other cores: the limit is scaled down, and a core does 
+  not poll at all while more cores are running than the host has.
+  A parked core does not poll either.
+ */
+static TimerDuration idle_poll_budget(CCB* ccb)
+{
+	TimerDuration limit = IDLE_POLL_MAX;
+	uint physical = cpu_physical_cores();
+
+	if (sched_core_parked(ccb))
+		return 0;
+
+	if (cpu_cores() > physical) {
+		if (cpu_cores_running() > physical)
+			return 0;
+		limit = limit * physical / cpu_cores();
+	}
+
+	if (ccb->idle_avg > limit)
+		return 0;
+	return (2 * ccb->idle_avg < limit) ? 2 * ccb->idle_avg : limit;
+}
+
+/*
+  Wait for new work: poll the scheduler queues for a while, then halt.
+  Polling is done with preemption off; interrupts that arrive meanwhile
+  are served when it ends. In consolidation mode, the core may park 
+  first (see sched_park()).
+ */
+static void idle_wait(CCB* ccb)
+{
+	sched_util_update(ccb, 1);
+	sched_park(ccb);
+
+	TimerDuration budget = idle_poll_budget(ccb);
+	TimerDuration start = bios_clock_hires();
+	TimerDuration now = start;
+	int polled = 0;
+
+	if (budget > 0) {
+		int preempt = preempt_off;
+		uint ready = sched_ready_total();
+		while (!polled && (now = bios_clock_hires()) - start < budget)
+			polled = sched_ready_total() > ready;
+		if (preempt)
+			preempt_on;
+	}
 
-	/* Set a 1-quantum alarm */
-	bios_set_timer(current->rts);
+	if (polled) {
+		ccb->idle_polls++;
+	} else {
+		cpu_core_halt();
+		now = bios_clock_hires();
+		ccb->idle_halts++;
+	}
+
+	/* Long idle periods only need to push the average over the limit */
+	TimerDuration period = now - start;
+	if (period > 8 * IDLE_POLL_MAX)
+		period = 8 * IDLE_POLL_MAX;
+	ccb->idle_avg = (7 * ccb->idle_avg + period) / 8;
+	sched_util_update(ccb, 0);
 }
 
 static void idle_thread()
@@ -507,7 +2714,7 @@ static void idle_thread()
 
 	/* We come here whenever we cannot find a ready thread for our core */
 	while (active_threads > 0) {
-		cpu_core_halt();
+		idle_wait(&CURCORE);
 		yield(SCHED_IDLE);
 	}
 
@@ -517,12 +2724,85 @@ static void idle_thread()
 }
 
 /*
-  Initialize the scheduler queue
+  Initialize the scheduler queues of all cores. This is done before
+  any core enters the scheduler, because the init task is made ready
+  during boot.
  */
 void initialize_scheduler()
 {
-	rlnode_init(&SCHED, NULL);
-	rlnode_init(&TIMEOUT_LIST, NULL);
+	/* The environment overrides the policy chosen by the program */
+	const char* name = getenv(SCHED_POLICY_ENV);
+	if (name != NULL && sched_select_policy(name) == -1)
+		fprintf(stderr, "%s: unknown scheduling policy '%s', using '%s'\n", 
+			SCHED_POLICY_ENV, name, sched_policies[sched_policy].name);
+	policy = &sched_policies[sched_policy];
+
+	/* The environment also turns on the trace */
+	sched_trace_path = getenv(SCHED_TRACE_ENV);
+
+	rlnode_init(&thread_pool, NULL);
+	thread_pool_count = 0;
+
+	for (uint g = 0; g < CPU_GROUPS; g++) {
+		memset(&cpu_groups[g], 0, sizeof(cpu_group));
+		cpu_groups[g].spinlock = MUTEX_INIT;
+	}
+
+	for (uint c = 0; c < cpu_cores(); c++) {
+		CCB* ccb = &cctx[c];
+		ccb->id = c;
+		ccb->sched_spinlock = MUTEX_INIT;
+		for (uint p = 0; p < PRIORITY_QUEUES; p++)
+			rlnode_init(&ccb->ready_queue[p], NULL);
+		ccb->ready_count = 0;
+		ccb->rt_queue = (sched_heap) { NULL, 0, 0 };
+		ccb->fair_queue = (sched_heap) { NULL, 0, 0 };
+		rlnode_init(&ccb->batch_queue, NULL);
+		ccb->batch_count = 0;
+		ccb->load = 0;
+		ccb->min_vruntime = 0;
+		ccb->timeout_heap = (sched_heap) { NULL, 0, 0 };
+		rlnode_init(&ccb->thread_cache, NULL);
+		ccb->thread_cache_count = 0;
+		ccb->tickless = 0;
+		ccb->timer_cause = SCHED_QUANTUM;
+		ccb->preempt = 0;
+		ccb->rseq_deferred = 0;
+		ccb->handoff = NULL;
+		ccb->yield_to = NULL;
+		ccb->curr_deadline = NO_TIMEOUT;
+		ccb->curr_batch = 0;
+		ccb->curr_gang = 0;
+		ccb->curr_group = -1;
+		ccb->curr_start = 0;
+		ccb->gang_next = NULL;
+		ccb->deadline_misses = 0;
+		ccb->alarms = 0;
+		ccb->context_switches = 0;
+		ccb->steals = 0;
+		ccb->rseq_overruns = 0;
+		ccb->trace = (sched_trace_path != NULL) ? 
+			xmalloc(SCHED_TRACE_EVENTS * sizeof(sched_trace_event)) : NULL;
+		ccb->trace_count = 0;
+		ccb->trace_dropped = 0;
+		ccb->steal_retry = 0;
+		ccb->idle_avg = 0;
+		ccb->idle_polls = 0;
+		ccb->idle_halts = 0;
+		ccb->util = 0;
+		ccb->util_stamp = bios_clock_hires();
+		ccb->idling = 0;
+		ccb->unpark_time = 0;
+		ccb->parks = 0;
+		ccb->unparks = 0;
+		memset(&ccb->hist, 0, sizeof(ccb->hist));
+		ccb->last_boost = bios_clock();
+	}
+
+	/* In consolidation mode, only core 0 starts unparked */
+	Mutex_Lock(&sched_park_spinlock);
+	sched_set_active_cores(sched_consolidate ? 1 : cpu_cores());
+	Mutex_Unlock(&sched_park_spinlock);
 }
 
 void run_scheduler()
@@ -539,13 +2819,32 @@ void run_scheduler()
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+	curcore->idle_thread.spinlock = MUTEX_INIT;
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
+	curcore->idle_thread.sched_ccb = curcore;
+	curcore->idle_thread.queued = 0;
 
 	curcore->idle_thread.its = QUANTUM;
 	curcore->idle_thread.rts = QUANTUM;
+	curcore->idle_thread.priority = 0;
+	curcore->idle_thread.affinity = CORE_BIT(curcore->id);
+	curcore->idle_thread.last_core = curcore->id;
+	curcore->idle_thread.migrations = 0;
+	curcore->idle_thread.nice = 0;
+	curcore->idle_thread.weight = NICE_0_WEIGHT;
+	curcore->idle_thread.vruntime = 0;
+	curcore->idle_thread.exec_start = 0;
+	curcore->idle_thread.rt_runtime = 0;
+	curcore->idle_thread.rt_misses = 0;
+	curcore->idle_thread.batch = 0;
+	curcore->idle_thread.gang = 0;
+	curcore->idle_thread.cpu_group = 0;
+	curcore->idle_thread.rseq = NULL;
 
 	curcore->idle_thread.curr_cause = SCHED_IDLE;
 	curcore->idle_thread.last_cause = SCHED_IDLE;
+	curcore->idle_thread.ready_time = 0;
+	memset(&curcore->idle_thread.hist, 0, sizeof(curcore->idle_thread.hist));
 
 	/* Initialize interrupt handler */
 	cpu_interrupt_handler(ALARM, yield_handler);
@@ -559,4 +2858,76 @@ void run_scheduler()
 	assert(CURTHREAD == &CURCORE.idle_thread);
 	cpu_interrupt_handler(ALARM, NULL);
 	cpu_interrupt_handler(ICI, NULL);
+
+	/* All threads have exited, so the heaps are empty */
+	assert(curcore->timeout_heap.count == 0 && curcore->fair_queue.count == 0 && 
+		curcore->rt_queue.count == 0);
+	free(curcore->rt_queue.node);
+	curcore->rt_queue = (sched_heap) { NULL, 0, 0 };
+	free(curcore->timeout_heap.node);
+	curcore->timeout_heap = (sched_heap) { NULL, 0, 0 };
+	free(curcore->fair_queue.node);
+	curcore->fair_queue = (sched_heap) { NULL, 0, 0 };
+}
+
+/*
+  Write the trace buffers of all cores to the trace file (see 
+  SCHED_TRACE_ENV), and release them.
+*/
+static void sched_trace_write()
+{
+	static const char state_code[] = { [READY] = 'R', [STOPPED] = 'S', [EXITED] = 'X' };
+
+	FILE* f = fopen(sched_trace_path, "w");
+	if (f == NULL)
+		fprintf(stderr, "%s: cannot write the trace to '%s'\n", SCHED_TRACE_ENV, sched_trace_path);
+	else
+		fprintf(f, "# tinyos scheduler trace: cores %u policy %s\n", cpu_cores(), policy->name);
+
+	unsigned long dropped = 0;
+	for (uint c = 0; c < cpu_cores(); c++) {
+		CCB* ccb = &cctx[c];
+		for (uint i = 0; f != NULL && i < ccb->trace_count; i++) {
+			sched_trace_event* e = &ccb->trace[i];
+			switch (e->type) {
+			case SCHED_TRACE_CREATE:
+				fprintf(f, "C %lu %#lx\n", e->time, e->tid);
+				break;
+			case SCHED_TRACE_WAKEUP:
+				fprintf(f, "W %lu %#lx\n", e->time, e->tid);
+				break;
+			case SCHED_TRACE_BURST:
+				fprintf(f, "B %lu %#lx %u %lu %u %c %d\n", e->time, e->tid, c, e->length, 
+					e->cause, state_code[e->state], e->nice);
+				break;
+			}
+		}
+		dropped += ccb->trace_dropped;
+		free(ccb->trace);
+		ccb->trace = NULL;
+	}
+
+	if (f != NULL) {
+		fprintf(f, "# dropped %lu\n", dropped);
+		fclose(f);
+	}
+}
+
+/*
+  Write the scheduler trace, if any, and free the thread pool (after all 
+  cores have left the scheduler).
+ */
+void finalize_scheduler()
+{
+	if (sched_trace_path != NULL)
+		sched_trace_write();
+
+	for (uint c = 0; c < cpu_cores(); c++) {
+		CCB* ccb = &cctx[c];
+		thread_list_move(&thread_pool, &ccb->thread_cache, ccb->thread_cache_count);
+		ccb->thread_cache_count = 0;
+	}
+	while (!is_rlist_empty(&thread_pool))
+		free_thread(rlist_pop_front(&thread_pool)->tcb);
+	thread_pool_count = 0;
 }
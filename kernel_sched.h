@@ -58,8 +58,8 @@ typedef enum {
   correctness:  
 
   > A TCB is in the scheduler
-  > queue, if and only if, its @c Thread_state is @c READY and the @c Thread_phase 
-  > is @c CTX_CLEAN.
+  > queue of some core, if and only if, its @c Thread_state is @c READY and the 
+  > @c Thread_phase is @c CTX_CLEAN.
 
   @see Thread_state
 */
@@ -88,9 +88,38 @@ enum SCHED_CAUSE {
 	SCHED_PIPE, /**< @brief Sleep at a pipe or socket */
 	SCHED_POLL, /**< @brief The thread is polling a device */
 	SCHED_IDLE, /**< @brief The idle thread called yield */
-	SCHED_USER /**< @brief User-space code called yield */
+	SCHED_USER, /**< @brief User-space code called yield */
+	SCHED_TIMEOUT, /**< @brief The timer expired for a sleep timeout, before the end of the time-slice */
+	SCHED_PREEMPT /**< @brief A real-time thread with an earlier deadline became ready */
 };
 
+/**
+  @brief A node of a scheduler heap.
+
+  A thread embeds a node for each heap that it can be in. The node
+  records its position in the heap, so that it can be removed in
+  @f$ O(\log n) @f$ time.
+
+  @see sched_heap
+ */
+typedef struct sched_heap_node {
+	TimerDuration key; /**< @brief The key of the node (the top of a heap has the smallest key) */
+	uint index; /**< @brief The position of the node in its heap */
+	TCB* tcb; /**< @brief The thread of the node */
+} heap_node;
+
+/**
+  @brief A binary min-heap of threads.
+
+  The heap is stored in an array, which is never grown by the scheduler
+  itself (see @c spawn_thread).
+ */
+typedef struct sched_heap {
+	heap_node** node; /**< @brief The array of the heap */
+	uint count; /**< @brief The number of nodes in the heap */
+	uint capacity; /**< @brief The allocated size of @c node */
+} sched_heap;
+
 /**
   @brief The thread control block
 
@@ -106,17 +135,58 @@ typedef struct thread_control_block {
 	Thread_state state; /**< @brief The state of the thread */
 	Thread_phase phase; /**< @brief The phase of the thread */
 
+	Mutex spinlock; /**< @brief Protects @c state, @c phase and @c wakeup_time.
+
+	  In order to also lock the scheduler data of some core, this lock must be 
+	  acquired first.
+	  */
+
 	void (*thread_func)(); /**< @brief The initial function executed by this thread */
 
-	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler */
+	void* stack; /**< @brief The lowest address of the stack of this thread */
+	size_t stack_size; /**< @brief The size of the stack of this thread */
+
+	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler, by @c bios_clock_hires() */
 
-	rlnode sched_node; /**< @brief Node to use when queueing in the scheduler queue */
+	rlnode sched_node; /**< @brief Node to use when queueing in the scheduler queue (MLFQ policy) or the batch queue */
+	CCB* sched_ccb; /**< @brief The core whose scheduler queue or timeout heap holds this thread */
+	int queued; /**< @brief Non-zero while this thread is in the scheduler queue of @c sched_ccb.
+		Protected by the @c sched_spinlock of @c sched_ccb */
+	heap_node timeout_node; /**< @brief Node in the timeout heap of @c sched_ccb, keyed by @c wakeup_time */
 	TimerDuration its; /**< @brief Initial time-slice for this thread */
 	TimerDuration rts; /**< @brief Remaining time-slice for this thread */
+	uint priority; /**< @brief The priority queue of this thread (0 is the highest priority) */
+	cpumask_t affinity; /**< @brief The cores this thread may run on. Protected by @c spinlock */
+	uint last_core; /**< @brief The core this thread ran on most recently (initially, the core that created it) */
+	unsigned long migrations; /**< @brief The number of times this thread ran on a core other than @c last_core */
+
+	int nice; /**< @brief The nice value of this thread, from @c NICE_MIN to @c NICE_MAX */
+	uint weight; /**< @brief The weight of this thread in the fair policy, determined by @c nice */
+	TimerDuration vruntime; /**< @brief The virtual run time of this thread, in the fair policy */
+	TimerDuration exec_start; /**< @brief The start of the current time-slice, by @c bios_clock_hires().
+		While the thread is not running, the time it last stopped running */
+	heap_node fair_node; /**< @brief Node in the fair queue of @c sched_ccb, keyed by @c vruntime */
+
+	TimerDuration rt_runtime; /**< @brief The cpu time per period of a real-time thread, or 0 for a normal thread */
+	TimerDuration rt_deadline; /**< @brief The deadline of a real-time thread, relative to the start of each period */
+	TimerDuration rt_period; /**< @brief The period of a real-time thread */
+	TimerDuration rt_abs_deadline; /**< @brief The current deadline of a real-time thread, by @c bios_clock_hires() */
+	TimerDuration rt_budget; /**< @brief The remaining cpu time of a real-time thread, until @c rt_abs_deadline */
+	unsigned long rt_misses; /**< @brief The number of deadlines missed by this thread */
+	heap_node rt_node; /**< @brief Node in the real-time queue of @c sched_ccb, keyed by @c rt_abs_deadline */
+
+	int batch; /**< @brief Non-zero for a thread of the batch class (unless it is real-time) */
+	int gang; /**< @brief The gang of this thread, or 0 if it is not in a gang */
+	int cpu_group; /**< @brief The cpu group of this thread, or 0 for the default group (see @c set_cpu_quota) */
+
+	rseq_area* rseq; /**< @brief The restartable sequence area of this thread, or NULL */
 
 	enum SCHED_CAUSE curr_cause; /**< @brief The endcause for the current time-slice */
 	enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
 
+	TimerDuration ready_time; /**< @brief The time this thread last became ready, by @c bios_clock_hires() */
+	sched_hist hist; /**< @brief The wait, run and endcause histograms of this thread */
+
 #ifndef NVALGRIND
 	unsigned valgrind_stack_id; /**< @brief Valgrind helper for stacks. 
 
@@ -136,15 +206,94 @@ typedef struct thread_control_block {
  */
 #define THREAD_STACK_SIZE (128 * 1024)
 
+/** @brief Minimum thread stack size.
+
+  Smaller stack sizes requested from @c spawn_thread_stack are rounded up to this.
+ */
+#define THREAD_STACK_MIN (16 * 1024)
+
 /************************
  *
  *      Scheduler
  *
  ************************/
 
+/** @brief Number of priority queues of the scheduler.
+
+  The MLFQ policy implements a multi-level feedback queue. A thread
+  whose quantum expires moves to the next (lower-priority) queue, whereas
+  a thread that sleeps on I/O or on a pipe moves to the previous 
+  (higher-priority) queue. Threads of lower priority get longer quanta: 
+  the quantum of priority @f$ p @f$ is @f$ 2^p @f$ times @c QUANTUM.
+
+  @see SCHED_CAUSE
+ */
+#define PRIORITY_QUEUES 4
+
+/** @brief The period (in microseconds) of priority boosting.
+
+  In order to avoid starvation of low-priority threads, every so often each core
+  moves all its threads to the highest priority queue.
+ */
+#define PRIORITY_BOOST_PERIOD (1000000L)
+
+/** @brief The weight of a thread with nice value 0.
+
+  In the fair policy, the virtual run time of a thread advances at a rate
+  of @c NICE_0_WEIGHT / @c weight, relative to its actual run time. Each
+  nice level changes the weight by a factor of about 1.25, so that two
+  threads one nice level apart get about 55% and 45% of a core.
+ */
+#define NICE_0_WEIGHT 1024
+
+/** @brief The quantum (in microseconds) of batch threads.
+
+  Batch threads that share a core take turns with this quantum, as long
+  as no other thread is ready on the core.
+ */
+#define BATCH_QUANTUM (10 * QUANTUM)
+
+/** @brief The maximum period (in microseconds) of a real-time thread. */
+#define RT_PERIOD_MAX (10000000L)
+
+/** @brief The shortest period of a cpu quota (usec).
+
+  A thread may overrun the quota of its group by up to @c TIMEOUT_MIN
+  per time-slice, so shorter periods would not be enforced well.
+ */
+#define QUOTA_PERIOD_MIN (1000L)
+
+/** @brief The longest period of a cpu quota (usec). */
+#define QUOTA_PERIOD_MAX (10000000L)
+
+/** @brief The maximum utilization of a core by real-time threads, in percent.
+
+  A real-time thread is only admitted if the total utilization 
+  (@c rt_runtime / @c rt_period) of all real-time threads does not exceed
+  this, times the number of cores. The rest is left for normal threads.
+ */
+#define RT_UTIL_MAX_PERCENT 95
+
+/** @brief The scheduling policies.
+
+  @see sched_policy
+ */
+enum SCHED_POLICY {
+	SCHED_POLICY_FAIR, /**< @brief Weighted fair scheduling, by virtual run time (the default) */
+	SCHED_POLICY_MLFQ, /**< @brief The multi-level feedback queue, by priority */
+	SCHED_POLICY_FIFO, /**< @brief Round-robin with a fixed quantum, as the original scheduler */
+	SCHED_POLICIES /**< @brief The number of scheduling policies */
+};
+
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
+
+  Each core has its own scheduler queues of @c READY threads (a heap by deadline
+  for real-time threads, one queue per priority for the MLFQ policy, or a 
+  heap by virtual run time for the fair policy, and a queue of batch threads), 
+  and its own heap of threads sleeping with a timeout. These are protected by the core's @c sched_spinlock. 
+  A core whose queues are empty steals threads from the queues of other cores.
  */
 typedef struct core_control_block {
 	uint id; /**< @brief The core id */
@@ -153,6 +302,57 @@ typedef struct core_control_block {
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 
+	Mutex sched_spinlock; /**< @brief Protects @c rt_queue, @c ready_queue, @c fair_queue, @c batch_queue and @c timeout_heap */
+	sched_heap rt_queue; /**< @brief The real-time threads of this core, by @c rt_abs_deadline */
+	rlnode ready_queue[PRIORITY_QUEUES]; /**< @brief The scheduler queues of this core, by priority (MLFQ policy) */
+	sched_heap fair_queue; /**< @brief The scheduler queue of this core, by @c vruntime (fair policy) */
+	rlnode batch_queue; /**< @brief The batch threads of this core, in round-robin order */
+	volatile uint ready_count; /**< @brief The number of threads in the scheduler queues */
+	uint batch_count; /**< @brief The number of threads in @c batch_queue */
+	unsigned long load; /**< @brief The total weight of the threads in @c fair_queue */
+	TimerDuration min_vruntime; /**< @brief The (non-decreasing) virtual run time of this core */
+	sched_heap timeout_heap; /**< @brief The threads that went to sleep on this core with a timeout, by @c wakeup_time */
+	TimerDuration last_boost; /**< @brief The time of the last priority boost */
+
+	rlnode thread_cache; /**< @brief Free threads kept for reuse by this core */
+	uint thread_cache_count; /**< @brief The length of @c thread_cache */
+
+	int tickless; /**< @brief Non-zero if the timer is not armed for the end of the current time-slice */
+	enum SCHED_CAUSE timer_cause; /**< @brief The cause reported when the timer expires */
+	int preempt; /**< @brief Non-zero if the current thread must yield to a real-time thread */
+	int steal_retry; /**< @brief Non-zero if this core left a cache-hot thread in the queue of another core, at its last scheduling decision */
+	TCB* handoff; /**< @brief A thread of our queue, woken up by the current thread, which gets the core if the current thread sleeps */
+	TCB* yield_to; /**< @brief A thread of our queue, to which the current thread donates the core at its next yield (see @c sched_donate) */
+	TimerDuration curr_deadline; /**< @brief The deadline of the current thread, or @c NO_TIMEOUT for a normal thread */
+	int curr_batch; /**< @brief Non-zero if the current thread is a batch thread */
+	volatile int curr_gang; /**< @brief The gang of the current thread, or 0 */
+	TCB* gang_next; /**< @brief A gang thread of our queue, which preempts the current thread to join its gang */
+	int rseq_deferred; /**< @brief Non-zero if a preemption of the current thread was deferred, while it commits a restartable sequence */
+	volatile int curr_group; /**< @brief The cpu group of the current thread, or -1 for the idle thread */
+	volatile TimerDuration curr_start; /**< @brief The time the current thread was last charged to its cpu group */
+	unsigned long deadline_misses; /**< @brief The number of deadlines missed on this core */
+	unsigned long alarms; /**< @brief The number of timer interrupts of this core */
+	unsigned long context_switches; /**< @brief The number of context switches of this core */
+	unsigned long steals; /**< @brief The number of threads this core stole from other cores */
+	unsigned long rseq_overruns; /**< @brief The number of threads preempted while committing a restartable sequence, after @c RSEQ_GRACE */
+
+	struct sched_trace_event* trace; /**< @brief The trace buffer of this core, or NULL if tracing is off */
+	uint trace_count; /**< @brief The number of events in @c trace */
+	unsigned long trace_dropped; /**< @brief The number of events that did not fit in @c trace */
+
+	TimerDuration idle_avg; /**< @brief The moving average of the idle periods of this core (usec) */
+	unsigned long idle_polls; /**< @brief The number of idle periods which ended while polling */
+	unsigned long idle_halts; /**< @brief The number of idle periods in which this core halted */
+
+	unsigned int util; /**< @brief The moving average of the busy fraction of this core, out of @c UTIL_SCALE (see @c PARK_WINDOW) */
+	TimerDuration util_stamp; /**< @brief The time @c util was last updated */
+	int idling; /**< @brief Non-zero while the idle thread waits for work (since @c util_stamp) */
+	TimerDuration unpark_time; /**< @brief The time this core was last unparked */
+	unsigned long parks; /**< @brief The number of times this core was parked */
+	unsigned long unparks; /**< @brief The number of times this core was unparked */
+
+	sched_hist hist; /**< @brief The wait, run and endcause histograms of the threads of this core (except the idle thread) */
+
 } CCB;
 
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
@@ -202,6 +402,198 @@ TCB* cur_thread();
 */
 TCB* spawn_thread(PCB* pcb, void (*func)());
 
+/**
+	@brief Create a new thread with a given stack size.
+
+	This is like @c spawn_thread, but the new thread gets a stack of 
+	@c stack_size bytes (rounded up to a page, and to at least 
+	@c THREAD_STACK_MIN), instead of @c THREAD_STACK_SIZE. 
+	Stack memory is committed on demand, when it is touched, and
+	a stack overflow causes a segmentation fault.
+
+    @param pcb  The process control block of the owning process.
+    @param func The function to execute in the new thread.
+    @param stack_size The requested stack size, in bytes.
+    @returns  A pointer to the TCB of the new thread, in the @c INIT state.
+    @see spawn_thread
+*/
+TCB* spawn_thread_stack(PCB* pcb, void (*func)(), size_t stack_size);
+
+/**
+	@brief Return the high-water mark of the stack of a thread.
+
+	This is the number of bytes from the top of the stack down to the
+	lowest stack page that has been touched (and thus committed) since the
+	thread was spawned. It is accurate to a page.
+
+	@param tcb the thread
+	@returns the high-water mark of the stack, in bytes
+*/
+size_t thread_stack_high_water(TCB* tcb);
+
+/**
+	@brief Set the cpu affinity of a thread.
+
+	The thread will only be scheduled on the cores in @c mask (cores beyond
+	@c cpu_cores() are ignored). A queued thread is moved to an allowed core. 
+	If @c tcb is the current thread and the current core is not allowed, the
+	thread yields, and resumes on an allowed core.
+
+	@param tcb the thread
+	@param mask the set of allowed cores
+	@returns 0 on success, or -1 if @c mask contains no core of the machine
+*/
+int set_thread_affinity(TCB* tcb, cpumask_t mask);
+
+/**
+	@brief Set the nice value of a thread.
+
+	The weight of the thread in the fair policy is changed accordingly.
+	This has no effect in the MLFQ policy.
+
+	@param tcb the thread
+	@param nice the new nice value
+	@returns 0 on success, or -1 if @c nice is not between @c NICE_MIN
+	  and @c NICE_MAX
+*/
+int set_thread_nice(TCB* tcb, int nice);
+
+/**
+	@brief Set the real-time parameters of a thread.
+
+	A thread with non-zero @c runtime enters the real-time class: in every 
+	@c period, it is guaranteed @c runtime microseconds of cpu time before 
+	its @c deadline (relative to the start of the period). Ready real-time
+	threads run before all normal threads, earliest deadline first. A thread
+	that exhausts its runtime has its deadline postponed by a period, so that
+	it cannot take more than its share of cpu time from other real-time 
+	threads. A thread with zero @c runtime returns to the normal class.
+
+	@param tcb the thread
+	@param runtime the cpu time per period, in microseconds, or 0
+	@param deadline the relative deadline, in microseconds
+	@param period the period, in microseconds
+	@returns 0 on success, or -1 if the parameters are not valid
+	  (@c runtime <= @c deadline <= @c period <= @c RT_PERIOD_MAX), or if
+	  the thread is not admitted, because the real-time utilization would
+	  exceed @c RT_UTIL_MAX_PERCENT of the cores.
+*/
+int set_thread_deadline(TCB* tcb, TimerDuration runtime, TimerDuration deadline, TimerDuration period);
+
+/**
+	@brief Move a thread to the batch class, or back to the normal class.
+
+	Ready batch threads run only when no normal or real-time thread is ready
+	on their core, round-robin with a quantum of @c BATCH_QUANTUM, and a 
+	normal thread that becomes ready on the core preempts a batch thread at 
+	once. A real-time thread stays in the real-time class; it is a batch
+	thread when it returns to the normal class.
+
+	@param tcb the thread
+	@param batch non-zero for the batch class, zero for the normal class
+*/
+void set_thread_batch(TCB* tcb, int batch);
+
+/**
+	@brief Put a thread in a gang, or take it out of its gang.
+
+	The normal threads of a gang are co-scheduled: a gang thread that wakes
+	up while another thread of its gang is running goes to a core which is
+	not running its gang (preferably the core it last ran on), and it 
+	preempts the current thread of that core at once, unless that thread
+	is real-time or in a gang itself. Thus, threads that synchronize often
+	(e.g., at a barrier) do not wait for a sibling that waits for a core.
+	Gangs are co-scheduled only if the host has a cpu for every core.
+
+	@param tcb the thread
+	@param gang the gang, a positive number, or 0 for no gang
+*/
+void set_thread_gang(TCB* tcb, int gang);
+
+/**
+	@brief Move a thread to a cpu group.
+
+	The normal and batch threads of a cpu group share its quota (see 
+	@c set_cpu_quota). Real-time threads are limited by their own runtime
+	instead, but their cpu time is charged to their group.
+
+	@param tcb the thread
+	@param group the group, from 0 (the default group) to @c CPU_GROUPS-1
+*/
+void set_thread_cpu_group(TCB* tcb, int group);
+
+/**
+	@brief Set the cpu quota of a cpu group.
+
+	The threads of the group may use @c quota microseconds of cpu time, 
+	in total over all cores, in every @c period. When a thread of the group
+	stops running after the group has used up its quota, it is throttled:
+	it is taken off the scheduler queues, and it sleeps until the next 
+	period. A thread is not throttled while it holds the kernel lock, and
+	it is charged its whole time-slice; the time-slice of a thread is
+	cut short when the quota of its group runs out, so the group overruns
+	its quota by less than a time-slice per core. A zero @c quota
+	removes the limit. Changing the quota starts a new period.
+
+	@param group the group, from 1 to @c CPU_GROUPS-1
+	@param quota the cpu time per period, in microseconds, or 0
+	@param period the period, in microseconds
+	@returns 0 on success, or -1 if the parameters are not valid (the 
+	  period must be from @c QUOTA_PERIOD_MIN to @c QUOTA_PERIOD_MAX, and
+	  the quota at most @c cpu_cores() periods)
+*/
+int set_cpu_quota(int group, TimerDuration quota, TimerDuration period);
+
+/**
+	@brief Return the quota and the usage counters of a cpu group.
+
+	@param group the group, from 0 to @c CPU_GROUPS-1
+	@param q a location where the quota and the counters are stored
+*/
+void get_cpu_quota(int group, cpu_quota* q);
+
+/**
+  @brief Register the restartable sequence area of a thread.
+
+  While the area is registered, the scheduler keeps its @c cpu_id current,
+  and aborts a sequence in progress when the thread resumes after another
+  thread ran on its core, or on another core.
+
+  @param tcb the thread, which must be the current thread
+  @param rs the area, or NULL
+  */
+void set_thread_rseq(TCB* tcb, rseq_area* rs);
+
+/**
+  @brief Yield for a preemption that was deferred during @c RseqCommit.
+
+  The timer or an interrupt from another core does not preempt a thread 
+  which is committing a restartable sequence (a few instructions). Instead,
+  it sets @c rs->deferred, and the thread calls this right after. If the
+  thread is still committing after @c RSEQ_GRACE, it is preempted anyway.
+
+  @param rs the area of the current thread
+  */
+void rseq_deferred_yield(rseq_area* rs);
+
+/**
+  @brief Prepare to donate the core of the current thread to another thread.
+
+  If @c tcb is @c READY in some scheduler queue, and it may run on the 
+  current core, it is moved to the queue of the current core. Then, at
+  the next @c yield(SCHED_USER) of the current thread, it gets the core
+  with the rest of the time-slice of the current thread, like a handoff
+  thread, unless a thread of a higher class is ready. If the thread 
+  leaves the queue before that (e.g., it is stolen), or the current 
+  thread is preempted first, the donation is cancelled, and the yield 
+  is a normal one.
+
+  @param tcb the thread, which must not be released during the call
+  @returns 1 if the donation was prepared, or 0 if @c tcb is not in a 
+     queue (e.g., it is running or sleeping) or may not run on this core
+  */
+int sched_donate(TCB* tcb);
+
 /**
   @brief Wakeup a blocked thread.
 
@@ -214,6 +606,22 @@ TCB* spawn_thread(PCB* pcb, void (*func)());
 */
 int wakeup(TCB* tcb);
 
+/**
+  @brief Wakeup many blocked threads at once.
+
+  This is equivalent to calling @c wakeup() on each thread, but most 
+  threads are made @c READY under a single acquisition of the scheduler 
+  lock of the current core, and as many halted cores are restarted 
+  as there are new runnable threads.
+
+  @param tcbs an array of @c n threads. On return, the threads which were
+         not woken up (because they were not @c STOPPED or @c INIT) are 
+         replaced by @c NULL.
+  @param n the number of threads in @c tcbs
+  @returns the number of threads woken up
+*/
+uint wakeup_many(TCB** tcbs, uint n);
+
 /** 
   @brief Block the current thread.
 
@@ -271,6 +679,14 @@ void run_scheduler(void);
  */
 void initialize_scheduler(void);
 
+/**
+  @brief Finalize the scheduler.
+
+  This function is called after all cores have left the scheduler, 
+  to free the pool of released threads.
+ */
+void finalize_scheduler(void);
+
 /**
   @brief Quantum (in microseconds) 
 
@@ -278,6 +694,276 @@ void initialize_scheduler(void);
   */
 #define QUANTUM (10000L)
 
+/**
+  @brief Scheduling latency (in microseconds)
+
+  The quantum is adaptive: the threads in the scheduler queue of a core
+  (plus the one selected to run) share a period of @c SCHED_LATENCY, so
+  that short queues get long quanta (and fewer context switches), and 
+  long queues get short quanta (and better latency). The result is 
+  further scaled by priority.
+  */
+#define SCHED_LATENCY (4 * QUANTUM)
+
+/**
+  @brief Minimum quantum (in microseconds) 
+
+  The adaptive quantum is never shorter than this.
+  */
+#define MIN_QUANTUM (2000L)
+
+/**
+  @brief Minimum timer delay for a timeout (in microseconds)
+
+  Sleep timeouts are by @c bios_clock_hires(), and the timer of a core is 
+  armed for the earliest one. A timeout that has passed arms the timer for
+  this long, to try again.
+  */
+#define TIMEOUT_MIN (20L)
+
+/**
+  @brief Maximum deferral of a preemption during @c RseqCommit (in microseconds)
+
+  A thread which is committing a restartable sequence is not preempted at 
+  once, but only if it is still committing this long after the first 
+  deferred preemption. The flag is in user memory, so a thread which sets
+  it and never clears it would otherwise keep its core forever.
+  */
+#define RSEQ_GRACE QUANTUM
+
+/**
+  @brief Maximum idle polling time (in microseconds)
+
+  An idle core polls the scheduler queues for new work before halting,
+  for up to twice its average idle period, if that average is at most 
+  @c IDLE_POLL_MAX. 
+  */
+#define IDLE_POLL_MAX (50L)
+
+/**
+  @brief Migration cost (in microseconds)
+
+  A thread that stopped running on a core within this time is cache-hot:
+  an idle core does not steal it from the queue of that core, unless 
+  the queue holds at least @c MIGRATE_IMBALANCE threads. This does not 
+  apply when the VM has more cores than the host.
+  */
+#define MIGRATE_COST (500L)
+
+/**
+  @brief Migration imbalance threshold (in ready threads)
+
+  @see MIGRATE_COST
+  */
+#define MIGRATE_IMBALANCE 2
+
+/**
+  @brief The scale of core utilization
+
+  @see CCB::util
+  */
+#define UTIL_SCALE 1024
+
+/**
+  @brief Core parking window (in microseconds)
+
+  The utilization of a core is a moving average of its busy fraction, 
+  over about this time. A core that was unparked counts as fully utilized,
+  and it is not parked again, within this time.
+
+  @see sched_consolidate
+  */
+#define PARK_WINDOW (10000L)
+
+/**
+  @brief Core parking utilization (out of @c UTIL_SCALE)
+
+  The highest unparked core is parked when it becomes idle, if the total 
+  utilization of the unparked cores would fit in the rest of them, at 
+  most this much each.
+
+  @see sched_consolidate
+  */
+#define PARK_UTIL 768
+
+/**
+  @brief Tickless mode.
+
+  When non-zero (the default), the scheduler does not arm the preemption
+  timer of a core when there is no other thread to run on it. Instead, the
+  timer is only armed for the earliest sleep timeout of the core, if any. 
+  An idle core then stays halted until there is work to do, and a thread 
+  that runs alone on its core is never interrupted.
+
+  This must be set before @c boot().
+  */
+extern int sched_tickless;
+
+/**
+  @brief The scheduling policy.
+
+  In the fair policy (the default), each thread accumulates virtual run time,
+  at a rate inversely proportional to its weight, and each core runs the
+  thread of its queue with the least virtual run time. Therefore, threads
+  that compete for a core get shares of it proportional to their weights. 
+  The time-slice of a thread is its share of @c SCHED_LATENCY.
+
+  In the MLFQ policy, threads are scheduled round-robin within their
+  priority, and the priority is adjusted by the scheduler. In the fifo 
+  policy, threads are scheduled round-robin with a fixed @c QUANTUM, as 
+  in the original scheduler.
+
+  The default is the fair policy, although the original scheduler was 
+  round-robin: @c SetPriority promises threads shares of a core by their 
+  nice values, and only the fair policy keeps that promise. Programs that
+  depend on the original behavior can select the fifo policy.
+
+  This must be set before @c boot(). If the environment variable 
+  @c SCHED_POLICY_ENV names a policy, it overrides this at boot.
+
+  @see sched_ops
+  */
+extern enum SCHED_POLICY sched_policy;
+
+/**
+  @brief The environment variable that selects the scheduling policy.
+
+  Its value is the name of a policy, "fair", "mlfq" or "fifo". This way, 
+  the policies can be compared on the same programs, e.g., 
+  @c "TINYOS_SCHED=mlfq ./validate_api". The "fifo" policy schedules 
+  normal threads as the original scheduler did, so it serves as the 
+  control of such comparisons.
+  */
+#define SCHED_POLICY_ENV "TINYOS_SCHED"
+
+/**
+  @brief Set @c sched_policy by name.
+
+  Return 0 on success, or -1 if there is no policy by this name.
+  This must be called before @c boot().
+  */
+int sched_select_policy(const char* name);
+
+/**
+  @brief The operations of a scheduling policy.
+
+  A policy orders the normal threads only: real-time and batch threads have
+  their own queues, and they always run before and after normal threads, 
+  respectively. The operations are called with the @c sched_spinlock of 
+  the core held, except for @c on_tick. Optional operations may be NULL.
+
+  A new policy adds its queues to the CCB, and its operations to the table
+  of policies in kernel_sched.c.
+
+  The operations touch only the CCB and the TCBs they are given, so that
+  tools (such as the @c sched_sim simulator) can run them on CCBs and 
+  TCBs of their own, outside the kernel.
+  */
+struct sched_ops {
+	const char* name; /**< @brief The name of the policy, for @c SCHED_POLICY_ENV */
+
+	/** @brief Insert a normal thread into the queues of a core */
+	void (*enqueue)(CCB* ccb, TCB* tcb);
+
+	/** @brief Remove a normal thread from the queues of a core */
+	void (*dequeue)(CCB* ccb, TCB* tcb);
+
+	/** @brief Return the next normal thread of a core allowed to run on @c core, or NULL */
+	TCB* (*pick_next)(CCB* ccb, uint core);
+
+	/** @brief Return true if the normal thread @c a should run before @c b */
+	int (*runs_before)(TCB* a, TCB* b);
+
+	/** @brief Return the time-slice of a normal thread, before the @c MIN_QUANTUM floor */
+	TimerDuration (*quantum)(CCB* ccb, TCB* tcb);
+
+	/** @brief Called at the end of each time-slice of the current thread of core @c ccb,
+	    at time @c now by @c bios_clock() (optional) */
+	void (*on_tick)(CCB* ccb, TCB* current, enum SCHED_CAUSE cause, TimerDuration now);
+
+	/** @brief Called when a thread is about to enter the queues of a core, 
+	    after waking up or moving from another core (optional) */
+	void (*on_wakeup)(CCB* ccb, TCB* tcb);
+
+	/** @brief Called when a normal thread is selected to run on a core (optional) */
+	void (*on_pick)(CCB* ccb, TCB* tcb);
+};
+
+/**
+  @brief Return the operations of a scheduling policy, or NULL if @c p is
+  not a policy.
+  */
+const struct sched_ops* sched_policy_ops(enum SCHED_POLICY p);
+
+/**
+  @brief Return the weight of a nice value in the fair policy.
+  */
+uint sched_nice_weight(int nice);
+
+/**
+  @brief Consolidation mode.
+
+  When non-zero, the scheduler keeps the work on as few cores as the load
+  needs, and parks the rest (the default is zero). The unparked cores are
+  always the lowest-numbered ones. Threads are placed only on unparked 
+  cores (unless their affinity allows only parked ones), parked cores do 
+  not steal, and they are not restarted when threads are added to the
+  queues (see @c cpu_core_park()). Therefore, under light load, fewer
+  cores halt and restart.
+
+  When a thread is added to a queue, the next core is unparked if the ready
+  threads of the unparked cores outnumber their idle cores, and their total
+  utilization exceeds @c PARK_UTIL per core. The highest unparked core is 
+  parked when it becomes idle, if the others can take its load, but not 
+  within @c PARK_WINDOW of being unparked. Core 0 is never parked.
+
+  This must be set before @c boot().
+  */
+extern int sched_consolidate;
+
+/**
+  @brief The environment variable that enables the scheduler trace.
+
+  If it names a file, each core records the scheduling events of its 
+  threads (except the idle thread) in a buffer of @c SCHED_TRACE_EVENTS 
+  events, and the buffers are written to the file when the kernel shuts 
+  down. The trace can be replayed against each policy with @c sched_sim.
+  The file has one event per line, by core and then by time:
+
+    - @c "C <time> <tid>": the thread was created
+    - @c "W <time> <tid>": the thread became ready
+    - @c "B <time> <tid> <core> <length> <cause> <state> <nice>": the thread
+      ran on the core from @c time for @c length, the time-slice ended
+      with @c cause (a @c SCHED_CAUSE), and then the thread was ready
+      (@c R), stopped (@c S) or exited (@c X)
+
+  Times are in microseconds, by @c bios_clock_hires(). Lines starting with
+  @c '#' are comments: the first one gives the number of cores and the 
+  policy, and the last one the number of events that did not fit.
+  */
+#define SCHED_TRACE_ENV "TINYOS_SCHED_TRACE"
+
+/** @brief The capacity of the trace buffer of each core, in events */
+#define SCHED_TRACE_EVENTS (1u << 18)
+
+/** @brief The kinds of events of the scheduler trace */
+enum SCHED_TRACE_TYPE {
+	SCHED_TRACE_CREATE, /**< @brief A thread was created */
+	SCHED_TRACE_WAKEUP, /**< @brief A thread became ready */
+	SCHED_TRACE_BURST   /**< @brief A thread ran for a time-slice */
+};
+
+/** @brief An event of the scheduler trace */
+typedef struct sched_trace_event {
+	TimerDuration time; /**< @brief The time of the event, or the start of the time-slice */
+	TimerDuration length; /**< @brief The length of the time-slice (bursts only) */
+	uintptr_t tid; /**< @brief The thread */
+	unsigned char type; /**< @brief A @c SCHED_TRACE_TYPE */
+	unsigned char cause; /**< @brief The @c SCHED_CAUSE that ended the time-slice (bursts only) */
+	unsigned char state; /**< @brief The @c Thread_state after the time-slice (bursts only) */
+	signed char nice; /**< @brief The nice value of the thread (bursts only) */
+} sched_trace_event;
+
 /** @} */
 
 #endif
@@ -6,6 +6,7 @@
 
 #define SYSCALLS \
 SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(ExecStack, Pid_t, (Task task, int argl, void* args, size_t stack_size), (task, argl, args, stack_size))\
 SYSCALLV(Exit, (int exitval), (exitval))\
 SYSCALL(GetPid, int, (void), ())\
 SYSCALL(GetPPid, int, (void), ())\
@@ -15,6 +16,24 @@ SYSCALL(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
 SYSCALLV(ThreadExit, (int exitval), (exitval))\
+SYSCALL(GetStackInfo, int, (Tid_t tid, stack_info* info), (tid, info))\
+SYSCALL(SetThreadAffinity, int, (Tid_t tid, cpumask_t mask), (tid, mask))\
+SYSCALL(GetThreadAffinity, int, (Tid_t tid, cpumask_t* mask), (tid, mask))\
+SYSCALL(GetThreadStats, int, (Tid_t tid, thread_stats* stats), (tid, stats))\
+SYSCALL(SetPriority, int, (Tid_t tid, int nice), (tid, nice))\
+SYSCALL(GetPriority, int, (Tid_t tid, int* nice), (tid, nice))\
+SYSCALL(SetDeadline, int, (Tid_t tid, const deadline_attr* attr), (tid, attr))\
+SYSCALL(GetDeadline, int, (Tid_t tid, deadline_attr* attr), (tid, attr))\
+SYSCALL(SetBatch, int, (Tid_t tid, int batch), (tid, batch))\
+SYSCALL(GetBatch, int, (Tid_t tid, int* batch), (tid, batch))\
+SYSCALL(SetGang, int, (Tid_t tid, int gang), (tid, gang))\
+SYSCALL(GetGang, int, (Tid_t tid, int* gang), (tid, gang))\
+SYSCALL(SetCpuGroup, int, (Tid_t tid, int group), (tid, group))\
+SYSCALL(GetCpuGroup, int, (Tid_t tid, int* group), (tid, group))\
+SYSCALL(SetCpuQuota, int, (int group, const cpu_quota* q), (group, q))\
+SYSCALL(GetCpuQuota, int, (int group, cpu_quota* q), (group, q))\
+SYSCALL(RseqRegister, int, (rseq_area* rs), (rs))\
+SYSCALL(YieldTo, int, (Tid_t tid), (tid))\
 SYSCALL(GetTerminalDevices, unsigned int, (), ())\
 SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
 SYSCALL(OpenNull, Fid_t, (), ())\
@@ -29,6 +48,7 @@ SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
 SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
 SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
 SYSCALL(OpenInfo, Fid_t, (), ())\
+SYSCALL(OpenSchedInfo, Fid_t, (), ())\
 
 
 
@@ -2,6 +2,19 @@
 #include "tinyos.h"
 #include "kernel_sched.h"
 #include "kernel_proc.h"
+#include "kernel_cc.h"
+
+/*
+  Return the TCB of a thread of the current process, or NULL if there
+  is no such thread. NOTHREAD stands for the current thread.
+ */
+static TCB* get_thread(Tid_t tid)
+{
+  TCB* tcb = (tid == NOTHREAD) ? cur_thread() : (TCB*) tid;
+
+  /* The only thread of a process is its main thread */
+  return (tcb == CURPROC->main_thread) ? tcb : NULL;
+}
 
 /** 
   @brief Create a new thread in the current process.
@@ -43,3 +56,242 @@ void sys_ThreadExit(int exitval)
 
 }
 
+/**
+  @brief Return information about the stack of a thread.
+  */
+int sys_GetStackInfo(Tid_t tid, stack_info* info)
+{
+  TCB* tcb = get_thread(tid);
+  if(info == NULL || tcb == NULL)
+    return -1;
+
+  info->size = tcb->stack_size;
+  info->high_water = thread_stack_high_water(tcb);
+  return 0;
+}
+
+/**
+  @brief Set the cpu affinity of a thread.
+  */
+int sys_SetThreadAffinity(Tid_t tid, cpumask_t mask)
+{
+  TCB* tcb = get_thread(tid);
+  if(tcb == NULL)
+    return -1;
+
+  return set_thread_affinity(tcb, mask);
+}
+
+/**
+  @brief Get the cpu affinity of a thread.
+  */
+int sys_GetThreadAffinity(Tid_t tid, cpumask_t* mask)
+{
+  TCB* tcb = get_thread(tid);
+  if(mask == NULL || tcb == NULL)
+    return -1;
+
+  *mask = tcb->affinity;
+  return 0;
+}
+
+/**
+  @brief Return scheduling statistics of a thread.
+  */
+int sys_GetThreadStats(Tid_t tid, thread_stats* stats)
+{
+  TCB* tcb = get_thread(tid);
+  if(stats == NULL || tcb == NULL)
+    return -1;
+
+  stats->last_core = tcb->last_core;
+  stats->migrations = tcb->migrations;
+  return 0;
+}
+
+/**
+  @brief Set the nice value of a thread.
+  */
+int sys_SetPriority(Tid_t tid, int nice)
+{
+  TCB* tcb = get_thread(tid);
+  if(tcb == NULL)
+    return -1;
+
+  return set_thread_nice(tcb, nice);
+}
+
+/**
+  @brief Get the nice value of a thread.
+  */
+int sys_GetPriority(Tid_t tid, int* nice)
+{
+  TCB* tcb = get_thread(tid);
+  if(nice == NULL || tcb == NULL)
+    return -1;
+
+  *nice = tcb->nice;
+  return 0;
+}
+
+/**
+  @brief Set the real-time parameters of a thread.
+  */
+int sys_SetDeadline(Tid_t tid, const deadline_attr* attr)
+{
+  TCB* tcb = get_thread(tid);
+  if(tcb == NULL)
+    return -1;
+
+  if(attr == NULL)
+    return set_thread_deadline(tcb, 0, 0, 0);
+  if(attr->runtime == 0)
+    return -1;
+  return set_thread_deadline(tcb, attr->runtime, attr->deadline, attr->period);
+}
+
+/**
+  @brief Get the real-time parameters of a thread.
+  */
+int sys_GetDeadline(Tid_t tid, deadline_attr* attr)
+{
+  TCB* tcb = get_thread(tid);
+  if(attr == NULL || tcb == NULL)
+    return -1;
+
+  attr->runtime = tcb->rt_runtime;
+  attr->deadline = tcb->rt_deadline;
+  attr->period = tcb->rt_period;
+  attr->misses = tcb->rt_misses;
+  return 0;
+}
+
+/**
+  @brief Move a thread to the batch class, or back to the normal class.
+  */
+int sys_SetBatch(Tid_t tid, int batch)
+{
+  TCB* tcb = get_thread(tid);
+  if(tcb == NULL)
+    return -1;
+
+  set_thread_batch(tcb, batch);
+  return 0;
+}
+
+/**
+  @brief Return whether a thread is in the batch class.
+  */
+int sys_GetBatch(Tid_t tid, int* batch)
+{
+  TCB* tcb = get_thread(tid);
+  if(batch == NULL || tcb == NULL)
+    return -1;
+
+  *batch = tcb->batch;
+  return 0;
+}
+
+/**
+  @brief Put a thread in a gang, or take it out of its gang.
+  */
+int sys_SetGang(Tid_t tid, int gang)
+{
+  TCB* tcb = get_thread(tid);
+  if(tcb == NULL || gang < 0)
+    return -1;
+
+  set_thread_gang(tcb, gang);
+  return 0;
+}
+
+/**
+  @brief Return the gang of a thread.
+  */
+int sys_GetGang(Tid_t tid, int* gang)
+{
+  TCB* tcb = get_thread(tid);
+  if(gang == NULL || tcb == NULL)
+    return -1;
+
+  *gang = tcb->gang;
+  return 0;
+}
+
+/**
+  @brief Move a thread to a cpu group.
+  */
+int sys_SetCpuGroup(Tid_t tid, int group)
+{
+  TCB* tcb = get_thread(tid);
+  if(tcb == NULL || group < 0 || group >= CPU_GROUPS)
+    return -1;
+
+  set_thread_cpu_group(tcb, group);
+  return 0;
+}
+
+/**
+  @brief Return the cpu group of a thread.
+  */
+int sys_GetCpuGroup(Tid_t tid, int* group)
+{
+  TCB* tcb = get_thread(tid);
+  if(group == NULL || tcb == NULL)
+    return -1;
+
+  *group = tcb->cpu_group;
+  return 0;
+}
+
+/**
+  @brief Limit the cpu time of a cpu group.
+  */
+int sys_SetCpuQuota(int group, const cpu_quota* q)
+{
+  if(q == NULL)
+    return set_cpu_quota(group, 0, 0);
+  if(q->quota == 0)
+    return -1;
+  return set_cpu_quota(group, q->quota, q->period);
+}
+
+/**
+  @brief Return the quota of a cpu group and its usage counters.
+  */
+int sys_GetCpuQuota(int group, cpu_quota* q)
+{
+  if(q == NULL || group < 0 || group >= CPU_GROUPS)
+    return -1;
+
+  get_cpu_quota(group, q);
+  return 0;
+}
+
+/**
+  @brief Register the restartable sequence area of the current thread.
+  */
+int sys_RseqRegister(rseq_area* rs)
+{
+  set_thread_rseq(cur_thread(), rs);
+  return 0;
+}
+
+/**
+  @brief Yield the core, donating it to a thread if it is ready.
+  */
+int sys_YieldTo(Tid_t tid)
+{
+  TCB* tcb = get_tcb(tid);
+  if(tcb == NULL)
+    return -1;
+
+  if(tcb != cur_thread())
+    sched_donate(tcb);
+
+  /* Yield without the kernel lock, which the thread may need */
+  kernel_unlock();
+  yield(SCHED_USER);
+  kernel_lock();
+  return 0;
+}
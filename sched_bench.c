@@ -0,0 +1,1379 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "util.h"
+#include "bios.h"
+#include "tinyos.h"
+#include "tinyoslib.h"
+#include "kernel_sched.h"
+
+
+/*
+	A benchmark suite for the tinyos scheduler.
+
+	Where bios_bench measures the virtual machine, this program boots
+	the kernel and measures the scheduler through the system calls.
+	Each benchmark runs inside the init task and prints its results
+	as lines of the form
+
+	  <benchmark>.<metric>   <value>   <unit>
+
+	All times are measured with the host's CLOCK_MONOTONIC.
+
+	Usage:  ./sched_bench [-c <cores>] [-n <waiters>] [-r <rounds>] [-T] [-M] [-S <policy>] [-P] [-H] [<benchmark> ...]
+
+	Option -T disables the tickless mode of the scheduler, option -M
+	selects the MLFQ scheduling policy instead of the fair policy (as
+	does -S mlfq, or TINYOS_SCHED=mlfq in the environment; -S fifo selects
+	the original round-robin scheduler, as a control), and option 
+	-P enables the consolidation mode (core parking). Option -H reports
+	percentiles of the run-queue wait times and the time-slice lengths 
+	of all the benchmarks (the upper bounds of their log2 buckets), and 
+	why the time-slices ended.
+ */
+
+
+/* Default number of cores */
+#define DEFAULT_CORES 1
+
+/* Default number of concurrent timed waiters */
+#define DEFAULT_WAITERS 10000
+
+/* Default number of ping-pong round trips (and churn iterations) */
+#define DEFAULT_ROUNDS 20000
+
+/* How long each spinner of the cpu_bound benchmark runs (msec) */
+#define SPIN_MSEC 500
+
+/* The nice value of the second spinner of the nice benchmark */
+#define NICE_SPINNER 5
+
+/* The period, the work per period and the number of periods of the periodic task */
+#define PERIODIC_MSEC 10
+#define PERIODIC_WORK_USEC 1000
+#define PERIODIC_JOBS 100
+
+/* The nice value of the cpu hogs that compete with the periodic task */
+#define HOG_NICE (-10)
+
+/* The number of cpu-bound jobs of the batch benchmark */
+#define BATCH_JOBS 3
+
+/* The maximum number of ping-pong round trips next to cpu hogs */
+#define HANDOFF_ROUNDS 2000
+
+/* The number of spins of a waiting side of the yield_to benchmark, between yields */
+#define YIELD_SPINS 100
+
+/* The number and length of the sleeps of the sleep benchmark */
+#define SLEEPS 200
+#define SLEEP_USEC 1000
+
+/* The number of increments of each worker of the rseq benchmark */
+#define RSEQ_INCREMENTS 1000000
+
+/* The maximum number of waiters and rounds of the broadcast benchmark */
+#define BROADCAST_WAITERS 256
+#define BROADCAST_ROUNDS 200
+
+/* The work per round and the number of rounds of each worker of the gang benchmark */
+#define GANG_WORK_USEC 200
+#define GANG_ROUNDS 500
+
+/* The quota of the tenant in the quota benchmark, in percent of all cores, and its period (usec) */
+#define QUOTA_PERCENT 25
+#define QUOTA_PERIOD_USEC 100000
+
+/* The think time of the client, and the rounds of the request/response benchmark */
+#define THINK_USEC 20
+#define REQUEST_ROUNDS 5000
+
+/* The work and the sleep of each period of a lightly loaded thread, and the run time */
+#define LIGHT_WORK_USEC 100
+#define LIGHT_SLEEP_MSEC 2
+#define LIGHT_MSEC 1000
+
+/* The working set of each worker of the affinity benchmark (bytes) */
+#define WORKER_BUFFER_SIZE (256*1024)
+
+/* The timeout of the idle waiters (msec); they are released long before */
+#define WAITER_TIMEOUT (600*1000)
+
+/* 
+	The timeout of each ping-pong wait (msec); it never expires. It is 
+	longer than the timeout of the waiters, so that it sorts after them.
+ */
+#define PINGPONG_TIMEOUT (3600*1000)
+
+
+static unsigned int ncores = DEFAULT_CORES;
+static unsigned int nwaiters = DEFAULT_WAITERS;
+static unsigned int nrounds = DEFAULT_ROUNDS;
+static int show_latency = 0;
+
+
+/* Host-side monotonic clock, in nanoseconds */
+static inline int64_t now_nsec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ll + ts.tv_nsec;
+}
+
+static void report(const char* bench, const char* metric, double value, const char* unit)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "%s.%s", bench, metric);
+	printf("%-40s %14.3f  %s\n", name, value, unit);
+}
+
+
+
+/*********************************************
+
+	Ping-pong between two processes
+
+ *********************************************/
+
+/* All processes of the benchmarks share this mutex */
+static Mutex mx = MUTEX_INIT;
+
+static CondVar ping_cv = COND_INIT, pong_cv = COND_INIT;
+static volatile int turn;
+
+static int pong_task(int argl, void* args)
+{
+	unsigned int rounds = argl;
+	Mutex_Lock(&mx);
+	for(unsigned int i=0; i<rounds; i++) {
+		while(turn!=1) Cond_TimedWait(&mx, &pong_cv, PINGPONG_TIMEOUT);
+		turn = 0;
+		Cond_Signal(&ping_cv);
+	}
+	Mutex_Unlock(&mx);
+	return 0;
+}
+
+/*
+	Return the mean time of a round trip (in nsec). Both sides wait
+	with a timeout, so that every wait registers a timeout with the
+	scheduler, and every wakeup cancels it.
+ */
+static double pingpong(unsigned int rounds)
+{
+	turn = 0;
+	Pid_t pid = Exec(pong_task, rounds, NULL);
+
+	int64_t t0 = now_nsec();
+	Mutex_Lock(&mx);
+	for(unsigned int i=0; i<rounds; i++) {
+		turn = 1;
+		Cond_Signal(&pong_cv);
+		while(turn!=0) Cond_TimedWait(&mx, &ping_cv, PINGPONG_TIMEOUT);
+	}
+	Mutex_Unlock(&mx);
+	int64_t t1 = now_nsec();
+
+	WaitChild(pid, NULL);
+	return (double)(t1-t0) / rounds;
+}
+
+
+
+/*********************************************
+
+	Many concurrent timed waiters
+
+ *********************************************/
+
+static CondVar ready_cv = COND_INIT, release_cv = COND_INIT;
+static volatile unsigned int nready;
+static volatile int released;
+
+static int waiter_task(int argl, void* args)
+{
+	Mutex_Lock(&mx);
+	if(++nready == nwaiters) Cond_Signal(&ready_cv);
+	while(! released)
+		Cond_TimedWait(&mx, &release_cv, WAITER_TIMEOUT);
+	Mutex_Unlock(&mx);
+	return 0;
+}
+
+/*
+	Start many processes sleeping with a (long) timeout, and measure
+	how the scheduler copes: the cost of starting each waiter, the cost
+	of a ping-pong round trip with and without the waiters present, and
+	the cost of releasing all the waiters.
+ */
+static void bench_timed_waiters(const char* name)
+{
+	report(name, "ping_pong_idle", pingpong(nrounds), "nsec");
+
+	nready = 0;
+	released = 0;
+
+	int64_t t0 = now_nsec();
+	for(unsigned int i=0; i<nwaiters; i++)
+		if(Exec(waiter_task, 0, NULL)==NOPROC) {
+			fprintf(stderr, "%s: could not start waiter %u\n", name, i);
+			abort();
+		}
+	Mutex_Lock(&mx);
+	while(nready < nwaiters) Cond_Wait(&mx, &ready_cv);
+	Mutex_Unlock(&mx);
+	int64_t t1 = now_nsec();
+	report(name, "start_waiter", (double)(t1-t0)/nwaiters/1000.0, "usec");
+
+	report(name, "ping_pong_loaded", pingpong(nrounds), "nsec");
+
+	t0 = now_nsec();
+	Mutex_Lock(&mx);
+	released = 1;
+	Cond_Broadcast(&release_cv);
+	Mutex_Unlock(&mx);
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+	t1 = now_nsec();
+	report(name, "release_waiter", (double)(t1-t0)/nwaiters/1000.0, "usec");
+}
+
+
+
+/*********************************************
+
+	Process churn
+
+ *********************************************/
+
+static int empty_task(int argl, void* args)
+{
+	return 0;
+}
+
+/*
+	Start and reap short-lived processes, one at a time. Each process
+	has a single thread, so this measures the cost of creating and
+	releasing a thread (plus the process bookkeeping).
+ */
+static void bench_churn(const char* name)
+{
+	int64_t t0 = now_nsec();
+	for(unsigned int i=0; i<nrounds; i++) {
+		Pid_t pid = Exec(empty_task, 0, NULL);
+		WaitChild(pid, NULL);
+	}
+	int64_t t1 = now_nsec();
+	report(name, "spawn_exit", (double)(t1-t0)/nrounds/1000.0, "usec");
+	report(name, "spawn_exit_rate", nrounds*1e9/(t1-t0), "1/sec");
+}
+
+
+
+/*********************************************
+
+	CPU-bound processes
+
+ *********************************************/
+
+static int spinner_task(int argl, void* args)
+{
+	int64_t t0 = now_nsec();
+	while(now_nsec()-t0 < SPIN_MSEC*1000000ll);
+	return 0;
+}
+
+/* Sum the per-core scheduler counters over all cores */
+static void read_counters(unsigned long* alarms, unsigned long* switches)
+{
+	*alarms = *switches = 0;
+	for(unsigned int c=0; c<ncores; c++) {
+		*alarms += cctx[c].alarms;
+		*switches += cctx[c].context_switches;
+	}
+}
+
+/*
+	Run 'nspinners' CPU-bound processes at once, and count the timer
+	interrupts and the context switches per second of run time.
+ */
+static void run_spinners(const char* name, unsigned int nspinners)
+{
+	char metric[32];
+	unsigned long alarms0, switches0, alarms, switches;
+	read_counters(&alarms0, &switches0);
+	int64_t t0 = now_nsec();
+
+	for(unsigned int i=0; i<nspinners; i++)
+		Exec(spinner_task, 0, NULL);
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	double secs = (now_nsec()-t0) * 1e-9;
+	read_counters(&alarms, &switches);
+	alarms -= alarms0;
+	switches -= switches0;
+
+	snprintf(metric, sizeof(metric), "alarms_%u", nspinners);
+	report(name, metric, alarms/secs, "1/sec");
+	snprintf(metric, sizeof(metric), "switches_%u", nspinners);
+	report(name, metric, switches/secs, "1/sec");
+}
+
+/*
+	One CPU-bound process per core (where tickless mode avoids all timer
+	interrupts), and four per core (where the adaptive quantum applies).
+ */
+static void bench_cpu_bound(const char* name)
+{
+	run_spinners(name, ncores);
+	run_spinners(name, 4*ncores);
+}
+
+
+
+/*********************************************
+
+	Pinned compute workers
+
+ *********************************************/
+
+#define MAX_WORKERS (2*MAX_CORES)
+
+/* The buffers are static, to keep malloc out of the measurement */
+static long worker_buffer[MAX_WORKERS][WORKER_BUFFER_SIZE / sizeof(long)];
+static unsigned long worker_passes[MAX_WORKERS];
+static unsigned long worker_migrations[MAX_WORKERS];
+
+typedef struct worker_arg
+{
+	unsigned int id;
+	cpumask_t affinity;   /* 0 for no pinning */
+} worker_arg;
+
+/*
+	Repeatedly sum a private buffer, for SPIN_MSEC. The buffer fits in
+	a core's cache, so a worker that stays on one core runs faster than 
+	one that migrates.
+ */
+static int worker_task(int argl, void* args)
+{
+	worker_arg* arg = args;
+	if(arg->affinity)
+		SetThreadAffinity(NOTHREAD, arg->affinity);
+
+	const size_t n = WORKER_BUFFER_SIZE / sizeof(long);
+	volatile long* buf = worker_buffer[arg->id];
+	for(size_t i=0; i<n; i++) buf[i] = i;
+
+	unsigned long passes = 0;
+	long sum = 0;
+	int64_t t0 = now_nsec();
+	while(now_nsec()-t0 < SPIN_MSEC*1000000ll) {
+		for(size_t i=0; i<n; i++) sum += buf[i];
+		passes++;
+	}
+
+	thread_stats stats;
+	GetThreadStats(NOTHREAD, &stats);
+	worker_passes[arg->id] = passes;
+	worker_migrations[arg->id] = stats.migrations;
+	return (int)(sum & 1);
+}
+
+static double run_workers(unsigned int nworkers, int pinned, unsigned long* migrations)
+{
+	worker_arg arg;
+
+	for(unsigned int i=0; i<nworkers; i++) {
+		arg.id = i;
+		arg.affinity = pinned ? (1u << (i % ncores)) : 0;
+		Exec(worker_task, sizeof(arg), &arg);
+	}
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	unsigned long total = 0;
+	*migrations = 0;
+	for(unsigned int i=0; i<nworkers; i++) {
+		total += worker_passes[i];
+		*migrations += worker_migrations[i];
+	}
+	return total * 1000.0 / SPIN_MSEC;
+}
+
+/*
+	Run two compute workers per core, first free to migrate, then each
+	pinned to one core, and compare their throughput. Also report the
+	migrations of the free workers.
+ */
+static void bench_affinity(const char* name)
+{
+	unsigned long migrations;
+	report(name, "unpinned_passes", run_workers(2*ncores, 0, &migrations), "1/sec");
+	report(name, "unpinned_migrations", migrations * 1000.0 / SPIN_MSEC, "1/sec");
+	report(name, "pinned_passes", run_workers(2*ncores, 1, &migrations), "1/sec");
+}
+
+
+
+/*********************************************
+
+	Spinners with different nice values
+
+ *********************************************/
+
+static unsigned long nice_count[2];
+
+/*
+	Count loop iterations for SPIN_MSEC, at nice 0 (id 0) or at
+	NICE_SPINNER (id 1), on core 0.
+ */
+static int nice_task(int argl, void* args)
+{
+	int id = argl;
+	SetThreadAffinity(NOTHREAD, 1);
+	SetPriority(NOTHREAD, id ? NICE_SPINNER : 0);
+
+	unsigned long count = 0;
+	int64_t t0 = now_nsec();
+	while(now_nsec()-t0 < SPIN_MSEC*1000000ll)
+		count++;
+
+	nice_count[id] = count;
+	return 0;
+}
+
+/*
+	Two spinners compete for core 0, one at nice 0 and one at nice 
+	NICE_SPINNER. Under the fair policy, their shares of the core are
+	proportional to their weights.
+ */
+static void bench_nice(const char* name)
+{
+	for(int id=0; id<2; id++)
+		Exec(nice_task, id, NULL);
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	double total = nice_count[0] + nice_count[1];
+	report(name, "nice_0_share", 100.0 * nice_count[0] / total, "%");
+	report(name, "share_ratio", (double)nice_count[0] / nice_count[1], "x");
+}
+
+
+
+/*********************************************
+
+	A periodic task next to cpu hogs
+
+ *********************************************/
+
+static volatile int periodic_done;
+static double response_avg, response_max;
+static unsigned long response_misses;
+
+/* A cpu hog on core 0, with nice value argl, until periodic_done is set */
+static int hog_task(int argl, void* args)
+{
+	SetThreadAffinity(NOTHREAD, 1);
+	SetPriority(NOTHREAD, argl);
+	while(!periodic_done);
+	return 0;
+}
+
+/*
+	Every PERIODIC_MSEC, do PERIODIC_WORK_USEC of work, on core 0, and
+	measure the response time: from the start of the period to the 
+	end of the work. If argl is non-zero, the task is real-time.
+ */
+static int periodic_task(int argl, void* args)
+{
+	SetThreadAffinity(NOTHREAD, 1);
+	if(argl) {
+		deadline_attr attr = { 
+			.runtime = 2*PERIODIC_WORK_USEC, 
+			.deadline = PERIODIC_MSEC*1000, 
+			.period = PERIODIC_MSEC*1000 
+		};
+		if(SetDeadline(NOTHREAD, &attr)) { periodic_done = 1; return 1; }
+	}
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	double total = 0.0, max = 0.0;
+
+	int64_t start = now_nsec();
+	for(int job=1; job<=PERIODIC_JOBS; job++) {
+		int64_t release = start + job*PERIODIC_MSEC*1000000ll;
+		int64_t t;
+
+		Mutex_Lock(&mx);
+		while((t = now_nsec()) < release)
+			Cond_TimedWait(&mx, &cv, (release - t + 999999)/1000000);
+		Mutex_Unlock(&mx);
+
+		while(now_nsec()-t < PERIODIC_WORK_USEC*1000ll);
+
+		double response = (now_nsec()-release) * 1e-3;
+		total += response;
+		if(response > max) max = response;
+	}
+
+	deadline_attr attr;
+	GetDeadline(NOTHREAD, &attr);
+	response_avg = total / PERIODIC_JOBS;
+	response_max = max;
+	response_misses = attr.misses;
+	periodic_done = 1;
+	return 0;
+}
+
+static void run_periodic(const char* name, const char* class, int realtime)
+{
+	char metric[32];
+
+	periodic_done = 0;
+	for(int i=0; i<2; i++)
+		Exec(hog_task, HOG_NICE, NULL);
+	Exec(periodic_task, realtime, NULL);
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	snprintf(metric, sizeof(metric), "%s_avg_response", class);
+	report(name, metric, response_avg, "usec");
+	snprintf(metric, sizeof(metric), "%s_max_response", class);
+	report(name, metric, response_max, "usec");
+	if(realtime)
+		report(name, "rt_misses", response_misses, "");
+}
+
+/*
+	A periodic task shares core 0 with two cpu hogs of higher priority 
+	(HOG_NICE), first as a normal thread, and then as a real-time thread.
+ */
+static void bench_deadline(const char* name)
+{
+	run_periodic(name, "normal", 0);
+	run_periodic(name, "rt", 1);
+}
+
+
+
+/*********************************************
+
+	Batch jobs next to a periodic task
+
+ *********************************************/
+
+static unsigned long batch_passes;
+
+struct batch_arg { unsigned int id; int batch; };
+
+/*
+	A cpu-bound job on core 0, in the batch class if requested: 
+	it sums the buffer of its worker, until periodic_done is set.
+ */
+static int batch_task(int argl, void* args)
+{
+	struct batch_arg* arg = args;
+	unsigned int id = arg->id;
+	SetThreadAffinity(NOTHREAD, 1);
+	SetBatch(NOTHREAD, arg->batch);
+
+	const size_t n = WORKER_BUFFER_SIZE / sizeof(long);
+	volatile long* buf = worker_buffer[id];
+	for(size_t i=0; i<n; i++) buf[i] = i;
+
+	unsigned long passes = 0;
+	long sum = 0;
+	while(!periodic_done) {
+		for(size_t i=0; i<n; i++) sum += buf[i];
+		passes++;
+	}
+
+	Mutex_Lock(&mx);
+	batch_passes += passes;
+	Mutex_Unlock(&mx);
+	return (int)(sum & 1);
+}
+
+static void run_batch(const char* name, const char* class, int batch)
+{
+	char metric[32];
+	unsigned long alarms0, switches0, alarms, switches;
+
+	periodic_done = 0;
+	batch_passes = 0;
+	read_counters(&alarms0, &switches0);
+	int64_t t0 = now_nsec();
+
+	for(unsigned int i=0; i<BATCH_JOBS; i++) {
+		struct batch_arg arg = { i, batch };
+		Exec(batch_task, sizeof(arg), &arg);
+	}
+	Exec(periodic_task, 0, NULL);
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	double secs = (now_nsec()-t0) * 1e-9;
+	read_counters(&alarms, &switches);
+
+	snprintf(metric, sizeof(metric), "%s_passes", class);
+	report(name, metric, batch_passes/secs, "1/sec");
+	snprintf(metric, sizeof(metric), "%s_switches", class);
+	report(name, metric, (switches-switches0)/secs, "1/sec");
+	snprintf(metric, sizeof(metric), "%s_avg_response", class);
+	report(name, metric, response_avg, "usec");
+	snprintf(metric, sizeof(metric), "%s_max_response", class);
+	report(name, metric, response_max, "usec");
+}
+
+/*
+	BATCH_JOBS cache-heavy cpu-bound jobs share core 0 with a (normal) 
+	periodic task, first as normal threads, and then as batch threads.
+	This reports the throughput of the jobs, the context switches, and 
+	the response time of the periodic task.
+ */
+static void bench_batch(const char* name)
+{
+	run_batch(name, "normal", 0);
+	run_batch(name, "batch", 1);
+}
+
+
+
+/*********************************************
+
+	Ping-pong next to cpu hogs
+
+ *********************************************/
+
+/*
+	Ping-pong between two processes on core 0, which is shared with
+	two cpu hogs. Each side wakes up the other and goes to sleep, so
+	the woken side should run next, without waiting for the hogs.
+ */
+static void bench_handoff(const char* name)
+{
+	unsigned int rounds = (nrounds < HANDOFF_ROUNDS) ? nrounds : HANDOFF_ROUNDS;
+
+	SetThreadAffinity(NOTHREAD, 1);
+	periodic_done = 0;
+	for(int i=0; i<2; i++)
+		Exec(hog_task, 0, NULL);
+
+	report(name, "ping_pong_hogs", pingpong(rounds), "nsec");
+
+	periodic_done = 1;
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+	SetThreadAffinity(NOTHREAD, ~(cpumask_t)0);
+}
+
+
+
+/*********************************************
+
+	Spin-then-yield ping-pong next to cpu hogs
+
+ *********************************************/
+
+static volatile Tid_t yield_peer[2];
+
+/*
+	One side of a spin-then-yield ping-pong: wait for our turn, yielding
+	every YIELD_SPINS spins, to the other side if directed.
+ */
+static void spin_yield_side(int me, unsigned int rounds, int directed)
+{
+	for(unsigned int i=0; i<rounds; i++) {
+		unsigned int spins = 0;
+		while(turn != me)
+			if(++spins % YIELD_SPINS == 0)
+				YieldTo(directed ? yield_peer[1-me] : NOTHREAD);
+		turn = 1-me;
+	}
+}
+
+static int yield_pong_task(int argl, void* args)
+{
+	yield_peer[1] = ThreadSelf();
+	spin_yield_side(1, argl >> 1, argl & 1);
+	return 0;
+}
+
+/* Return the mean time of a round trip (in nsec) */
+static double spin_yield_pingpong(unsigned int rounds, int directed)
+{
+	turn = 0;
+	yield_peer[0] = ThreadSelf();
+	yield_peer[1] = NOTHREAD;
+	Pid_t pid = Exec(yield_pong_task, (rounds << 1) | directed, NULL);
+	while(yield_peer[1] == NOTHREAD)
+		YieldTo(NOTHREAD);
+
+	int64_t t0 = now_nsec();
+	spin_yield_side(0, rounds, directed);
+	int64_t t1 = now_nsec();
+
+	WaitChild(pid, NULL);
+	return (double)(t1-t0) / rounds;
+}
+
+/*
+	A spin-then-yield ping-pong between two processes on core 0, which 
+	is shared with two cpu hogs of higher priority (HOG_NICE): first with 
+	a normal yield, which lets the hogs run, and then with a yield to the
+	other side.
+ */
+static void bench_yield_to(const char* name)
+{
+	unsigned int rounds = (nrounds < HANDOFF_ROUNDS) ? nrounds : HANDOFF_ROUNDS;
+
+	SetThreadAffinity(NOTHREAD, 1);
+	periodic_done = 0;
+	for(int i=0; i<2; i++)
+		Exec(hog_task, HOG_NICE, NULL);
+
+	report(name, "yield_round_trip", spin_yield_pingpong(rounds, 0), "nsec");
+	report(name, "yield_to_round_trip", spin_yield_pingpong(rounds, 1), "nsec");
+
+	periodic_done = 1;
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+	SetThreadAffinity(NOTHREAD, ~(cpumask_t)0);
+}
+
+
+
+/*********************************************
+
+	Timed sleeps
+
+ *********************************************/
+
+/*
+	Sleep SLEEPS times for SLEEP_USEC, with Sleep() or Cond_TimedWait(),
+	and report the average and the maximum overshoot.
+ */
+static void measure_sleep(const char* name, const char* what, int timed_wait)
+{
+	Mutex m = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	double sum = 0.0, max = 0.0;
+	char metric[32];
+
+	for(int i=0; i<SLEEPS; i++) {
+		int64_t t0 = now_nsec();
+		if(timed_wait) {
+			Mutex_Lock(&m);
+			Cond_TimedWait(&m, &cv, SLEEP_USEC/1000);
+			Mutex_Unlock(&m);
+		} else {
+			Sleep(SLEEP_USEC);
+		}
+		double over = (now_nsec()-t0) * 1e-3 - SLEEP_USEC;
+		sum += over;
+		if(over > max) max = over;
+	}
+
+	snprintf(metric, sizeof(metric), "%s_avg_overshoot", what);
+	report(name, metric, sum / SLEEPS, "usec");
+	snprintf(metric, sizeof(metric), "%s_max_overshoot", what);
+	report(name, metric, max, "usec");
+}
+
+/*
+	Timed sleeps on core 0, first alone, and then next to a cpu hog.
+ */
+static void bench_sleep(const char* name)
+{
+	SetThreadAffinity(NOTHREAD, 1);
+	measure_sleep(name, "sleep", 0);
+	measure_sleep(name, "timedwait", 1);
+
+	periodic_done = 0;
+	Exec(hog_task, 0, NULL);
+	measure_sleep(name, "sleep_hog", 0);
+	periodic_done = 1;
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+	SetThreadAffinity(NOTHREAD, ~(cpumask_t)0);
+}
+
+
+
+/*********************************************
+
+	Per-core counters
+
+ *********************************************/
+
+static uintptr_t core_counter[MAX_CORES];
+static volatile uintptr_t shared_counter;
+static unsigned long rseq_restarts;
+
+/*
+	Increment a counter RSEQ_INCREMENTS times: a per-core counter with
+	a restartable sequence (argl 0), or a shared counter under a mutex 
+	(argl 1), or with an atomic increment (argl 2).
+ */
+static int counter_task(int argl, void* args)
+{
+	rseq_area rs;
+	unsigned long restarts = 0;
+
+	RseqRegister(&rs);
+	for(int i=0; i<RSEQ_INCREMENTS; i++) {
+		switch(argl) {
+		case 0:
+			for(;;) {
+				unsigned int core = RseqBegin(&rs);
+				if(RseqCommit(&rs, &core_counter[core], core_counter[core]+1)) break;
+				restarts++;
+			}
+			break;
+		case 1:
+			Mutex_Lock(&mx);
+			shared_counter++;
+			Mutex_Unlock(&mx);
+			break;
+		default:
+			__atomic_fetch_add(&shared_counter, 1, __ATOMIC_RELAXED);
+		}
+	}
+	RseqRegister(NULL);
+
+	Mutex_Lock(&mx);
+	rseq_restarts += restarts;
+	Mutex_Unlock(&mx);
+	return 0;
+}
+
+static double run_counters(int kind)
+{
+	unsigned int nworkers = 2*ncores;
+	int64_t t0 = now_nsec();
+	for(unsigned int i=0; i<nworkers; i++)
+		Exec(counter_task, kind, NULL);
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+	return (double)(now_nsec()-t0) / ((double)nworkers * RSEQ_INCREMENTS);
+}
+
+/*
+	Two workers per core increment a counter: per-core counters with
+	restartable sequences, against a shared counter under a mutex and
+	with atomic increments. This reports the time per increment, and 
+	the restarts per million increments.
+ */
+static void bench_rseq(const char* name)
+{
+	rseq_restarts = 0;
+	report(name, "rseq_increment", run_counters(0), "nsec");
+	report(name, "rseq_restarts", rseq_restarts * 1e6 / (2.0*ncores*RSEQ_INCREMENTS), "1/M");
+	report(name, "mutex_increment", run_counters(1), "nsec");
+	report(name, "atomic_increment", run_counters(2), "nsec");
+}
+
+
+
+/*********************************************
+
+	Condition variable broadcast
+
+ *********************************************/
+
+static CondVar bcast_cv = COND_INIT;
+static volatile unsigned int bcast_round;
+static unsigned int bcast_waiters, bcast_rounds;
+static unsigned long bcast_migrations;
+
+static int bcast_task(int argl, void* args)
+{
+	Mutex_Lock(&mx);
+	for(unsigned int r=0; r<bcast_rounds; r++) {
+		if(++nready == bcast_waiters) Cond_Signal(&ready_cv);
+		while(bcast_round == r)
+			Cond_Wait(&mx, &bcast_cv);
+	}
+	thread_stats stats;
+	GetThreadStats(NOTHREAD, &stats);
+	bcast_migrations += stats.migrations;
+	Mutex_Unlock(&mx);
+	return 0;
+}
+
+/*
+	Repeatedly wake up a group of waiters with a single Cond_Broadcast, and
+	wait until all of them are waiting again. This measures the cost of
+	the broadcast call per waiter, and of a whole round.
+ */
+static void bench_broadcast(const char* name)
+{
+	bcast_waiters = (nwaiters < BROADCAST_WAITERS) ? nwaiters : BROADCAST_WAITERS;
+	bcast_rounds = (nrounds < BROADCAST_ROUNDS) ? nrounds : BROADCAST_ROUNDS;
+	bcast_round = 0;
+	bcast_migrations = 0;
+	nready = 0;
+	unsigned long steals = 0;
+	for(unsigned int c=0; c<ncores; c++) steals -= cctx[c].steals;
+
+	for(unsigned int i=0; i<bcast_waiters; i++)
+		Exec(bcast_task, 0, NULL);
+
+	int64_t tcall = 0;
+	int64_t t0 = now_nsec();
+	Mutex_Lock(&mx);
+	for(unsigned int r=0; r<bcast_rounds; r++) {
+		while(nready < bcast_waiters) Cond_Wait(&mx, &ready_cv);
+		nready = 0;
+		bcast_round++;
+		int64_t tb = now_nsec();
+		Cond_Broadcast(&bcast_cv);
+		tcall += now_nsec() - tb;
+	}
+	Mutex_Unlock(&mx);
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+	int64_t t1 = now_nsec();
+
+	report(name, "broadcast_call", (double)tcall/bcast_rounds/bcast_waiters, "nsec");
+	report(name, "broadcast_round", (double)(t1-t0)/bcast_rounds/1000.0, "usec");
+	for(unsigned int c=0; c<ncores; c++) steals += cctx[c].steals;
+	report(name, "migrations", (double)bcast_migrations/bcast_rounds/bcast_waiters, "per wakeup");
+	report(name, "steals", (double)steals/bcast_rounds/bcast_waiters, "per wakeup");
+}
+
+
+
+/*********************************************
+
+	Barrier-synchronized workers next to cpu hogs
+
+ *********************************************/
+
+static barrier gang_barrier;
+
+/* Each round, do GANG_WORK_USEC of work and wait for the other workers at the barrier */
+static int gang_task(int argl, void* args)
+{
+	SetGang(NOTHREAD, argl);
+	for(int r=0; r<GANG_ROUNDS; r++) {
+		int64_t t0 = now_nsec();
+		while(now_nsec()-t0 < GANG_WORK_USEC*1000ll);
+		BarrierSync(&gang_barrier, ncores);
+	}
+	return 0;
+}
+
+/* A cpu hog on any core, until periodic_done is set */
+static int spin_hog_task(int argl, void* args)
+{
+	while(!periodic_done);
+	return 0;
+}
+
+static void run_gang(const char* name, const char* class, int gang)
+{
+	char metric[32];
+	unsigned long alarms0, switches0, alarms, switches;
+
+	gang_barrier = BARRIER_INIT;
+	periodic_done = 0;
+	for(unsigned int i=0; i<ncores; i++)
+		Exec(spin_hog_task, 0, NULL);
+
+	read_counters(&alarms0, &switches0);
+	int64_t t0 = now_nsec();
+	Pid_t workers[MAX_CORES];
+	for(unsigned int i=0; i<ncores; i++)
+		workers[i] = Exec(gang_task, gang, NULL);
+	for(unsigned int i=0; i<ncores; i++)
+		WaitChild(workers[i], NULL);
+	double secs = (now_nsec()-t0) * 1e-9;
+	read_counters(&alarms, &switches);
+
+	periodic_done = 1;
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	snprintf(metric, sizeof(metric), "%s_rounds", class);
+	report(name, metric, GANG_ROUNDS/secs, "1/sec");
+	snprintf(metric, sizeof(metric), "%s_switches", class);
+	report(name, metric, (switches-switches0)/secs, "1/sec");
+}
+
+/*
+	One worker per core runs rounds of GANG_WORK_USEC of work separated by
+	a barrier, next to one cpu hog per core: first without a gang, and 
+	then as a gang. This reports the rounds per second (at most 
+	1e6/GANG_WORK_USEC) and the context switches. Gangs are co-scheduled 
+	only with at most one core per host cpu.
+ */
+static void bench_gang(const char* name)
+{
+	run_gang(name, "normal", 0);
+	run_gang(name, "gang", 1);
+}
+
+
+
+/*********************************************
+
+	A cpu-hungry tenant with a quota
+
+ *********************************************/
+
+/* A cpu hog in cpu group 'argl', until periodic_done is set */
+static int group_spinner_task(int argl, void* args)
+{
+	SetCpuGroup(NOTHREAD, argl);
+	while(!periodic_done);
+	return 0;
+}
+
+static void run_tenants(const char* name, const char* class, int limited)
+{
+	char metric[32];
+	cpu_quota q = { .quota = ncores * QUOTA_PERIOD_USEC * QUOTA_PERCENT / 100, .period = QUOTA_PERIOD_USEC };
+	SetCpuQuota(1, limited ? &q : NULL);
+
+	periodic_done = 0;
+	for(unsigned int i=0; i<2*ncores; i++)
+		Exec(group_spinner_task, 1, NULL);
+	for(unsigned int i=0; i<ncores; i++)
+		Exec(group_spinner_task, 0, NULL);
+
+	/* Measure after the spinners have started */
+	cpu_quota tenant0, other0, tenant, other;
+	Sleep(QUOTA_PERIOD_USEC);
+	GetCpuQuota(1, &tenant0);
+	GetCpuQuota(0, &other0);
+	int64_t t0 = now_nsec();
+	Sleep(SPIN_MSEC*1000);
+	GetCpuQuota(1, &tenant);
+	GetCpuQuota(0, &other);
+	double usecs = (now_nsec()-t0) * 1e-3;
+
+	periodic_done = 1;
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+	SetCpuQuota(1, NULL);
+
+	snprintf(metric, sizeof(metric), "%s_tenant_cores", class);
+	report(name, metric, (tenant.total - tenant0.total) / usecs, "cores");
+	snprintf(metric, sizeof(metric), "%s_other_cores", class);
+	report(name, metric, (other.total - other0.total) / usecs, "cores");
+	snprintf(metric, sizeof(metric), "%s_throttles", class);
+	report(name, metric, (double)(tenant.throttles - tenant0.throttles), "");
+}
+
+/*
+	A tenant runs two spinners per core in cpu group 1, next to one
+	spinner per core in the default group, first without a limit and 
+	then with a quota of QUOTA_PERCENT of the cores. This reports the 
+	cpu time per second (in cores) that each group got, and the throttles
+	of the tenant. With fewer host cpus than cores, halted cores are only
+	restarted up to the host cpus, so idle time is left when the tenant
+	is throttled.
+ */
+static void bench_quota(const char* name)
+{
+	run_tenants(name, "unlimited", 0);
+	run_tenants(name, "quota", 1);
+}
+
+
+
+/*********************************************
+
+	Light load
+
+ *********************************************/
+
+static unsigned long light_periods;
+
+static int light_task(int argl, void* args)
+{
+	Mutex lmx = MUTEX_INIT;
+	CondVar lcv = COND_INIT;
+	unsigned long periods = 0;
+
+	int64_t t0 = now_nsec();
+	while(now_nsec()-t0 < LIGHT_MSEC*1000000ll) {
+		int64_t tw = now_nsec();
+		while(now_nsec()-tw < LIGHT_WORK_USEC*1000ll);
+		Mutex_Lock(&lmx);
+		Cond_TimedWait(&lmx, &lcv, LIGHT_SLEEP_MSEC);
+		Mutex_Unlock(&lmx);
+		periods++;
+	}
+
+	Mutex_Lock(&mx);
+	light_periods += periods;
+	Mutex_Unlock(&mx);
+	return 0;
+}
+
+static double host_cpu_secs()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + 
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e-6;
+}
+
+/*
+	One thread per core, which works for a short time and sleeps for 
+	much longer, so that the cores are mostly idle. This reports the 
+	host cpu time used by the VM, relative to the run time, the halts 
+	of the cores, and the core unparkings (with option -P).
+ */
+static void bench_light_load(const char* name)
+{
+	unsigned long halts = 0, unparks = 0;
+	for(unsigned int c=0; c<ncores; c++) {
+		halts -= cctx[c].idle_halts;
+		unparks -= cctx[c].unparks;
+	}
+	light_periods = 0;
+	double cpu0 = host_cpu_secs();
+	int64_t t0 = now_nsec();
+
+	for(unsigned int i=0; i<ncores; i++)
+		Exec(light_task, 0, NULL);
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	double secs = (now_nsec()-t0) * 1e-9;
+	double cpu = host_cpu_secs() - cpu0;
+	for(unsigned int c=0; c<ncores; c++) {
+		halts += cctx[c].idle_halts;
+		unparks += cctx[c].unparks;
+	}
+	report(name, "host_cpu", 100.0*cpu/secs, "%");
+	report(name, "halts", halts/secs, "1/sec");
+	report(name, "unparks", unparks/secs, "1/sec");
+	report(name, "periods", light_periods/secs, "1/sec");
+}
+
+
+
+/*********************************************
+
+	Request/response with an idle server
+
+ *********************************************/
+
+static CondVar request_cv = COND_INIT, response_cv = COND_INIT;
+static volatile unsigned int requests, responses;
+static volatile int server_done;
+
+static int server_task(int argl, void* args)
+{
+	SetThreadAffinity(NOTHREAD, 1);
+	Mutex_Lock(&mx);
+	while(! server_done) {
+		if(requests == responses) {
+			Cond_Wait(&mx, &request_cv);
+			continue;
+		}
+		responses++;
+		Cond_Signal(&response_cv);
+	}
+	Mutex_Unlock(&mx);
+	return 0;
+}
+
+/*
+	A client on the last core sends requests to a server on core 0, 
+	thinking (spinning) for a short time between a response and the next 
+	request. Meanwhile, the core of the server becomes idle, and the 
+	request must restart it. This reports the round trip time, and the 
+	fraction of the idle periods of the cores that ended while polling.
+ */
+static void bench_request_response(const char* name)
+{
+	unsigned int rounds = (nrounds < REQUEST_ROUNDS) ? nrounds : REQUEST_ROUNDS;
+	unsigned long polls = 0, halts = 0;
+	for(unsigned int c=0; c<ncores; c++) {
+		polls -= cctx[c].idle_polls;
+		halts -= cctx[c].idle_halts;
+	}
+
+	SetThreadAffinity(NOTHREAD, (cpumask_t)1 << (ncores-1));
+	requests = responses = 0;
+	server_done = 0;
+	Pid_t pid = Exec(server_task, 0, NULL);
+
+	int64_t rtt = 0;
+	for(unsigned int i=0; i<rounds; i++) {
+		int64_t t0 = now_nsec();
+		while(now_nsec()-t0 < THINK_USEC*1000ll);
+
+		t0 = now_nsec();
+		Mutex_Lock(&mx);
+		requests++;
+		Cond_Signal(&request_cv);
+		while(responses != requests) Cond_Wait(&mx, &response_cv);
+		Mutex_Unlock(&mx);
+		rtt += now_nsec() - t0;
+	}
+
+	Mutex_Lock(&mx);
+	server_done = 1;
+	Cond_Signal(&request_cv);
+	Mutex_Unlock(&mx);
+	WaitChild(pid, NULL);
+	SetThreadAffinity(NOTHREAD, ~(cpumask_t)0);
+
+	for(unsigned int c=0; c<ncores; c++) {
+		polls += cctx[c].idle_polls;
+		halts += cctx[c].idle_halts;
+	}
+	report(name, "round_trip", (double)rtt/rounds/1000.0, "usec");
+	report(name, "idle_polled", (polls+halts) ? 100.0*polls/(polls+halts) : 0.0, "%");
+}
+
+
+
+/*********************************************
+
+	Driver
+
+ *********************************************/
+
+typedef struct bench_def
+{
+	const char* name;
+	const char* descr;
+	void (*func)(const char*);
+	int selected;
+} bench_def;
+
+static bench_def BENCHMARKS[] = {
+	{ "timed_waiters", "context switch cost with many concurrent timed waiters", bench_timed_waiters, 0 },
+	{ "churn", "cost of starting and reaping a process", bench_churn, 0 },
+	{ "cpu_bound", "timer interrupts and context switches of cpu-bound processes", bench_cpu_bound, 0 },
+	{ "affinity", "throughput of cache-heavy workers, unpinned and pinned", bench_affinity, 0 },
+	{ "nice", "cpu shares of two spinners with different nice values", bench_nice, 0 },
+	{ "deadline", "response time of a periodic task next to cpu hogs, normal and real-time", bench_deadline, 0 },
+	{ "batch", "throughput of cpu-bound jobs and response time of a periodic task, normal and batch", bench_batch, 0 },
+	{ "handoff", "ping-pong round trip on a core shared with cpu hogs", bench_handoff, 0 },
+	{ "yield_to", "spin-then-yield ping-pong on a core shared with cpu hogs, normal and directed yield", bench_yield_to, 0 },
+	{ "sleep", "overshoot of timed sleeps, alone and next to a cpu hog", bench_sleep, 0 },
+	{ "rseq", "cost of per-core counters with restartable sequences, against shared counters", bench_rseq, 0 },
+	{ "broadcast", "cost of waking up a group of waiters with Cond_Broadcast", bench_broadcast, 0 },
+	{ "gang", "round rate of barrier-synchronized workers next to cpu hogs, normal and gang", bench_gang, 0 },
+	{ "quota", "cpu shares of a cpu-hungry tenant and its neighbours, without and with a quota", bench_quota, 0 },
+	{ "request_response", "round trip of requests to a server on an idle core", bench_request_response, 0 },
+	{ "light_load", "host cpu time and core halts of mostly sleeping threads", bench_light_load, 0 },
+	{ NULL, NULL, NULL, 0 }
+};
+
+
+/*
+	The upper bound (usec) of the bucket of a latency histogram, below 
+	which a fraction p of its samples lie.
+ */
+static double hist_percentile(const unsigned long* hist, double p)
+{
+	unsigned long total = 0, sum = 0;
+	for(int b=0; b<SCHED_HIST_BUCKETS; b++) total += hist[b];
+	for(int b=0; b<SCHED_HIST_BUCKETS; b++) {
+		sum += hist[b];
+		if(total > 0 && sum >= p * total) return (double)(1ul << b);
+	}
+	return 0.0;
+}
+
+/*
+	Report the latency histograms of all cores, since boot, as read
+	from the scheduler information stream.
+ */
+static void report_latency()
+{
+	static const char* causes[SCHED_CAUSES] = {
+		"quantum", "io", "mutex", "pipe", "poll", "idle", "user", "timeout", "preempt"
+	};
+	sched_hist total = { {0}, {0}, {0} };
+	schedinfo info;
+	char metric[32];
+
+	Fid_t f = OpenSchedInfo();
+	while(Read(f, (char*)&info, sizeof(info)) == sizeof(info)) {
+		if(info.core < 0) break;
+		for(int b=0; b<SCHED_HIST_BUCKETS; b++) {
+			total.wait[b] += info.hist.wait[b];
+			total.run[b] += info.hist.run[b];
+		}
+		for(int c=0; c<SCHED_CAUSES; c++)
+			total.cause[c] += info.hist.cause[c];
+	}
+	Close(f);
+
+	report("latency", "wait_p50", hist_percentile(total.wait, 0.5), "usec");
+	report("latency", "wait_p99", hist_percentile(total.wait, 0.99), "usec");
+	report("latency", "wait_p999", hist_percentile(total.wait, 0.999), "usec");
+	report("latency", "run_p50", hist_percentile(total.run, 0.5), "usec");
+	report("latency", "run_p99", hist_percentile(total.run, 0.99), "usec");
+	for(int c=0; c<SCHED_CAUSES; c++) {
+		snprintf(metric, sizeof(metric), "end_%s", causes[c]);
+		report("latency", metric, total.cause[c], "");
+	}
+}
+
+static int boot_bench(int argl, void* args)
+{
+	for(bench_def* b = BENCHMARKS; b->name; b++)
+		if(b->selected) b->func(b->name);
+	if(show_latency)
+		report_latency();
+	return 0;
+}
+
+
+static void usage(const char* pname)
+{
+	fprintf(stderr, "usage: %s [-c <cores>] [-n <waiters>] [-r <rounds>] [-T] [-M] [-S <policy>] [-P] [-H] [<benchmark> ...]\n\n", pname);
+	fprintf(stderr, "  -c <cores>    number of cpu cores (default %d)\n", DEFAULT_CORES);
+	fprintf(stderr, "  -n <waiters>  number of concurrent timed waiters (default %d)\n", DEFAULT_WAITERS);
+	fprintf(stderr, "  -r <rounds>   number of ping-pong round trips and churn iterations (default %d)\n", DEFAULT_ROUNDS);
+	fprintf(stderr, "  -T            disable the tickless mode of the scheduler\n");
+	fprintf(stderr, "  -M            use the MLFQ scheduling policy\n");
+	fprintf(stderr, "  -S <policy>   use the named scheduling policy (fair, mlfq or fifo)\n");
+	fprintf(stderr, "  -P            enable the consolidation mode (core parking)\n");
+	fprintf(stderr, "  -H            report the scheduler latency histograms of all the benchmarks\n\n");
+	fprintf(stderr, "benchmarks (default: all):\n");
+	for(bench_def* b = BENCHMARKS; b->name; b++)
+		fprintf(stderr, "  %-20s %s\n", b->name, b->descr);
+	exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+	int opt;
+	while((opt = getopt(argc, argv, "c:n:r:TMS:PHh")) != -1) {
+		switch(opt) {
+		case 'c': ncores = atoi(optarg); break;
+		case 'n': nwaiters = atoi(optarg); break;
+		case 'r': nrounds = atoi(optarg); break;
+		case 'T': sched_tickless = 0; break;
+		case 'M': sched_policy = SCHED_POLICY_MLFQ; break;
+		case 'S': if(sched_select_policy(optarg)) usage(argv[0]); break;
+		case 'P': sched_consolidate = 1; break;
+		case 'H': show_latency = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if(ncores<1 || ncores>MAX_CORES || nwaiters<1 || nwaiters>=MAX_PROC-2 || nrounds<1)
+		usage(argv[0]);
+
+	if(optind == argc) {
+		for(bench_def* b = BENCHMARKS; b->name; b++) b->selected = 1;
+	} else {
+		for(int i=optind; i<argc; i++) {
+			bench_def* b = BENCHMARKS;
+			while(b->name && strcmp(b->name, argv[i])!=0) b++;
+			if(b->name == NULL) usage(argv[0]);
+			b->selected = 1;
+		}
+	}
+
+	boot(ncores, 0, boot_bench, 0, NULL);
+	return 0;
+}
@@ -0,0 +1,679 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "bios.h"
+#include "tinyos.h"
+#include "kernel_sched.h"
+
+
+/*
+	A trace-driven simulator of the tinyos scheduler.
+
+	It reads a scheduler trace, recorded by running any tinyos program
+	with TINYOS_SCHED_TRACE=<file> in the environment (see SCHED_TRACE_ENV
+	in kernel_sched.h), and turns it into a workload: for each thread, the
+	time it was created, and its cpu bursts, where a burst is the cpu time
+	between two blocks, followed by the time the thread stayed blocked.
+
+	Then, it replays the workload on simulated cores against each policy of
+	kernel_sched.c, through its sched_ops, in simulated time, and reports
+	lines of the form (as sched_bench does)
+
+	  <policy>.<metric>   <value>   <unit>
+
+	namely the throughput (completed bursts per second, and cpu utilization),
+	the fairness (Jain's index of the fraction of time the threads ran while
+	they were ready, per unit of weight), percentiles of the run-queue wait,
+	the context switches, and how much faster than real time the replay ran.
+	The lines "trace.*" report the same metrics for the recorded run.
+
+	The replay is open-loop: a thread blocks for as long as it did in the
+	trace, whatever the cause of the block was (the cause is passed to the
+	policy, though). A thread which wakes up goes to the queue of the core
+	it last ran on, or to an idle core, and it does not preempt the current
+	thread of the core; an idle core steals from the longest queue. Quanta,
+	the MIN_QUANTUM floor and the tickless mode are as in the kernel. All
+	threads are treated as normal threads.
+
+	Usage:  ./sched_sim [-c <cores>] [-S <policy>] <trace>
+
+	By default, the workload runs on as many cores as the recorded run,
+	against all the policies.
+ */
+
+
+/* A cpu burst of a thread, and what followed it */
+typedef struct burst {
+	TimerDuration cpu; /* The cpu time of the burst */
+	TimerDuration sleep; /* The time the thread stayed blocked after the burst */
+	enum SCHED_CAUSE cause; /* The cause of the block */
+	int exits; /* Non-zero if the thread exited after the burst */
+} burst;
+
+/* A thread of the workload */
+typedef struct sim_thread {
+	TimerDuration arrival; /* The time the thread became ready for the first time */
+	int nice; /* The nice value of the thread (the last one in the trace) */
+	burst* bursts; /* The bursts of the thread */
+	uint nbursts, capacity;
+
+	TimerDuration cpu_time, wait_time; /* The totals of the current run */
+
+	TCB* tcb; /* The TCB that the policies see */
+	uint next; /* The current burst */
+	TimerDuration left; /* The cpu time left in the current burst */
+	TimerDuration ready_since; /* The time the thread last became ready */
+} sim_thread;
+
+/* An event of the trace */
+typedef struct trace_event {
+	char type; /* 'C', 'W' or 'B' */
+	char state; /* 'R', 'S' or 'X' (bursts only) */
+	int cause, nice; /* (bursts only) */
+	uint core; /* (bursts only) */
+	TimerDuration time, length;
+	uintptr_t tid;
+} trace_event;
+
+/* The samples of the run-queue wait of a run */
+typedef struct sample_set {
+	TimerDuration* value;
+	size_t count, capacity;
+} sample_set;
+
+/* A simulated core */
+typedef struct sim_core {
+	CCB* ccb;
+	sim_thread* current; /* The running thread, or NULL if idle */
+	sim_thread* previous; /* The thread that ran last */
+	TimerDuration slice_start, slice_end;
+	int tickless; /* Non-zero if the current thread runs with no quantum */
+} sim_core;
+
+
+static trace_event* events;
+static size_t nevents;
+static uint trace_cores;
+static char trace_policy[32];
+
+static sim_thread* threads;
+static uint nthreads;
+
+static uint ncores;
+static const char* policy_name = NULL;
+
+
+/* Host-side monotonic clock, in nanoseconds */
+static inline int64_t now_nsec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ll + ts.tv_nsec;
+}
+
+static void report(const char* run, const char* metric, double value, const char* unit)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "%s.%s", run, metric);
+	printf("%-40s %14.3f  %s\n", name, value, unit);
+}
+
+static void add_sample(sample_set* s, TimerDuration v)
+{
+	if(s->count == s->capacity) {
+		s->capacity = (s->capacity < 1024) ? 1024 : 2*s->capacity;
+		s->value = realloc(s->value, s->capacity * sizeof(TimerDuration));
+		if(s->value == NULL) { perror("sched_sim"); exit(1); }
+	}
+	s->value[s->count++] = v;
+}
+
+static int cmp_duration(const void* a, const void* b)
+{
+	TimerDuration x = *(const TimerDuration*)a, y = *(const TimerDuration*)b;
+	return (x > y) - (x < y);
+}
+
+/* The sample below which a fraction p of the samples lie (they must be sorted) */
+static double percentile(sample_set* s, double p)
+{
+	if(s->count == 0) return 0.0;
+	size_t i = (size_t)(p * (s->count - 1));
+	return (double) s->value[i];
+}
+
+
+
+/*********************************************
+
+	Reading the trace
+
+ *********************************************/
+
+static void read_trace(const char* path)
+{
+	FILE* f = fopen(path, "r");
+	if(f == NULL) { perror(path); exit(1); }
+
+	size_t capacity = 0;
+	char line[256];
+	while(fgets(line, sizeof(line), f) != NULL) {
+		if(line[0] == '#') {
+			sscanf(line, "# tinyos scheduler trace: cores %u policy %31s", &trace_cores, trace_policy);
+			continue;
+		}
+
+		trace_event e = { 0 };
+		int n;
+		unsigned long time, tid, length;
+		e.type = line[0];
+		switch(e.type) {
+		case 'C':
+		case 'W':
+			n = sscanf(line+1, "%lu %lx", &time, &tid);
+			if(n != 2) continue;
+			break;
+		case 'B':
+			n = sscanf(line+1, "%lu %lx %u %lu %d %c %d", &time, &tid, &e.core, &length,
+				&e.cause, &e.state, &e.nice);
+			if(n != 7 || e.cause < 0 || e.cause >= SCHED_CAUSES) continue;
+			e.length = length;
+			break;
+		default:
+			continue;
+		}
+		e.time = time;
+		e.tid = tid;
+
+		if(nevents == capacity) {
+			capacity = (capacity < 4096) ? 4096 : 2*capacity;
+			events = realloc(events, capacity * sizeof(trace_event));
+			if(events == NULL) { perror("sched_sim"); exit(1); }
+		}
+		events[nevents++] = e;
+	}
+	fclose(f);
+}
+
+/* Order by thread, then by time; a wakeup comes before a burst that starts with it */
+static int cmp_event(const void* a, const void* b)
+{
+	static const char rank[128] = { ['C'] = 0, ['W'] = 1, ['B'] = 2 };
+	const trace_event* x = a;
+	const trace_event* y = b;
+	if(x->tid != y->tid) return (x->tid > y->tid) - (x->tid < y->tid);
+	if(x->time != y->time) return (x->time > y->time) - (x->time < y->time);
+	return rank[(int)x->type] - rank[(int)y->type];
+}
+
+static sim_thread* new_thread(TimerDuration arrival)
+{
+	static uint capacity = 0;
+	if(nthreads == capacity) {
+		capacity = (capacity < 256) ? 256 : 2*capacity;
+		threads = realloc(threads, capacity * sizeof(sim_thread));
+		if(threads == NULL) { perror("sched_sim"); exit(1); }
+	}
+	sim_thread* th = &threads[nthreads++];
+	memset(th, 0, sizeof(sim_thread));
+	th->arrival = arrival;
+	return th;
+}
+
+/* Return the open burst of a thread, adding one if needed */
+static burst* open_burst(sim_thread* th, int* open)
+{
+	if(!*open) {
+		if(th->nbursts == th->capacity) {
+			th->capacity = (th->capacity < 8) ? 8 : 2*th->capacity;
+			th->bursts = realloc(th->bursts, th->capacity * sizeof(burst));
+			if(th->bursts == NULL) { perror("sched_sim"); exit(1); }
+		}
+		th->bursts[th->nbursts++] = (burst) { 0, 0, SCHED_USER, 0 };
+		*open = 1;
+	}
+	return &th->bursts[th->nbursts-1];
+}
+
+/*
+	Build the workload from the events of the trace, and measure the
+	recorded run: the run-queue waits go to 'waits', and the threads get
+	their recorded cpu and wait times. Return the number of completed
+	bursts, and the span of the trace in 'span'.
+ */
+static unsigned long build_workload(sample_set* waits, TimerDuration* span)
+{
+	qsort(events, nevents, sizeof(trace_event), cmp_event);
+
+	TimerDuration first = NO_TIMEOUT, last = 0;
+	unsigned long completed = 0;
+
+	sim_thread* th = NULL;
+	uintptr_t tid = 0;
+	int open = 0, exited = 0, blocked = 0;
+	TimerDuration ready = NO_TIMEOUT, stopped = 0;
+
+	for(size_t i=0; i<nevents; i++) {
+		trace_event* e = &events[i];
+		if(e->time < first) first = e->time;
+		if(e->time + e->length > last) last = e->time + e->length;
+
+		/* A new thread: the first event of a tid, a creation, or any event after an exit */
+		if(th == NULL || e->tid != tid || e->type == 'C' || exited) {
+			if(th != NULL && !exited && th->nbursts > 0)
+				th->bursts[th->nbursts-1].exits = 1;
+			th = new_thread(e->time);
+			tid = e->tid;
+			open = exited = blocked = 0;
+			ready = NO_TIMEOUT;
+			if(e->type == 'C') continue;
+		}
+
+		switch(e->type) {
+		case 'C':
+			break;
+
+		case 'W':
+			if(th->nbursts == 0 && !open)
+				th->arrival = e->time;
+			else if(blocked)
+				th->bursts[th->nbursts-1].sleep = (e->time > stopped) ? e->time - stopped : 0;
+			blocked = 0;
+			ready = e->time;
+			break;
+
+		case 'B': {
+			burst* b = open_burst(th, &open);
+			b->cpu += e->length;
+			th->cpu_time += e->length;
+			th->nice = e->nice;
+			if(ready != NO_TIMEOUT && e->time >= ready) {
+				add_sample(waits, e->time - ready);
+				th->wait_time += e->time - ready;
+			}
+			ready = NO_TIMEOUT;
+
+			if(e->state == 'R') {
+				/* Preempted, or yielded: the burst goes on */
+				ready = e->time + e->length;
+			} else {
+				b->cause = e->cause;
+				b->exits = (e->state == 'X');
+				open = 0;
+				completed++;
+				if(e->state == 'X')
+					exited = 1;
+				else {
+					blocked = 1;
+					stopped = e->time + e->length;
+				}
+			}
+			break;
+		}
+		}
+	}
+
+	/* A thread that never woke up again ends at its last burst */
+	for(uint t=0; t<nthreads; t++)
+		if(threads[t].nbursts > 0)
+			threads[t].bursts[threads[t].nbursts-1].exits = 1;
+
+	*span = (nevents > 0) ? last - first : 0;
+	return completed;
+}
+
+
+
+/*********************************************
+
+	Replaying the workload
+
+ *********************************************/
+
+/* The wakeups of the simulation, as a binary heap by time */
+typedef struct wakeup_event { TimerDuration time; sim_thread* th; } wakeup_event;
+static wakeup_event* wakeups;
+static uint nwakeups;
+
+static void wakeup_push(TimerDuration time, sim_thread* th)
+{
+	uint i = nwakeups++;
+	while(i > 0 && wakeups[(i-1)/2].time > time) {
+		wakeups[i] = wakeups[(i-1)/2];
+		i = (i-1)/2;
+	}
+	wakeups[i] = (wakeup_event) { time, th };
+}
+
+static sim_thread* wakeup_pop()
+{
+	sim_thread* th = wakeups[0].th;
+	wakeup_event last = wakeups[--nwakeups];
+	uint i = 0;
+	for(;;) {
+		uint c = 2*i+1;
+		if(c >= nwakeups) break;
+		if(c+1 < nwakeups && wakeups[c+1].time < wakeups[c].time) c++;
+		if(last.time <= wakeups[c].time) break;
+		wakeups[i] = wakeups[c];
+		i = c;
+	}
+	if(nwakeups > 0) wakeups[i] = last;
+	return th;
+}
+
+static const struct sched_ops* ops;
+static sim_core* cores;
+static TCB* tcbs; /* The TCB of threads[t] is tcbs[t] */
+
+/* Add a thread to the queue of a core, as sched_queue_enqueue() does */
+static void enqueue(sim_core* core, sim_thread* th, TimerDuration now)
+{
+	CCB* ccb = core->ccb;
+	if(ops->on_wakeup != NULL)
+		ops->on_wakeup(ccb, th->tcb);
+	ops->enqueue(ccb, th->tcb);
+	th->tcb->sched_ccb = ccb;
+	th->tcb->state = READY;
+	ccb->ready_count++;
+	th->ready_since = now;
+
+	/* A thread that runs alone gets a quantum when another one arrives */
+	if(core->current != NULL && core->tickless) {
+		core->tickless = 0;
+		if(now + QUANTUM < core->slice_end)
+			core->slice_end = now + QUANTUM;
+	}
+}
+
+/* The core for a thread that wakes up: its last core if idle, else an idle core, else its last core */
+static sim_core* wakeup_target(sim_thread* th)
+{
+	sim_core* last = &cores[th->tcb->last_core];
+	if(last->current == NULL)
+		return last;
+	for(uint c=0; c<ncores; c++)
+		if(cores[c].current == NULL)
+			return &cores[c];
+	return last;
+}
+
+/* The next thread of an idle core, from its own queue or the longest other queue */
+static sim_thread* pick(sim_core* core)
+{
+	CCB* ccb = core->ccb;
+	TCB* tcb = ops->pick_next(ccb, ccb->id);
+	if(tcb == NULL) {
+		CCB* victim = NULL;
+		for(uint c=0; c<ncores; c++)
+			if(cores[c].ccb->ready_count > 0 &&
+			   (victim == NULL || cores[c].ccb->ready_count > victim->ready_count))
+				victim = cores[c].ccb;
+		if(victim == NULL)
+			return NULL;
+		ccb = victim;
+		tcb = ops->pick_next(ccb, core->ccb->id);
+	}
+	ops->dequeue(ccb, tcb);
+	ccb->ready_count--;
+	return &threads[tcb - tcbs];
+}
+
+/*
+	Jain's fairness index of the share of time each thread ran while it
+	was runnable, per unit of weight: 1 when all threads got the same
+	share, down to 1/n when one thread got it all.
+ */
+static double fairness()
+{
+	double sum = 0.0, sum2 = 0.0;
+	uint n = 0;
+	for(uint t=0; t<nthreads; t++) {
+		sim_thread* th = &threads[t];
+		TimerDuration runnable = th->cpu_time + th->wait_time;
+		if(runnable == 0) continue;
+		double x = (double) th->cpu_time / runnable / sched_nice_weight(th->nice);
+		sum += x;
+		sum2 += x*x;
+		n++;
+	}
+	return (sum2 > 0) ? sum*sum / (n * sum2) : 1.0;
+}
+
+/* Run the workload against the policy, and report the metrics */
+static void simulate(const struct sched_ops* policy)
+{
+	ops = policy;
+
+	/* The cores, with queues for all the threads */
+	cores = calloc(ncores, sizeof(sim_core));
+	for(uint c=0; c<ncores; c++) {
+		CCB* ccb = calloc(1, sizeof(CCB));
+		ccb->id = c;
+		ccb->sched_spinlock = MUTEX_INIT;
+		for(uint p=0; p<PRIORITY_QUEUES; p++)
+			rlnode_init(&ccb->ready_queue[p], NULL);
+		ccb->fair_queue = (sched_heap) { calloc(nthreads+1, sizeof(heap_node*)), 0, nthreads+1 };
+		rlnode_init(&ccb->batch_queue, NULL);
+		cores[c].ccb = ccb;
+	}
+
+	/* The threads, which arrive at their creation */
+	wakeups = malloc((nthreads+1) * sizeof(wakeup_event));
+	nwakeups = 0;
+	tcbs = calloc(nthreads, sizeof(TCB));
+	for(uint t=0; t<nthreads; t++) {
+		sim_thread* th = &threads[t];
+		TCB* tcb = &tcbs[t];
+		tcb->type = NORMAL_THREAD;
+		tcb->state = INIT;
+		tcb->affinity = ~(cpumask_t)0;
+		tcb->nice = th->nice;
+		tcb->weight = sched_nice_weight(th->nice);
+		rlnode_init(&tcb->sched_node, tcb);
+		tcb->fair_node.tcb = tcb;
+		tcb->last_core = t % ncores;
+		tcb->curr_cause = SCHED_IDLE;
+		th->tcb = tcb;
+		th->next = 0;
+		th->left = th->bursts[0].cpu;
+		th->cpu_time = th->wait_time = 0;
+		wakeup_push(th->arrival, th);
+	}
+
+	sample_set waits = { NULL, 0, 0 };
+	unsigned long completed = 0, switches = 0;
+	TimerDuration busy = 0, start = (nwakeups > 0) ? wakeups[0].time : 0, now = start;
+	uint alive = nthreads;
+
+	int64_t t0 = now_nsec();
+	while(alive > 0) {
+		/* The next event: a wakeup or the end of a time-slice */
+		TimerDuration next = (nwakeups > 0) ? wakeups[0].time : NO_TIMEOUT;
+		for(uint c=0; c<ncores; c++)
+			if(cores[c].current != NULL && cores[c].slice_end < next)
+				next = cores[c].slice_end;
+		if(next == NO_TIMEOUT) break;
+		now = next;
+
+		/* The time-slices that end now */
+		for(uint c=0; c<ncores; c++) {
+			sim_core* core = &cores[c];
+			sim_thread* th = core->current;
+			if(th == NULL || core->slice_end > now) continue;
+
+			TCB* tcb = th->tcb;
+			TimerDuration delta = now - core->slice_start;
+			th->left -= delta;
+			th->cpu_time += delta;
+			busy += delta;
+			tcb->vruntime += delta * NICE_0_WEIGHT / tcb->weight;
+			core->current = NULL;
+
+			if(th->left > 0) {
+				/* The quantum expired */
+				tcb->curr_cause = SCHED_QUANTUM;
+				if(ops->on_tick != NULL) ops->on_tick(core->ccb, tcb, SCHED_QUANTUM, now);
+				enqueue(core, th, now);
+				continue;
+			}
+
+			burst* b = &th->bursts[th->next];
+			tcb->curr_cause = b->cause;
+			if(ops->on_tick != NULL) ops->on_tick(core->ccb, tcb, b->cause, now);
+			completed++;
+			if(b->exits || ++th->next == th->nbursts) {
+				tcb->state = EXITED;
+				alive--;
+			} else {
+				tcb->state = STOPPED;
+				th->left = th->bursts[th->next].cpu;
+				wakeup_push(now + b->sleep, th);
+			}
+		}
+
+		/* The threads that wake up now */
+		while(nwakeups > 0 && wakeups[0].time <= now) {
+			sim_thread* th = wakeup_pop();
+			enqueue(wakeup_target(th), th, now);
+		}
+
+		/* The idle cores pick their next thread */
+		for(uint c=0; c<ncores; c++) {
+			sim_core* core = &cores[c];
+			if(core->current != NULL) continue;
+			sim_thread* th = pick(core);
+			if(th == NULL) continue;
+
+			TCB* tcb = th->tcb;
+			if(ops->on_pick != NULL) ops->on_pick(core->ccb, tcb);
+			add_sample(&waits, now - th->ready_since);
+			th->wait_time += now - th->ready_since;
+			if(core->previous != th) switches++;
+			core->current = core->previous = th;
+			tcb->state = RUNNING;
+			tcb->last_core = c;
+
+			TimerDuration quantum = ops->quantum(core->ccb, tcb);
+			if(quantum < MIN_QUANTUM) quantum = MIN_QUANTUM;
+			core->tickless = (core->ccb->ready_count == 0);
+			if(core->tickless || quantum > th->left) quantum = th->left;
+			core->slice_start = now;
+			core->slice_end = now + quantum;
+		}
+	}
+	double wall = (now_nsec() - t0) * 1e-9;
+	double secs = (now - start) * 1e-6;
+
+	qsort(waits.value, waits.count, sizeof(TimerDuration), cmp_duration);
+	report(ops->name, "throughput", secs > 0 ? completed / secs : 0.0, "1/sec");
+	report(ops->name, "utilization", secs > 0 ? 100.0 * busy * 1e-6 / secs / ncores : 0.0, "%");
+	report(ops->name, "switches", secs > 0 ? switches / secs : 0.0, "1/sec");
+	report(ops->name, "fairness", fairness(), "");
+	report(ops->name, "wait_p50", percentile(&waits, 0.5), "usec");
+	report(ops->name, "wait_p99", percentile(&waits, 0.99), "usec");
+	report(ops->name, "wait_p999", percentile(&waits, 0.999), "usec");
+	report(ops->name, "speedup", wall > 0 ? secs / wall : 0.0, "x real time");
+
+	free(tcbs);
+	for(uint c=0; c<ncores; c++) {
+		free(cores[c].ccb->fair_queue.node);
+		free(cores[c].ccb);
+	}
+	free(cores);
+	free(wakeups);
+	free(waits.value);
+}
+
+
+static void usage(const char* pname)
+{
+	fprintf(stderr, "usage: %s [-c <cores>] [-S <policy>] <trace>\n", pname);
+	exit(1);
+}
+
+int main(int argc, char** argv)
+{
+	int opt;
+	while((opt = getopt(argc, argv, "c:S:h")) != -1) {
+		switch(opt) {
+		case 'c':
+			ncores = atoi(optarg);
+			if(ncores < 1 || ncores > MAX_CORES) {
+				fprintf(stderr, "%s: the cores must be from 1 to %d\n", argv[0], MAX_CORES);
+				exit(1);
+			}
+			break;
+		case 'S':
+			policy_name = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(optind != argc-1) usage(argv[0]);
+
+	int found = (policy_name == NULL);
+	for(uint p=0; p<SCHED_POLICIES; p++)
+		if(policy_name != NULL && strcmp(policy_name, sched_policy_ops(p)->name) == 0)
+			found = 1;
+	if(!found) {
+		fprintf(stderr, "%s: unknown policy '%s'\n", argv[0], policy_name);
+		exit(1);
+	}
+
+	read_trace(argv[optind]);
+
+	sample_set waits = { NULL, 0, 0 };
+	TimerDuration span;
+	unsigned long completed = build_workload(&waits, &span);
+
+	/* Drop the threads with no bursts */
+	uint n = 0;
+	for(uint t=0; t<nthreads; t++) {
+		if(threads[t].nbursts > 0)
+			threads[n++] = threads[t];
+		else
+			free(threads[t].bursts);
+	}
+	nthreads = n;
+	if(nthreads == 0) {
+		fprintf(stderr, "%s: no bursts in '%s'\n", argv[0], argv[optind]);
+		exit(1);
+	}
+	if(ncores == 0)
+		ncores = (trace_cores > 0 && trace_cores <= MAX_CORES) ? trace_cores : 1;
+
+	printf("# %u threads, %lu bursts, %lu events, recorded on %u cores with policy %s, replayed on %u cores\n",
+		nthreads, completed, (unsigned long) nevents, trace_cores, 
+		trace_policy[0] ? trace_policy : "?", ncores);
+
+	/* The recorded run */
+	TimerDuration busy = 0;
+	for(uint t=0; t<nthreads; t++) busy += threads[t].cpu_time;
+	double secs = span * 1e-6;
+	qsort(waits.value, waits.count, sizeof(TimerDuration), cmp_duration);
+	report("trace", "throughput", secs > 0 ? completed / secs : 0.0, "1/sec");
+	report("trace", "utilization", secs > 0 && trace_cores > 0 ? 100.0 * busy * 1e-6 / secs / trace_cores : 0.0, "%");
+	report("trace", "fairness", fairness(), "");
+	report("trace", "wait_p50", percentile(&waits, 0.5), "usec");
+	report("trace", "wait_p99", percentile(&waits, 0.99), "usec");
+	report("trace", "wait_p999", percentile(&waits, 0.999), "usec");
+	free(waits.value);
+
+	/* The replays */
+	for(uint p=0; p<SCHED_POLICIES; p++) {
+		const struct sched_ops* policy = sched_policy_ops(p);
+		if(policy_name == NULL || strcmp(policy_name, policy->name) == 0)
+			simulate(policy);
+	}
+
+	for(uint t=0; t<nthreads; t++) free(threads[t].bursts);
+	free(threads);
+	free(events);
+	return 0;
+}
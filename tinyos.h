@@ -3,6 +3,7 @@
 #define __TINYOS_H__
 
 #include <stdint.h>
+#include <stddef.h>
 
 /**
   @file tinyos.h
@@ -61,6 +62,13 @@ typedef uintptr_t Tid_t;
 /** @brief The invalid thread ID */
 #define NOTHREAD ((Tid_t)0)
 
+/**
+  @brief A set of cpu cores, as a bit mask: bit @c i stands for core @c i.
+
+  @see SetThreadAffinity
+  */
+typedef uint32_t cpumask_t;
+
 
 /*******************************************
  *      Concurrency control
@@ -180,6 +188,21 @@ int Cond_Wait(Mutex* mx, CondVar* cv);
 int Cond_TimedWait(Mutex* mx, CondVar* cv, timeout_t timeout);
 
 
+/** @brief Sleep for a time.
+
+  The calling thread sleeps for at least @c usec microseconds. The timer 
+  of its core is armed for the wakeup time, so the thread becomes ready 
+  soon after it (the rest depends on the other threads of the core).
+  @c Cond_TimedWait also arms the timer for its exact deadline, but its 
+  timeout is given in milliseconds.
+
+  Note that @c usec is not a @c timeout_t, whose unit is milliseconds.
+
+  @param usec The time to sleep, in microseconds.
+  */
+void Sleep(unsigned long usec);
+
+
 
 /** @brief Signal a condition variable. 
    
@@ -240,6 +263,24 @@ typedef int (*Task)(int, void*);
   */
 Pid_t Exec(Task task, int argl, void* args);
 
+/** @brief Create a new process, whose main thread has a given stack size.
+
+  This call is like @c Exec, except that the stack of the main thread
+  of the new process is @c stack_size bytes, instead of the default.
+  The stack size is rounded up to a page, and to a minimum size.
+  Stack memory is only committed when it is used, so large stacks are cheap.
+
+  @param task the main function  of the new process
+  @param argl the length of byte array @c args
+  @param args the byte array copied as argument to `task`
+  @param stack_size the stack size of the main thread, or 0 for the default
+  @return On success, the pid of the new process is returned.
+    On error, NOPROC is returned.
+  @see Exec
+  @see GetStackInfo
+  */
+Pid_t ExecStack(Task task, int argl, void* args, size_t stack_size);
+
 
 /** @brief Exit the current process.
 
@@ -374,6 +415,451 @@ int ThreadDetach(Tid_t tid);
   */
 void ThreadExit(int exitval);
 
+/**
+  @brief Information about the stack of a thread.
+
+  @see GetStackInfo
+ */
+typedef struct stack_info
+{
+  size_t size;        /**< @brief The size of the stack, in bytes. */
+  size_t high_water;  /**< @brief The high-water mark of the stack, in bytes.
+
+            This is the maximum depth that the stack has reached so far,
+            accurate to a page. */
+} stack_info;
+
+/**
+  @brief Return information about the stack of a thread.
+
+  This can be used to right-size the stacks requested by @c ExecStack.
+
+  @param tid the thread, which must belong to the current process, or 
+     @c NOTHREAD for the current thread
+  @param info a location where the information is stored
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - @c info is NULL.
+  @see ExecStack
+  */
+int GetStackInfo(Tid_t tid, stack_info* info);
+
+/**
+  @brief Set the cpu affinity of a thread.
+
+  The thread will only run on the cores in @c mask. If the calling thread
+  excludes its current core, it moves to an allowed core before this call
+  returns. Cores beyond those of the machine are ignored. New processes 
+  inherit the affinity of the thread that creates them.
+
+  @param tid the thread, which must belong to the current process, or 
+     @c NOTHREAD for the current thread
+  @param mask the set of allowed cores
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - @c mask contains no core of the machine.
+  @see GetThreadAffinity
+  */
+int SetThreadAffinity(Tid_t tid, cpumask_t mask);
+
+/**
+  @brief Get the cpu affinity of a thread.
+
+  @param tid the thread, which must belong to the current process, or 
+     @c NOTHREAD for the current thread
+  @param mask a location where the set of allowed cores is stored
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - @c mask is NULL.
+  @see SetThreadAffinity
+  */
+int GetThreadAffinity(Tid_t tid, cpumask_t* mask);
+
+/**
+  @brief Yield the core to a specific thread.
+
+  If the thread is ready to run (it waits in a scheduler queue) and it 
+  may run on the current core, it gets the core at once, with the rest
+  of the time-slice of the current thread, unless a thread of a higher
+  class (e.g., a real-time thread) is ready. Otherwise (e.g., the thread
+  is running on another core, or it is sleeping), this is a normal 
+  yield. This helps user-level synchronization, such as spin-then-yield 
+  locks and producer/consumer handoffs: a thread which waits for another 
+  thread gives its core to that thread, instead of going to the back of
+  the queue. The thread may belong to any process.
+
+  @param tid the thread, or @c NOTHREAD for a normal yield
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid (e.g., it has exited).
+  */
+int YieldTo(Tid_t tid);
+
+/**
+  @brief Scheduling statistics of a thread.
+
+  @see GetThreadStats
+ */
+typedef struct thread_stats
+{
+  unsigned int last_core;     /**< @brief The core that the thread ran on most recently. 
+
+            For a thread that has not run yet, this is the core that created it. */
+  unsigned long migrations;   /**< @brief The number of times the thread ran on a core 
+                                   other than the one it ran on before. */
+} thread_stats;
+
+/**
+  @brief Return scheduling statistics of a thread.
+
+  An idle core takes a ready thread from the queue of another core only
+  if the thread has not run there recently (so its cache is cold), or if
+  the load of the cores is imbalanced. These statistics show how often 
+  threads move between cores.
+
+  @param tid the thread, which must belong to the current process, or 
+     @c NOTHREAD for the current thread
+  @param stats a location where the statistics are stored
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - @c stats is NULL.
+  */
+int GetThreadStats(Tid_t tid, thread_stats* stats);
+
+/** @brief The lowest nice value (the largest share of the cpu). */
+#define NICE_MIN (-20)
+
+/** @brief The highest nice value (the smallest share of the cpu). */
+#define NICE_MAX 19
+
+/**
+  @brief Set the nice value of a thread.
+
+  Threads that compete for a core get shares of it according to their
+  nice values: each nice level below 0 increases the share of a thread
+  by about 25%, and each level above 0 decreases it by about 20%, relative to
+  a thread of nice 0. Threads start with nice 0, and new processes inherit 
+  the nice value of the thread that creates them.
+
+  @param tid the thread, which must belong to the current process, or 
+     @c NOTHREAD for the current thread
+  @param nice the new nice value, from @c NICE_MIN to @c NICE_MAX
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - @c nice is out of range.
+  @see GetPriority
+  */
+int SetPriority(Tid_t tid, int nice);
+
+/**
+  @brief Get the nice value of a thread.
+
+  @param tid the thread, which must belong to the current process, or 
+     @c NOTHREAD for the current thread
+  @param nice a location where the nice value is stored
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - @c nice is NULL.
+  @see SetPriority
+  */
+int GetPriority(Tid_t tid, int* nice);
+
+/**
+  @brief The real-time parameters of a thread.
+
+  All times are in microseconds.
+
+  @see SetDeadline
+ */
+typedef struct deadline_attr
+{
+  unsigned long runtime;   /**< @brief The cpu time that the thread needs in every period */
+  unsigned long deadline;  /**< @brief The time, from the start of each period, by which 
+                                the thread must have received its @c runtime */
+  unsigned long period;    /**< @brief The period of the thread */
+  unsigned long misses;    /**< @brief The number of deadlines that the thread has missed 
+                                (ignored by @c SetDeadline) */
+} deadline_attr;
+
+/**
+  @brief Make a thread real-time, or return it to the normal class.
+
+  A real-time thread is guaranteed @c attr->runtime of cpu time within 
+  @c attr->deadline from the start of each period. A period starts when 
+  the thread becomes ready after its previous deadline. Ready real-time
+  threads run before all other threads, earliest deadline first. A 
+  thread that uses up its runtime gets its deadline postponed by a period.
+
+  A thread is admitted to the real-time class only if the total 
+  utilization (runtime/period) of the real-time threads stays within
+  95% of the cores of the machine. New processes do not inherit the 
+  real-time class.
+
+  @param tid the thread, which must belong to the current process, or 
+     @c NOTHREAD for the current thread
+  @param attr the real-time parameters, or NULL to return to the normal class
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the parameters do not satisfy 0 < runtime <= deadline <= period <= 10 sec.
+    - the thread was not admitted.
+  @see GetDeadline
+  */
+int SetDeadline(Tid_t tid, const deadline_attr* attr);
+
+/**
+  @brief Get the real-time parameters of a thread.
+
+  For a normal thread, @c runtime, @c deadline and @c period are 0.
+
+  @param tid the thread, which must belong to the current process, or 
+     @c NOTHREAD for the current thread
+  @param attr a location where the parameters and the number of missed
+     deadlines are stored
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - @c attr is NULL.
+  @see SetDeadline
+  */
+int GetDeadline(Tid_t tid, deadline_attr* attr);
+
+/**
+  @brief Move a thread to the batch class, or back to the normal class.
+
+  Batch threads are meant for long cpu-bound jobs. A ready batch thread
+  runs only when no other thread is ready on its core, and any other 
+  thread that becomes ready preempts it at once. In exchange, batch
+  threads that share a core take turns with long time-slices (100 msec),
+  which saves context switches and cache refills. A real-time thread
+  stays real-time, and it is a batch thread when it returns to the
+  normal class. New processes inherit the class of the thread that 
+  creates them.
+
+  @param tid the thread, which must belong to the current process, or 
+     @c NOTHREAD for the current thread
+  @param batch non-zero for the batch class, zero for the normal class
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+  @see GetBatch
+  */
+int SetBatch(Tid_t tid, int batch);
+
+/**
+  @brief Return whether a thread is in the batch class.
+
+  @param tid the thread, which must belong to the current process, or 
+     @c NOTHREAD for the current thread
+  @param batch a location where 1 is stored for a batch thread, else 0
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - @c batch is NULL.
+  @see SetBatch
+  */
+int GetBatch(Tid_t tid, int* batch);
+
+/**
+  @brief Put a thread in a gang, or take it out of its gang.
+
+  The threads of a gang are co-scheduled on different cores. When a gang
+  thread wakes up while another thread of its gang is running, it goes
+  to a core which does not run its gang, and it preempts the thread of
+  that core at once (unless that thread is real-time, or in a gang 
+  itself). This helps parallel jobs that synchronize often, e.g., at a 
+  barrier: a thread does not wait for a sibling which waits for a core.
+  Gangs are co-scheduled only if the host has a cpu for every core.
+  Real-time and batch threads ignore their gang. New processes inherit 
+  the gang of the thread that creates them, so a parallel job is a gang
+  of processes.
+
+  @param tid the thread, which must belong to the current process, or 
+     @c NOTHREAD for the current thread
+  @param gang a positive gang id, or 0 to leave the gang
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - @c gang is negative.
+  @see GetGang
+  */
+int SetGang(Tid_t tid, int gang);
+
+/**
+  @brief Return the gang of a thread.
+
+  @param tid the thread, which must belong to the current process, or 
+     @c NOTHREAD for the current thread
+  @param gang a location where the gang id is stored, or 0 if the thread
+     is not in a gang
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - @c gang is NULL.
+  @see SetGang
+  */
+int GetGang(Tid_t tid, int* gang);
+
+/** @brief The number of cpu groups, including the default group 0. */
+#define CPU_GROUPS 16
+
+/**
+  @brief The cpu quota of a cpu group, and its usage.
+
+  All times are in microseconds.
+
+  @see SetCpuQuota
+ */
+typedef struct cpu_quota
+{
+  unsigned long quota;          /**< @brief The cpu time the group may use in every period, 
+                                     or 0 for no limit */
+  unsigned long period;         /**< @brief The period of the quota */
+  unsigned long usage;          /**< @brief The cpu time used in the current period, or 0
+                                     if there is no limit (ignored by @c SetCpuQuota) */
+  unsigned long total;          /**< @brief The cpu time used since boot 
+                                     (ignored by @c SetCpuQuota) */
+  unsigned long throttles;      /**< @brief The number of times a thread of the group was
+                                     throttled (ignored by @c SetCpuQuota) */
+  unsigned long throttled_time; /**< @brief The total time that the threads of the group 
+                                     were throttled (ignored by @c SetCpuQuota) */
+} cpu_quota;
+
+/**
+  @brief Move a thread to a cpu group.
+
+  A cpu group is a set of threads which share a cpu quota (see 
+  @c SetCpuQuota), e.g., the processes of a tenant. Threads start in
+  the default group 0, which has no quota, and new processes inherit 
+  the group of the thread that creates them.
+
+  @param tid the thread, which must belong to the current process, or 
+     @c NOTHREAD for the current thread
+  @param group the group, from 0 to @c CPU_GROUPS-1
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - @c group is out of range.
+  @see GetCpuGroup
+  */
+int SetCpuGroup(Tid_t tid, int group);
+
+/**
+  @brief Return the cpu group of a thread.
+
+  @param tid the thread, which must belong to the current process, or 
+     @c NOTHREAD for the current thread
+  @param group a location where the group is stored
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - @c group is NULL.
+  @see SetCpuGroup
+  */
+int GetCpuGroup(Tid_t tid, int* group);
+
+/**
+  @brief Limit the cpu time of a cpu group.
+
+  The threads of the group may use @c q->quota of cpu time in every
+  @c q->period, in total over all cores. When the group has used up
+  its quota, its threads are throttled: they are taken off the cores
+  and the scheduler queues until the next period. Thus, a group of 
+  processes cannot take more than @c q->quota / @c q->period cores,
+  however many threads it runs. The quota may exceed the period, on
+  a machine with many cores. Setting the quota starts a new period,
+  and it does not reset the counters of the group.
+
+  @param group the group, from 1 to @c CPU_GROUPS-1
+  @param q the quota and the period, or NULL to remove the limit
+  @returns 0 on success and -1 on error. Possible errors are:
+    - @c group is out of range.
+    - the period is not from 1 msec to 10 sec.
+    - the quota is 0, or more than the period times the number of cores.
+  @see GetCpuQuota
+  */
+int SetCpuQuota(int group, const cpu_quota* q);
+
+/**
+  @brief Return the quota of a cpu group and its usage counters.
+
+  The counters are kept for all groups, including the default group 0.
+
+  @param group the group, from 0 to @c CPU_GROUPS-1
+  @param q a location where the quota and the counters are stored
+  @returns 0 on success and -1 on error. Possible errors are:
+    - @c group is out of range.
+    - @c q is NULL.
+  @see SetCpuQuota
+  */
+int GetCpuQuota(int group, cpu_quota* q);
+
+/**
+  @brief The restartable sequence area of a thread.
+
+  A thread registers such an area with @c RseqRegister, and then runs 
+  restartable sequences on per-core data: @c RseqBegin returns the current
+  core, the thread reads the data of that core and prepares an update, 
+  and @c RseqCommit stores the update, unless the sequence was aborted, 
+  i.e., the thread stopped running on its core in the meantime (it was 
+  preempted, or it slept, or it moved to another core). An aborted 
+  sequence is restarted by the caller. For example, a per-core counter:
+
+  @code
+  do {
+    unsigned int core = RseqBegin(&rs);
+    v = counter[core] + 1;
+  } while(!RseqCommit(&rs, (uintptr_t*)&counter[core], v));
+  @endcode
+
+  If the thread is preempted or moves to another core between 
+  @c RseqBegin and @c RseqCommit, the commit fails and the sequence is 
+  restarted. Thus, per-core data which are only updated by restartable 
+  sequences need no locks or atomic operations.
+
+  @see RseqRegister
+ */
+typedef struct rseq_area
+{
+  volatile unsigned int cpu_id;   /**< @brief The core of the thread, kept current by the kernel */
+  volatile unsigned int in_cs;    /**< @brief Non-zero inside a sequence */
+  volatile unsigned int aborted;  /**< @brief Set by the kernel, if the thread stops running 
+                                       on its core inside a sequence */
+  volatile unsigned int committing; /**< @brief Non-zero while @c RseqCommit checks and stores */
+  volatile unsigned int deferred; /**< @brief Set by the kernel, if it deferred a preemption 
+                                       during @c RseqCommit */
+} rseq_area;
+
+/**
+  @brief Register the restartable sequence area of the current thread.
+
+  The area must stay valid while it is registered, and it is never 
+  registered for a new process.
+
+  @param rs the area, or NULL to unregister the current one.
+  @returns 0 on success (this cannot fail).
+  @see RseqBegin
+  */
+int RseqRegister(rseq_area* rs);
+
+/**
+  @brief Begin a restartable sequence.
+
+  @param rs the registered area of the current thread
+  @returns the current core of the thread.
+  @see RseqCommit
+  */
+unsigned int RseqBegin(rseq_area* rs);
+
+/**
+  @brief Commit a restartable sequence with a store.
+
+  Unless the sequence was aborted, store @c value to @c *ptr, atomically 
+  with the check. In any case, the sequence ends. The thread is not 
+  preempted between the check and the store (a preemption is deferred 
+  until the end of the call, for a bounded time), and no system call is 
+  made.
+
+  @param rs the registered area of the current thread
+  @param ptr the location to update
+  @param value the value to store
+  @returns 1 if the value was stored, or 0 if the sequence was aborted
+     and must be restarted.
+  @see rseq_area
+  */
+int RseqCommit(rseq_area* rs, uintptr_t* ptr, uintptr_t value);
+
 
 
 /*******************************************
@@ -759,6 +1245,75 @@ typedef struct procinfo
  */
 Fid_t OpenInfo();
 
+/**
+  @brief The number of buckets of a scheduler latency histogram.
+
+  Bucket 0 counts intervals shorter than 1 usec, and bucket @c i > 0 
+  counts intervals from @f$ 2^{i-1} @f$ to @f$ 2^i - 1 @f$ usec. The last 
+  bucket also counts all longer intervals.
+
+  @see sched_hist
+  */
+#define SCHED_HIST_BUCKETS 20
+
+/**
+  @brief The number of reasons for the end of a time-slice.
+
+  These are, in order: the quantum expired, I/O, a contended mutex, a pipe or
+  socket, device polling, the idle thread, a user yield, a sleep timeout, 
+  and preemption by a more urgent thread.
+
+  @see sched_hist
+  */
+#define SCHED_CAUSES 9
+
+/**
+  @brief Scheduler latency histograms, of a thread or a core.
+
+  @see schedinfo
+  */
+typedef struct sched_hist
+{
+  unsigned long wait[SCHED_HIST_BUCKETS]; /**< @brief The time from becoming ready 
+                                              (woken up or preempted) to running */
+  unsigned long run[SCHED_HIST_BUCKETS];  /**< @brief The length of time-slices */
+  unsigned long cause[SCHED_CAUSES];      /**< @brief The number of time-slices that ended 
+                                              for each reason */
+} sched_hist;
+
+/**
+  @brief A record of a scheduler information stream.
+
+  There is a record for each core, followed by a record for the main thread
+  of each live process.
+
+  @see OpenSchedInfo
+  */
+typedef struct schedinfo
+{
+  int core;        /**< @brief The core of a core record, or -1 for a thread record */
+  Pid_t pid;       /**< @brief The process of a thread record, or @c NOPROC for a core record */
+  sched_hist hist; /**< @brief The histograms of the core (all its threads), or of the thread */
+} schedinfo;
+
+/**
+  @brief Open a scheduler information stream.
+
+  This is a read-only stream that returns a sequence of @c schedinfo 
+  structures, each packed into a block of size @c sizeof(schedinfo). 
+  The records are a snapshot taken when the stream is opened. The 
+  histograms count from boot (for cores), or from the creation of 
+  the thread.
+
+  This shows how long ready threads wait for a core, how long they run,
+  and why they stop, e.g., to diagnose tail latency under load.
+
+  @returns a file id on success, or NOFILE on error. Possible reasons
+    for error are:
+    - the available file ids for the process are exhausted.
+ */
+Fid_t OpenSchedInfo();
+
 
 
 
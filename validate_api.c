@@ -10,6 +10,7 @@
 #include "symposium.h"
 #include "tinyoslib.h"
 #include "unit_testing.h"
+#include "kernel_sched.h"
 
 
 /*
@@ -2597,11 +2598,1045 @@ BARE_TEST(dummy_user_test,
 }
 
 
+/*
+	Processes sleeping with different timeouts must wake up in the order
+	of their timeouts, regardless of the order in which they went to sleep.
+ */
+
+#define TIMEOUT_ORDER_N 10
+
+static Mutex timeout_order_mx = MUTEX_INIT;
+static int timeout_order[TIMEOUT_ORDER_N];
+static int timeout_order_count;
+
+static int sleep_and_record_rank(int argl, void* args)
+{
+	int rank = *(int*)args;
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 50*(rank+1));
+	Mutex_Unlock(&mx);
+
+	Mutex_Lock(&timeout_order_mx);
+	timeout_order[timeout_order_count++] = rank;
+	Mutex_Unlock(&timeout_order_mx);
+	return 0;
+}
+
+BOOT_TEST(test_timeouts_expire_in_order,
+	"Test that timed waits expire in the order of their timeouts."
+	)
+{
+	timeout_order_count = 0;
+
+	for(int i=0; i<TIMEOUT_ORDER_N; i++) {
+		int rank = (3*i) % TIMEOUT_ORDER_N;
+		ASSERT(Exec(sleep_and_record_rank, sizeof(rank), &rank)!=NOPROC);
+	}
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	ASSERT(timeout_order_count == TIMEOUT_ORDER_N);
+	for(int i=0; i<TIMEOUT_ORDER_N; i++)
+		ASSERT(timeout_order[i] == i);
+	return 0;
+}
+
+
+/*
+	ExecStack gives the main thread the requested stack size, and 
+	GetStackInfo reports how deep the stack has been used.
+ */
+
+/* Touch about 'depth' bytes of stack. This must not be inlined or folded
+   by the optimizer, so the buffer is written through a volatile pointer 
+   and used after the recursive call. */
+static __attribute__((noinline)) int touch_stack(size_t depth)
+{
+	char buf[1024];
+	volatile char* p = buf;
+	for(size_t i=0; i<sizeof(buf); i+=64) p[i] = 1;
+	int r = (depth <= sizeof(buf)) ? 0 : touch_stack(depth - sizeof(buf));
+	return r + p[0];
+}
+
+static int check_stack_info(int argl, void* args)
+{
+	size_t depth = *(size_t*)args;
+	stack_info info;
+
+	ASSERT(GetStackInfo(NOTHREAD, &info)==0);
+	ASSERT(info.size == 64*1024);
+	ASSERT(info.high_water > 0 && info.high_water < depth);
+
+	touch_stack(depth);
+
+	ASSERT(GetStackInfo(ThreadSelf(), &info)==0);
+	ASSERT(info.high_water >= depth && info.high_water <= info.size);
+	return 0;
+}
+
+/* A child with a stack much larger than a kernel stack of pages to scan */
+static int check_big_stack_info(int argl, void* args)
+{
+	stack_info info;
+	ASSERT(GetStackInfo(NOTHREAD, &info)==0);
+	ASSERT(info.size == *(size_t*)args);
+	ASSERT(info.high_water > 0 && info.high_water < 64*1024);
+	return 0;
+}
+
+BOOT_TEST(test_exec_stack_size,
+	"Test that ExecStack sets the stack size, and that GetStackInfo reports the stack usage."
+	)
+{
+	size_t depth = 32*1024;
+	Pid_t pid = ExecStack(check_stack_info, sizeof(depth), &depth, 64*1024);
+	ASSERT(pid != NOPROC);
+
+	int status;
+	ASSERT(WaitChild(pid, &status)==pid);
+	ASSERT(status==0);
+
+	stack_info info;
+	ASSERT(GetStackInfo(NOTHREAD, NULL)==-1);
+	ASSERT(GetStackInfo((Tid_t)&info, &info)==-1);
+	ASSERT(GetStackInfo(NOTHREAD, &info)==0);
+	ASSERT(info.size >= 64*1024);
+
+	/* The stack is only committed when touched, so a huge one is cheap */
+	size_t big = (size_t)1 << 30;
+	pid = ExecStack(check_big_stack_info, sizeof(big), &big, big);
+	ASSERT(pid != NOPROC);
+	ASSERT(WaitChild(pid, &status)==pid);
+	ASSERT(status==0);
+	return 0;
+}
+
+
+/*
+	A thread pinned with SetThreadAffinity only runs on the allowed cores,
+	and new processes inherit the affinity of their creator.
+ */
+
+static int check_inherited_affinity(int argl, void* args)
+{
+	cpumask_t mask = *(cpumask_t*)args;
+	cpumask_t cur;
+
+	ASSERT(GetThreadAffinity(NOTHREAD, &cur)==0);
+	ASSERT(cur == mask);
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	for(int i=0; i<10; i++) {
+		ASSERT(mask & (1u << cpu_core_id));
+		Cond_TimedWait(&mx, &cv, 2);
+	}
+	Mutex_Unlock(&mx);
+	return 0;
+}
+
+BOOT_TEST(test_thread_affinity,
+	"Test that SetThreadAffinity pins a thread to a core, and that it is inherited by Exec."
+	)
+{
+	cpumask_t all = (1u << cpu_cores()) - 1;
+	cpumask_t mask;
+
+	ASSERT(GetThreadAffinity(NOTHREAD, &mask)==0);
+	ASSERT(mask == all);
+	ASSERT(GetThreadAffinity(ThreadSelf(), &mask)==0);
+	ASSERT(mask == all);
+
+	ASSERT(GetThreadAffinity(NOTHREAD, NULL)==-1);
+	ASSERT(GetThreadAffinity((Tid_t)&mask, &mask)==-1);
+	ASSERT(SetThreadAffinity(NOTHREAD, 0)==-1);
+	ASSERT(SetThreadAffinity(NOTHREAD, 1u << cpu_cores())==-1);
+	ASSERT(SetThreadAffinity((Tid_t)&mask, all)==-1);
+
+	/* Move to the last core */
+	cpumask_t last = 1u << (cpu_cores()-1);
+	ASSERT(SetThreadAffinity(NOTHREAD, last)==0);
+	ASSERT(cpu_core_id == cpu_cores()-1);
+	ASSERT(GetThreadAffinity(NOTHREAD, &mask)==0);
+	ASSERT(mask == last);
+
+	int status;
+	Pid_t pid = Exec(check_inherited_affinity, sizeof(last), &last);
+	ASSERT(pid!=NOPROC);
+	ASSERT(WaitChild(pid, &status)==pid);
+	ASSERT(status==0);
+
+	/* Move back to the first core */
+	ASSERT(SetThreadAffinity(NOTHREAD, 1)==0);
+	ASSERT(cpu_core_id == 0);
+	ASSERT(SetThreadAffinity(NOTHREAD, all)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_thread_stats,
+	"Test that GetThreadStats reports the last core of a thread, and counts its migrations."
+	)
+{
+	thread_stats stats;
+	ASSERT(GetThreadStats(NOTHREAD, NULL)==-1);
+	ASSERT(GetThreadStats((Tid_t)&stats, &stats)==-1);
+
+	/* Pinned to the first core, then moved to the last core and back */
+	ASSERT(SetThreadAffinity(NOTHREAD, 1)==0);
+	ASSERT(GetThreadStats(ThreadSelf(), &stats)==0);
+	ASSERT(stats.last_core == 0);
+	unsigned long migrations = stats.migrations;
+
+	ASSERT(SetThreadAffinity(NOTHREAD, 1u << (cpu_cores()-1))==0);
+	ASSERT(GetThreadStats(NOTHREAD, &stats)==0);
+	ASSERT(stats.last_core == cpu_cores()-1);
+	if(cpu_cores() > 1) migrations++;
+	ASSERT(stats.migrations == migrations);
+
+	ASSERT(SetThreadAffinity(NOTHREAD, 1)==0);
+	ASSERT(GetThreadStats(NOTHREAD, &stats)==0);
+	ASSERT(stats.last_core == 0);
+	if(cpu_cores() > 1) migrations++;
+	ASSERT(stats.migrations == migrations);
+
+	ASSERT(SetThreadAffinity(NOTHREAD, (1u << cpu_cores()) - 1)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_sched_info,
+	"Test that OpenSchedInfo returns a record per core and per process, and that the histograms count time-slices."
+	)
+{
+	/* Some time-slices of our own, ending in timed sleeps */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	for(int i=0; i<10; i++)
+		Cond_TimedWait(&mx, &cv, 1);
+	Mutex_Unlock(&mx);
+
+	Fid_t f = OpenSchedInfo();
+	ASSERT(f!=NOFILE);
+	ASSERT(Write(f, "x", 1)==-1);
+
+	schedinfo info;
+	unsigned int cores = 0, threads = 0;
+	int found = 0;
+	int rc;
+	while((rc = Read(f, (char*)&info, sizeof(info))) > 0) {
+		ASSERT(rc == sizeof(info));
+		unsigned long slices = 0, waits = 0, causes = 0;
+		for(int b=0; b<SCHED_HIST_BUCKETS; b++) {
+			slices += info.hist.run[b];
+			waits += info.hist.wait[b];
+		}
+		for(int c=0; c<SCHED_CAUSES; c++)
+			causes += info.hist.cause[c];
+		ASSERT(slices == causes);
+
+		if(info.core >= 0) {
+			ASSERT(info.core == cores);
+			ASSERT(info.pid == NOPROC);
+			ASSERT(threads == 0);
+			cores++;
+		} else {
+			threads++;
+			if(info.pid == GetPid()) {
+				found = 1;
+				ASSERT(slices >= 10);
+				ASSERT(waits >= slices);
+			}
+		}
+	}
+	ASSERT(rc == 0);
+	ASSERT(cores == cpu_cores());
+	ASSERT(threads >= 1);
+	ASSERT(found);
+	ASSERT(Close(f)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_sleep_precise,
+	"Test that Sleep and Cond_TimedWait never wake up early, and wake up soon after their timeout."
+	)
+{
+	Sleep(0);
+
+	TimerDuration over = 0;
+	for(int i=0; i<20; i++) {
+		TimerDuration t0 = bios_clock_hires();
+		Sleep(2000);
+		TimerDuration elapsed = bios_clock_hires() - t0;
+		ASSERT(elapsed >= 2000);
+		over += elapsed - 2000;
+	}
+	ASSERT(over / 20 < 1000);
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	TimerDuration t0 = bios_clock_hires();
+	ASSERT(Cond_TimedWait(&mx, &cv, 1)==0);
+	ASSERT(bios_clock_hires() - t0 >= 1000);
+	Mutex_Unlock(&mx);
+	return 0;
+}
+
+
+/*
+  A worker for test_rseq_counters: it increments the per-core counters 
+  with restartable sequences.
+ */
+#define RSEQ_INCREMENTS 20000
+static uintptr_t rseq_counter[MAX_CORES];
+
+static int rseq_worker(int argl, void* args)
+{
+	rseq_area rs;
+	ASSERT(RseqRegister(&rs)==0);
+
+	for(int i=0; i<RSEQ_INCREMENTS; i++) {
+		unsigned int core;
+		uintptr_t v;
+		for(;;) {
+			core = RseqBegin(&rs);
+			ASSERT(core < cpu_cores());
+			v = rseq_counter[core];
+			for(volatile int d=0; d<50; d++);	/* widen the window */
+			if(RseqCommit(&rs, &rseq_counter[core], v+1)) break;
+		}
+	}
+	ASSERT(RseqRegister(NULL)==0);
+	return 0;
+}
+
+BOOT_TEST(test_rseq_counters,
+	"Test that restartable sequences abort when the thread stops running on its core, and keep per-core counters exact."
+	)
+{
+	rseq_area rs;
+	ASSERT(RseqRegister(&rs)==0);
+
+	/* No switch: the sequence commits */
+	uintptr_t x = 0;
+	RseqBegin(&rs);
+	ASSERT(RseqCommit(&rs, &x, 1)==1);
+	ASSERT(x == 1);
+
+	/* Sleeping lets another thread (at least the idle thread) run */
+	RseqBegin(&rs);
+	Sleep(100);
+	ASSERT(RseqCommit(&rs, &x, 2)==0);
+	ASSERT(x == 1);
+
+	/* Moving to another core aborts, and updates the core */
+	if(cpu_cores() > 1) {
+		ASSERT(SetThreadAffinity(NOTHREAD, 1)==0);
+		ASSERT(RseqBegin(&rs)==0);
+		ASSERT(SetThreadAffinity(NOTHREAD, 2)==0);
+		ASSERT(RseqCommit(&rs, &x, 3)==0);
+		ASSERT(RseqBegin(&rs)==1);
+		ASSERT(RseqCommit(&rs, &x, 3)==1);
+		ASSERT(SetThreadAffinity(NOTHREAD, (1u << cpu_cores()) - 1)==0);
+	}
+	ASSERT(RseqRegister(NULL)==0);
+
+	/* Workers share the cores, and all their increments count */
+	memset(rseq_counter, 0, sizeof(rseq_counter));
+	int nworkers = 2*cpu_cores();
+	for(int i=0; i<nworkers; i++)
+		ASSERT(Exec(rseq_worker, 0, NULL)!=NOPROC);
+	for(int i=0; i<nworkers; i++)
+		ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	uintptr_t total = 0;
+	for(unsigned int c=0; c<cpu_cores(); c++)
+		total += rseq_counter[c];
+	ASSERT(total == (uintptr_t)nworkers * RSEQ_INCREMENTS);
+	return 0;
+}
+
+
+/* A child for test_rseq_commit_bounded: it only has to run once */
+static int rseq_flag_setter(int argl, void* args)
+{
+	*(volatile int*)(*(int**)args) = 1;
+	return 0;
+}
+
+BOOT_TEST(test_rseq_commit_bounded,
+	"Test that a thread which never finishes committing a restartable sequence is preempted after a grace period."
+	)
+{
+	/* Everyone shares core 0 */
+	ASSERT(SetThreadAffinity(NOTHREAD, 1)==0);
+
+	rseq_area rs;
+	ASSERT(RseqRegister(&rs)==0);
+	volatile int flag = 0;
+	int* arg = (int*)&flag;
+
+	/* Pretend to be stuck in RseqCommit, until the child runs */
+	rs.committing = 1;
+	ASSERT(Exec(rseq_flag_setter, sizeof(arg), &arg)!=NOPROC);
+	TimerDuration limit = bios_clock() + 2000000;
+	while(!flag && bios_clock() < limit);
+	rs.committing = 0;
+
+	ASSERT(flag);
+	ASSERT(rs.deferred);
+	ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+	ASSERT(RseqRegister(NULL)==0);
+	ASSERT(SetThreadAffinity(NOTHREAD, (1u << cpu_cores()) - 1)==0);
+	return 0;
+}
+
+/*
+  A spinner for test_nice_cpu_share: it sets its nice value, and counts
+  loop iterations between two (shared) points in time.
+ */
+struct nice_spinner {
+	int nice;
+	TimerDuration start, end;
+	unsigned long count;
+};
+
+static int nice_spinner(int argl, void* args)
+{
+	struct nice_spinner* sp = *(struct nice_spinner**)args;
+	int nice;
+
+	ASSERT(GetPriority(NOTHREAD, &nice)==0);
+	ASSERT(nice == 5);	/* inherited */
+	ASSERT(SetPriority(NOTHREAD, sp->nice)==0);
+
+	TimerDuration now;
+	while((now = bios_clock()) < sp->end)
+		if(now >= sp->start) sp->count++;
+	return 0;
+}
+
+BOOT_TEST(test_nice_cpu_share,
+	"Test SetPriority and GetPriority, and that threads with a lower nice value get a larger share of a core."
+	)
+{
+	int nice;
+
+	ASSERT(GetPriority(NOTHREAD, &nice)==0);
+	ASSERT(nice == 0);
+	ASSERT(GetPriority(NOTHREAD, NULL)==-1);
+	ASSERT(GetPriority((Tid_t)&nice, &nice)==-1);
+	ASSERT(SetPriority(NOTHREAD, NICE_MIN-1)==-1);
+	ASSERT(SetPriority(NOTHREAD, NICE_MAX+1)==-1);
+	ASSERT(SetPriority((Tid_t)&nice, 0)==-1);
+	ASSERT(SetPriority(ThreadSelf(), NICE_MAX)==0);
+	ASSERT(GetPriority(ThreadSelf(), &nice)==0);
+	ASSERT(nice == NICE_MAX);
+
+	/* Two spinners, nice 0 and nice 10, compete for core 0 */
+	ASSERT(SetPriority(NOTHREAD, 5)==0);
+	ASSERT(SetThreadAffinity(NOTHREAD, 1)==0);
+
+	TimerDuration start = bios_clock() + 50000;
+	struct nice_spinner sp[2] = {
+		{ .nice = 0, .start = start, .end = start + 500000, .count = 0 },
+		{ .nice = 10, .start = start, .end = start + 500000, .count = 0 }
+	};
+	for(int i=0; i<2; i++) {
+		struct nice_spinner* arg = &sp[i];
+		ASSERT(Exec(nice_spinner, sizeof(arg), &arg)!=NOPROC);
+	}
+	for(int i=0; i<2; i++)
+		ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	/* The weights are 1024 and 110. Other policies (e.g., the MLFQ, selected 
+	   by TINYOS_SCHED) do not share a core by nice value, so only check that 
+	   neither spinner starves. */
+	ASSERT(sp[0].count > 0);
+	ASSERT(sp[1].count > 0);
+	if(sched_policy == SCHED_POLICY_FAIR)
+		ASSERT(sp[0].count > 3 * sp[1].count);
+
+	ASSERT(SetThreadAffinity(NOTHREAD, (1u << cpu_cores()) - 1)==0);
+	ASSERT(SetPriority(NOTHREAD, 0)==0);
+	return 0;
+}
+
+
+/*
+  A child for test_deadline_admission: it asks for half a core, and stays 
+  alive (holding its utilization) until the parent is done counting.
+ */
+struct rt_admission {
+	Mutex mx;
+	CondVar cv;
+	int arrived, admitted, done;
+};
+
+static int rt_admission_child(int argl, void* args)
+{
+	struct rt_admission* ra = *(struct rt_admission**)args;
+	deadline_attr half = { .runtime = 50000, .deadline = 100000, .period = 100000 };
+	int rc = SetDeadline(NOTHREAD, &half);
+
+	Mutex_Lock(&ra->mx);
+	ra->arrived++;
+	if(rc == 0) ra->admitted++;
+	Cond_Broadcast(&ra->cv);
+	while(!ra->done)
+		Cond_Wait(&ra->mx, &ra->cv);
+	Mutex_Unlock(&ra->mx);
+	return 0;
+}
+
+BOOT_TEST(test_deadline_class,
+	"Test SetDeadline and GetDeadline, and the admission control of real-time threads."
+	)
+{
+	deadline_attr attr;
+
+	ASSERT(GetDeadline(NOTHREAD, &attr)==0);
+	ASSERT(attr.runtime == 0 && attr.deadline == 0 && attr.period == 0 && attr.misses == 0);
+	ASSERT(GetDeadline(NOTHREAD, NULL)==-1);
+	ASSERT(GetDeadline((Tid_t)&attr, &attr)==-1);
+
+	deadline_attr bad[] = {
+		{ .runtime = 0, .deadline = 1000, .period = 1000 },
+		{ .runtime = 2000, .deadline = 1000, .period = 1000 },
+		{ .runtime = 1000, .deadline = 2000, .period = 1000 },
+		{ .runtime = 1000, .deadline = 20000000, .period = 20000000 }
+	};
+	for(unsigned i=0; i<sizeof(bad)/sizeof(bad[0]); i++)
+		ASSERT(SetDeadline(NOTHREAD, &bad[i])==-1);
+
+	deadline_attr rt = { .runtime = 1000, .deadline = 5000, .period = 10000 };
+	ASSERT(SetDeadline((Tid_t)&attr, &rt)==-1);
+	ASSERT(SetDeadline(NOTHREAD, &rt)==0);
+	ASSERT(GetDeadline(ThreadSelf(), &attr)==0);
+	ASSERT(attr.runtime == 1000 && attr.deadline == 5000 && attr.period == 10000);
+	ASSERT(SetDeadline(NOTHREAD, NULL)==0);
+	ASSERT(GetDeadline(NOTHREAD, &attr)==0);
+	ASSERT(attr.runtime == 0);
+
+	/* At most 95% of the cores can be reserved; each child asks for half a core */
+	struct rt_admission ra = { MUTEX_INIT, COND_INIT, 0, 0, 0 };
+	struct rt_admission* arg = &ra;
+	int nchildren = 2*cpu_cores();
+	for(int i=0; i<nchildren; i++)
+		ASSERT(Exec(rt_admission_child, sizeof(arg), &arg)!=NOPROC);
+
+	Mutex_Lock(&ra.mx);
+	while(ra.arrived < nchildren)
+		Cond_Wait(&ra.mx, &ra.cv);
+	ASSERT(ra.admitted == cpu_cores()*95/50);
+	ra.done = 1;
+	Cond_Broadcast(&ra.cv);
+	Mutex_Unlock(&ra.mx);
+
+	for(int i=0; i<nchildren; i++)
+		ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	/* Exited threads release their utilization */
+	deadline_attr full = { .runtime = 90000, .deadline = 100000, .period = 100000 };
+	ASSERT(SetDeadline(NOTHREAD, &full)==0);
+	ASSERT(SetDeadline(NOTHREAD, NULL)==0);
+	return 0;
+}
+
+
+/*
+  A spinner for test_batch_class: it leaves the batch class if asked to, 
+  and counts while the parent's window is open.
+ */
+struct batch_spinner {
+	int batch;
+	TimerDuration start, end;
+	unsigned long count;
+};
+
+static int batch_spinner(int argl, void* args)
+{
+	struct batch_spinner* sp = *(struct batch_spinner**)args;
+	int batch;
+
+	ASSERT(GetBatch(NOTHREAD, &batch)==0);
+	ASSERT(batch == 1);	/* inherited */
+	ASSERT(SetBatch(NOTHREAD, sp->batch)==0);
+
+	TimerDuration now;
+	while((now = bios_clock()) < sp->end)
+		if(now >= sp->start) sp->count++;
+	return 0;
+}
+
+BOOT_TEST(test_batch_class,
+	"Test SetBatch and GetBatch, and that batch threads run only when no other thread is ready."
+	)
+{
+	int batch;
+
+	ASSERT(GetBatch(NOTHREAD, &batch)==0);
+	ASSERT(batch == 0);
+	ASSERT(GetBatch(NOTHREAD, NULL)==-1);
+	ASSERT(GetBatch((Tid_t)&batch, &batch)==-1);
+	ASSERT(SetBatch((Tid_t)&batch, 1)==-1);
+	ASSERT(SetBatch(ThreadSelf(), 1)==0);
+	ASSERT(GetBatch(ThreadSelf(), &batch)==0);
+	ASSERT(batch == 1);
+
+	/* A normal and a batch spinner compete for core 0 */
+	ASSERT(SetThreadAffinity(NOTHREAD, 1)==0);
+
+	TimerDuration start = bios_clock() + 50000;
+	struct batch_spinner sp[2] = {
+		{ .batch = 0, .start = start, .end = start + 500000, .count = 0 },
+		{ .batch = 1, .start = start, .end = start + 500000, .count = 0 }
+	};
+	for(int i=0; i<2; i++) {
+		struct batch_spinner* arg = &sp[i];
+		ASSERT(Exec(batch_spinner, sizeof(arg), &arg)!=NOPROC);
+	}
+	for(int i=0; i<2; i++)
+		ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	/* The batch spinner gets the core only after the normal one is done */
+	ASSERT(sp[0].count > 0);
+	ASSERT(sp[0].count > 10 * sp[1].count);
+
+	ASSERT(SetThreadAffinity(NOTHREAD, (1u << cpu_cores()) - 1)==0);
+	ASSERT(SetBatch(NOTHREAD, 0)==0);
+	ASSERT(GetBatch(NOTHREAD, &batch)==0);
+	ASSERT(batch == 0);
+	return 0;
+}
+
+
+/*
+  A child for test_yield_to: it records the order in which it ran, after
+  the release. The first child publishes its tid and waits for the 
+  release.
+ */
+struct yield_race {
+	Mutex mx;
+	CondVar cv;
+	Tid_t tid;
+	int released;
+	int seq, order[3];
+};
+
+struct yield_racer_arg { struct yield_race* yr; int id; };
+
+static int yield_racer(int argl, void* args)
+{
+	struct yield_race* yr = ((struct yield_racer_arg*)args)->yr;
+	int id = ((struct yield_racer_arg*)args)->id;
+
+	if(id == 0) {
+		Mutex_Lock(&yr->mx);
+		yr->tid = ThreadSelf();
+		Cond_Broadcast(&yr->cv);
+		while(!yr->released)
+			Cond_Wait(&yr->mx, &yr->cv);
+		Mutex_Unlock(&yr->mx);
+	}
+	yr->order[id] = ++yr->seq;
+	return 0;
+}
+
+BOOT_TEST(test_yield_to,
+	"Test that YieldTo gives the core to a ready thread of another process, before the other ready threads."
+	)
+{
+	ASSERT(YieldTo(NOTHREAD)==0);
+	ASSERT(YieldTo(ThreadSelf())==0);
+	ASSERT(YieldTo((Tid_t)&test_yield_to)==-1);
+
+	/* Everyone shares core 0 */
+	ASSERT(SetThreadAffinity(NOTHREAD, 1)==0);
+
+	struct yield_race yr = { MUTEX_INIT, COND_INIT, NOTHREAD, 0, 0, {0,0,0} };
+	struct yield_racer_arg arg = { &yr, 0 };
+
+	/* The first child becomes ready, and then two more children are created */
+	ASSERT(Exec(yield_racer, sizeof(arg), &arg)!=NOPROC);
+	Mutex_Lock(&yr.mx);
+	while(yr.tid == NOTHREAD)
+		Cond_Wait(&yr.mx, &yr.cv);
+	yr.released = 1;
+	Cond_Broadcast(&yr.cv);
+	Mutex_Unlock(&yr.mx);
+	for(arg.id=1; arg.id<3; arg.id++)
+		ASSERT(Exec(yield_racer, sizeof(arg), &arg)!=NOPROC);
+
+	/* The first child runs first, although the others woke up later */
+	ASSERT(YieldTo(yr.tid)==0);
+	for(int i=0; i<3; i++)
+		ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+	ASSERT(yr.order[0] == 1);
+
+	/* The first child has exited */
+	ASSERT(YieldTo(yr.tid)==-1);
+
+	ASSERT(SetThreadAffinity(NOTHREAD, (1u << cpu_cores()) - 1)==0);
+	return 0;
+}
+
+
+/*
+  A thread of test_yield_to_busy: it publishes its tid, and then yields 
+  to each of the other threads in turn, while they all keep the cores 
+  busy. Nobody exits before everyone is done, so the targets exist.
+ */
+#define YIELD_STORM_ROUNDS 2000
+
+struct yield_storm {
+	Tid_t tid[2*MAX_CORES];
+	unsigned int n;
+	volatile unsigned int started, finished;
+};
+
+struct yield_stormer_arg { struct yield_storm* ys; unsigned int id; };
+
+static int yield_stormer(int argl, void* args)
+{
+	struct yield_storm* ys = ((struct yield_stormer_arg*)args)->ys;
+	unsigned int id = ((struct yield_stormer_arg*)args)->id;
+
+	ys->tid[id] = ThreadSelf();
+	__atomic_fetch_add(&ys->started, 1, __ATOMIC_SEQ_CST);
+	while(ys->started < ys->n)
+		YieldTo(NOTHREAD);
+
+	for(unsigned int r=0; r<YIELD_STORM_ROUNDS; r++) {
+		for(volatile int d=0; d<50; d++);
+		ASSERT(YieldTo(ys->tid[(id + 1 + r % (ys->n - 1)) % ys->n])==0);
+	}
+
+	__atomic_fetch_add(&ys->finished, 1, __ATOMIC_SEQ_CST);
+	while(ys->finished < ys->n)
+		YieldTo(NOTHREAD);
+	return 0;
+}
+
+BOOT_TEST(test_yield_to_busy,
+	"Test YieldTo between threads of different processes, while all cores are busy and the targets are selected or stolen by other cores."
+	)
+{
+	/* Two threads per core, so that some of them wait in the queues */
+	struct yield_storm ys = { .n = 2*cpu_cores(), .started = 0, .finished = 0 };
+	struct yield_stormer_arg arg = { &ys, 0 };
+	for(arg.id=0; arg.id<ys.n; arg.id++)
+		ASSERT(Exec(yield_stormer, sizeof(arg), &arg)!=NOPROC);
+
+	for(unsigned int i=0; i<ys.n; i++) {
+		int status;
+		ASSERT(WaitChild(NOPROC, &status)!=NOPROC);
+		ASSERT(status == 0);
+	}
+	return 0;
+}
+
+
+/*
+  A worker for test_gang_barrier: it passes the barrier a number of 
+  times, spinning a little in between, and then waits to be released. 
+  The exit status is its gang.
+ */
+struct gang_job {
+	barrier bar;
+	unsigned int n, rounds;
+	volatile unsigned int finished;
+	volatile int released;
+};
+
+static int gang_worker(int argl, void* args)
+{
+	struct gang_job* job = *(struct gang_job**)args;
+	int gang;
+
+	for(unsigned int r=0; r<job->rounds; r++) {
+		TimerDuration t = bios_clock() + 100;
+		while(bios_clock() < t);
+		BarrierSync(&job->bar, job->n);
+	}
+	__atomic_fetch_add(&job->finished, 1, __ATOMIC_SEQ_CST);
+	while(!job->released)
+		Sleep(1000);
+	if(GetGang(NOTHREAD, &gang)) return -1;
+	return gang;
+}
+
+/* A rival of the gang in test_gang_barrier: it keeps a core busy until released */
+static int gang_rival(int argl, void* args)
+{
+	struct gang_job* job = *(struct gang_job**)args;
+	while(!job->released);
+	return 0;
+}
+
+/* Return the index of pid in pids[0..n-1], or -1 */
+static int find_pid(Pid_t pid, Pid_t* pids, unsigned int n)
+{
+	for(unsigned int i=0; i<n; i++)
+		if(pids[i] == pid) return i;
+	return -1;
+}
+
+BOOT_TEST(test_gang_barrier,
+	"Test SetGang and GetGang, that new processes inherit the gang, that a gang passes a barrier, and that it is co-scheduled."
+	)
+{
+	int gang;
+
+	ASSERT(GetGang(NOTHREAD, &gang)==0);
+	ASSERT(gang == 0);
+	ASSERT(GetGang(NOTHREAD, NULL)==-1);
+	ASSERT(GetGang((Tid_t)&gang, &gang)==-1);
+	ASSERT(SetGang((Tid_t)&gang, 1)==-1);
+	ASSERT(SetGang(NOTHREAD, -1)==-1);
+	ASSERT(SetGang(ThreadSelf(), 7)==0);
+	ASSERT(GetGang(ThreadSelf(), &gang)==0);
+	ASSERT(gang == 7);
+
+	/* One more worker than cores, so that some of them wait for a core */
+	struct gang_job job = { BARRIER_INIT, cpu_cores()+1, 200, 0, 1 };
+	struct gang_job* arg = &job;
+	for(unsigned int i=0; i<job.n; i++)
+		ASSERT(Exec(gang_worker, sizeof(arg), &arg)!=NOPROC);
+	ASSERT(SetGang(NOTHREAD, 0)==0);
+	ASSERT(GetGang(NOTHREAD, &gang)==0);
+	ASSERT(gang == 0);
+
+	for(unsigned int i=0; i<job.n; i++) {
+		int status;
+		ASSERT(WaitChild(NOPROC, &status)!=NOPROC);
+		ASSERT(status == 7);
+	}
+
+	/* 
+	  The gang is co-scheduled only if the host has a cpu for every core.
+	  Then, a gang of a worker per core competes with a rival per core: a 
+	  worker which passes the barrier preempts a rival at once, rather than 
+	  waiting for a core, and the workers are never preempted on their own.
+	 */
+	if(cpu_cores() == 1 || cpu_cores() > cpu_physical_cores())
+		return 0;
+
+	struct gang_job cojob = { BARRIER_INIT, cpu_cores(), 200, 0, 0 };
+	arg = &cojob;
+	Pid_t rival[MAX_CORES], worker[MAX_CORES];
+	for(unsigned int i=0; i<cojob.n; i++)
+		ASSERT((rival[i] = Exec(gang_rival, sizeof(arg), &arg))!=NOPROC);
+	ASSERT(SetGang(NOTHREAD, 7)==0);
+	for(unsigned int i=0; i<cojob.n; i++)
+		ASSERT((worker[i] = Exec(gang_worker, sizeof(arg), &arg))!=NOPROC);
+	ASSERT(SetGang(NOTHREAD, 0)==0);
+	while(cojob.finished < cojob.n)
+		Sleep(1000);
+
+	/* Count the preemptions, while everyone is still alive */
+	Fid_t f = OpenSchedInfo();
+	ASSERT(f!=NOFILE);
+	schedinfo info;
+	unsigned long rival_preempts = 0, worker_preempts = 0;
+	while(Read(f, (char*)&info, sizeof(info)) == sizeof(info)) {
+		if(find_pid(info.pid, rival, cojob.n) >= 0)
+			rival_preempts += info.hist.cause[SCHED_PREEMPT];
+		if(find_pid(info.pid, worker, cojob.n) >= 0)
+			worker_preempts += info.hist.cause[SCHED_PREEMPT];
+	}
+	ASSERT(Close(f)==0);
+
+	cojob.released = 1;
+	for(unsigned int i=0; i<2*cojob.n; i++) {
+		int status;
+		Pid_t pid = WaitChild(NOPROC, &status);
+		ASSERT(pid!=NOPROC);
+		ASSERT(status == (find_pid(pid, worker, cojob.n) >= 0 ? 7 : 0));
+	}
+	ASSERT(rival_preempts > 0);
+	ASSERT(worker_preempts == 0);
+	return 0;
+}
+
+
+/*
+  A waiter for test_broadcast_wakes_all: odd waiters wait with a timeout,
+  which never expires. The exit status is the result of the wait.
+ */
+struct bcast_group {
+	Mutex mx;
+	CondVar ready, go;
+	int waiting, released;
+};
+
+static int bcast_waiter(int argl, void* args)
+{
+	struct bcast_group* bg = *(struct bcast_group**)args;
+	int signalled;
+
+	Mutex_Lock(&bg->mx);
+	bg->waiting++;
+	Cond_Signal(&bg->ready);
+	if(argl & 1)
+		signalled = Cond_TimedWait(&bg->mx, &bg->go, 600*1000);
+	else
+		signalled = Cond_Wait(&bg->mx, &bg->go);
+	ASSERT(bg->released);
+	Mutex_Unlock(&bg->mx);
+	return signalled;
+}
+
+BOOT_TEST(test_broadcast_wakes_all,
+	"Test that Cond_Broadcast wakes up many waiters, with and without a timeout, and signals each one."
+	)
+{
+	struct bcast_group bg = { MUTEX_INIT, COND_INIT, COND_INIT, 0, 0 };
+	struct bcast_group* arg = &bg;
+	const int nwaiters = 150;	/* more than one batch of wakeups */
+
+	for(int i=0; i<nwaiters; i++)
+		ASSERT(Exec(bcast_waiter, sizeof(arg), &arg)!=NOPROC);
+
+	Mutex_Lock(&bg.mx);
+	while(bg.waiting < nwaiters)
+		Cond_Wait(&bg.mx, &bg.ready);
+	bg.released = 1;
+	Cond_Broadcast(&bg.go);
+	Mutex_Unlock(&bg.mx);
+
+	for(int i=0; i<nwaiters; i++) {
+		int status;
+		ASSERT(WaitChild(NOPROC, &status)!=NOPROC);
+		ASSERT(status == 1);
+	}
+	return 0;
+}
+
+/*
+  A spinner for test_cpu_quota: it counts loop iterations between two 
+  (shared) points in time, in the cpu group it inherited.
+ */
+struct quota_spinner {
+	int group;
+	TimerDuration start, end;
+	unsigned long count;
+};
+
+static int quota_spinner(int argl, void* args)
+{
+	struct quota_spinner* sp = *(struct quota_spinner**)args;
+	int group;
+
+	ASSERT(GetCpuGroup(NOTHREAD, &group)==0);
+	ASSERT(group == sp->group);
+
+	TimerDuration now;
+	while((now = bios_clock()) < sp->end)
+		if(now >= sp->start) sp->count++;
+	return 0;
+}
+
+BOOT_TEST(test_cpu_quota,
+	"Test SetCpuGroup, SetCpuQuota and GetCpuQuota, and that the threads of a group with a quota are throttled."
+	)
+{
+	int group;
+	cpu_quota q;
+
+	ASSERT(GetCpuGroup(NOTHREAD, &group)==0);
+	ASSERT(group == 0);
+	ASSERT(GetCpuGroup(NOTHREAD, NULL)==-1);
+	ASSERT(GetCpuGroup((Tid_t)&group, &group)==-1);
+	ASSERT(SetCpuGroup(NOTHREAD, -1)==-1);
+	ASSERT(SetCpuGroup(NOTHREAD, CPU_GROUPS)==-1);
+	ASSERT(SetCpuGroup((Tid_t)&group, 1)==-1);
+
+	ASSERT(GetCpuQuota(-1, &q)==-1);
+	ASSERT(GetCpuQuota(CPU_GROUPS, &q)==-1);
+	ASSERT(GetCpuQuota(1, NULL)==-1);
+	ASSERT(GetCpuQuota(1, &q)==0);
+	ASSERT(q.quota == 0 && q.total == 0 && q.throttles == 0);
+
+	q = (cpu_quota) { .quota = 20000, .period = 100000 };
+	ASSERT(SetCpuQuota(0, &q)==-1);
+	ASSERT(SetCpuQuota(CPU_GROUPS, &q)==-1);
+	q.period = 100;
+	ASSERT(SetCpuQuota(1, &q)==-1);
+	q.period = 100000;
+	q.quota = 0;
+	ASSERT(SetCpuQuota(1, &q)==-1);
+	q.quota = 100000 * cpu_cores() + 1;
+	ASSERT(SetCpuQuota(1, &q)==-1);
+	q.quota = 20000;
+	ASSERT(SetCpuQuota(1, &q)==0);
+	ASSERT(GetCpuQuota(1, &q)==0);
+	ASSERT(q.quota == 20000 && q.period == 100000);
+
+	/* Two spinners of group 1 (with 20% of a core) and one of group 0 compete for core 0 */
+	ASSERT(SetThreadAffinity(NOTHREAD, 1)==0);
+
+	TimerDuration start = bios_clock() + 50000;
+	struct quota_spinner sp[3] = {
+		{ .group = 1, .start = start, .end = start + 500000, .count = 0 },
+		{ .group = 1, .start = start, .end = start + 500000, .count = 0 },
+		{ .group = 0, .start = start, .end = start + 500000, .count = 0 }
+	};
+	for(int i=0; i<3; i++) {
+		struct quota_spinner* arg = &sp[i];
+		ASSERT(SetCpuGroup(NOTHREAD, sp[i].group)==0);
+		ASSERT(Exec(quota_spinner, sizeof(arg), &arg)!=NOPROC);
+	}
+	for(int i=0; i<3; i++)
+		ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+
+	/* Group 1 used about 110 msec in 550 msec, and the rest went to group 0 */
+	ASSERT(GetCpuQuota(1, &q)==0);
+	ASSERT(q.total > 50000 && q.total < 200000);
+	ASSERT(q.usage <= q.total);
+	ASSERT(q.throttles > 0 && q.throttled_time > 0);
+	ASSERT(sp[0].count > 0 && sp[1].count > 0);
+	ASSERT(sp[2].count > 2 * (sp[0].count + sp[1].count));
+
+	/* Without the quota, the counters remain */
+	ASSERT(SetCpuQuota(1, NULL)==0);
+	ASSERT(GetCpuQuota(1, &q)==0);
+	ASSERT(q.quota == 0 && q.period == 0 && q.usage == 0);
+	ASSERT(q.total > 50000 && q.throttles > 0);
+
+	ASSERT(SetThreadAffinity(NOTHREAD, (1u << cpu_cores()) - 1)==0);
+	return 0;
+}
+
+
 TEST_SUITE(user_tests, 
 	"These are tests defined by the user."
 	)
 {
 	&dummy_user_test,
+	&test_timeouts_expire_in_order,
+	&test_exec_stack_size,
+	&test_thread_affinity,
+	&test_thread_stats,
+	&test_sched_info,
+	&test_sleep_precise,
+	&test_rseq_counters,
+	&test_rseq_commit_bounded,
+	&test_nice_cpu_share,
+	&test_deadline_class,
+	&test_batch_class,
+	&test_gang_barrier,
+	&test_yield_to,
+	&test_yield_to_busy,
+	&test_broadcast_wakes_all,
+	&test_cpu_quota,
 	NULL
 };
 